@@ -0,0 +1,280 @@
+#pragma once
+
+#include "k-means.hpp"
+#include "pixel-k-means.hpp"
+#include "quantize.hpp"
+#include <vector>
+#include <deque>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+#include <chrono>
+#include <cassert>
+#include <omp.h>
+
+
+// color quantization of a whole batch of images (a folder of thousands of them), as a pipeline of three stages that run
+// at the same time, each with its own worker threads:
+//
+//   decode (caller's function) -> fit (pixel iterators, see pixel-k-means.hpp) -> remap + encode (caller's function)
+//
+// so while one image is being fitted the next ones are being decoded and the last ones written, and no core waits on
+// I/O. Stages are connected by queues of at most queueSize images; a stage that gets ahead blocks on a full queue
+// (backpressure) instead of piling up images, and the decoded pixels of every image in the pipeline together are kept
+// under maxBytes (decoders wait before handing over an image that would go past it, so at most decodeWorkers more images
+// can be in memory). Every image is fitted by a single fit worker with threadsPerFit OpenMP threads, so cores can be
+// split between many small fits at once or a few parallel ones.
+//
+// each stage counts its images, the time it spent working, waiting for an image and waiting for room in the next queue,
+// so the slowest stage shows up as the one that never waits for input while the others do. Give it more workers.
+// Images are encoded in whatever order they finish.
+
+
+// one image going through the pipeline
+struct QuantizeJob {
+	int index = 0; // in the batch
+	int width = 0, height = 0, channels = 0;
+	std::vector<unsigned char> pixels; // interleaved like stb_image gives them, quantized in place before encode
+
+	Dataset centroids;
+	int iterations = 0;
+
+	int numPixels() const { return width * height; }
+	size_t bytes() const { return pixels.size(); }
+};
+
+
+// blocking queue of at most `capacity` items. pop returns false once the queue was closed and is empty
+template <class T>
+struct BoundedQueue {
+
+	std::mutex mutex;
+	std::condition_variable notFull, notEmpty;
+	std::deque<T> items;
+	const size_t capacity;
+	bool closed = false;
+
+	explicit BoundedQueue(size_t capacity) : capacity(std::max<size_t>(capacity, 1)) {}
+
+	void push(T&& item) {
+		std::unique_lock<std::mutex> lock(mutex);
+		notFull.wait(lock, [&] { return items.size() < capacity; });
+		items.push_back(std::move(item));
+		notEmpty.notify_one();
+	}
+
+	bool pop(T& item) {
+		std::unique_lock<std::mutex> lock(mutex);
+		notEmpty.wait(lock, [&] { return !items.empty() || closed; });
+		if (items.empty()) return false;
+
+		item = std::move(items.front());
+		items.pop_front();
+		notFull.notify_one();
+		return true;
+	}
+
+	// after the last push
+	void close() {
+		std::lock_guard<std::mutex> lock(mutex);
+		closed = true;
+		notEmpty.notify_all();
+	}
+};
+
+
+// bytes of pixels in the pipeline. An image is always let in when the pipeline is empty, so one bigger than the whole
+// budget still goes through (alone)
+struct MemoryBudget {
+
+	std::mutex mutex;
+	std::condition_variable released;
+	const size_t maxBytes;
+	size_t used = 0;
+
+	explicit MemoryBudget(size_t maxBytes) : maxBytes(maxBytes) {}
+
+	void acquire(size_t bytes) {
+		std::unique_lock<std::mutex> lock(mutex);
+		released.wait(lock, [&] { return used == 0 || used + bytes <= maxBytes; });
+		used += bytes;
+	}
+
+	void release(size_t bytes) {
+		std::lock_guard<std::mutex> lock(mutex);
+		used -= bytes;
+		released.notify_all();
+	}
+};
+
+
+struct StageStats {
+	int workers = 0;
+	long long images = 0;
+	double busyMs = 0.0; // working, summed over workers
+	double waitInMs = 0.0; // waiting for an image (or, for decode, for memory)
+	double waitOutMs = 0.0; // waiting for room in the next queue
+
+	// images per second of work, for one worker
+	double imagesPerSecond() const {
+		return busyMs > 0.0 ? images / busyMs * 1000.0 : 0.0;
+	}
+};
+
+
+struct BatchQuantizer {
+
+	int k;
+
+	// worker threads of each stage, and the OpenMP threads of every fit
+	int decodeWorkers = 1, fitWorkers = 1, encodeWorkers = 1;
+	int threadsPerFit = 1;
+
+	int queueSize = 4; // images waiting between two stages
+	size_t maxBytes = size_t(1) << 30; // decoded pixels in the pipeline
+
+	int maxIter = 100;
+	unsigned seed = 123; // image i is seeded with seed + i, so results don't depend on the workers
+
+	// fills width, height, channels (1 ~ 4) and pixels of the image with this index, false if it can't
+	std::function<bool(QuantizeJob& job)> decode;
+
+	// gets the quantized image, false if it can't be written
+	std::function<bool(const QuantizeJob& job)> encode;
+
+	// of the last run
+	StageStats decodeStats, fitStats, encodeStats;
+	std::atomic<int> failed{0};
+	double wallMs = 0.0;
+
+	BatchQuantizer(int k) : k(k) {}
+
+	// quantizes images [0, count) and returns how many were written
+	int run(int count) {
+		assert(decodeWorkers > 0 && fitWorkers > 0 && encodeWorkers > 0 && threadsPerFit > 0);
+
+		using Clock = std::chrono::steady_clock;
+		const auto start = Clock::now();
+
+		BoundedQueue<QuantizeJob> decoded(queueSize), fitted(queueSize);
+		MemoryBudget budget(maxBytes);
+
+		std::atomic<int> next{0};
+		std::atomic<int> decodersLeft{decodeWorkers}, fittersLeft{fitWorkers};
+
+		decodeStats = { decodeWorkers };
+		fitStats = { fitWorkers };
+		encodeStats = { encodeWorkers };
+		failed = 0;
+
+		std::mutex statsMutex;
+		auto since = [](Clock::time_point t) { return std::chrono::duration<double, std::milli>(Clock::now() - t).count(); };
+		auto add = [&](StageStats& stats, const StageStats& mine) {
+			std::lock_guard<std::mutex> lock(statsMutex);
+			stats.images += mine.images;
+			stats.busyMs += mine.busyMs;
+			stats.waitInMs += mine.waitInMs;
+			stats.waitOutMs += mine.waitOutMs;
+		};
+
+		auto decodeWorker = [&]() {
+			StageStats mine;
+
+			for (int i; (i = next++) < count;) {
+				QuantizeJob job;
+				job.index = i;
+
+				auto t = Clock::now();
+				const bool ok = decode(job) && job.channels >= 1 && job.channels <= 4 && job.bytes() == (size_t) job.numPixels() * job.channels;
+				mine.busyMs += since(t);
+
+				if (!ok) {
+					++failed;
+					continue;
+				}
+
+				t = Clock::now();
+				budget.acquire(job.bytes());
+				mine.waitInMs += since(t);
+
+				t = Clock::now();
+				decoded.push(std::move(job));
+				mine.waitOutMs += since(t);
+				++mine.images;
+			}
+
+			add(decodeStats, mine);
+			if (--decodersLeft == 0) decoded.close();
+		};
+
+		auto fitWorker = [&]() {
+			StageStats mine;
+			omp_set_num_threads(threadsPerFit); // only for this thread's parallel regions
+
+			QuantizeJob job;
+			for (;;) {
+				auto t = Clock::now();
+				if (!decoded.pop(job)) break;
+				mine.waitInMs += since(t);
+
+				t = Clock::now();
+				KMeans model(k, seed + job.index);
+				model.initializeCentroids(PixelView(job.pixels.data(), job.numPixels(), job.channels));
+
+				job.iterations = threadsPerFit > 1 ? model.fit<ParallelPixelLloydIteration>(maxIter) : model.fit<PixelLloydIteration>(maxIter);
+				job.centroids = std::move(model.centroids);
+				mine.busyMs += since(t);
+
+				t = Clock::now();
+				fitted.push(std::move(job));
+				mine.waitOutMs += since(t);
+				++mine.images;
+			}
+
+			add(fitStats, mine);
+			if (--fittersLeft == 0) fitted.close();
+		};
+
+		auto encodeWorker = [&]() {
+			StageStats mine;
+			std::vector<int> labels;
+
+			QuantizeJob job;
+			for (;;) {
+				auto t = Clock::now();
+				if (!fitted.pop(job)) break;
+				mine.waitInMs += since(t);
+
+				t = Clock::now();
+				const PixelView px(job.pixels.data(), job.numPixels(), job.channels);
+				labels.resize(px.size());
+
+				KMeans model(k);
+				model.centroids = job.centroids;
+				model.predict(px, labels.data(), false);
+				quantizePixels(job.centroids, labels.data(), px.size(), job.pixels.data(), false);
+
+				if (encode(job)) ++mine.images;
+				else ++failed;
+				mine.busyMs += since(t);
+
+				budget.release(job.bytes());
+			}
+
+			add(encodeStats, mine);
+		};
+
+		std::vector<std::thread> workers;
+		for (int w = 0; w < decodeWorkers; ++w) workers.emplace_back(decodeWorker);
+		for (int w = 0; w < fitWorkers; ++w) workers.emplace_back(fitWorker);
+		for (int w = 0; w < encodeWorkers; ++w) workers.emplace_back(encodeWorker);
+
+		for (std::thread& worker : workers) worker.join();
+
+		wallMs = since(start);
+		return encodeStats.images;
+	}
+};
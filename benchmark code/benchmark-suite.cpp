@@ -0,0 +1,755 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <chrono>
+#include <random>
+#include <regex>
+#include <cmath>
+#include <cstdlib>
+#include <algorithm>
+#include <functional>
+
+#include "k-means.hpp"
+#include "parallel-k-means.hpp"
+#include "SIMD-k-means.hpp"
+#include "parallel-SIMD-k-means.hpp"
+#include "hamerly-k-means.hpp"
+#include "elkan-k-means.hpp"
+#include "kd-tree-k-means.hpp"
+#include "gemm-k-means.hpp"
+#include "spherical-k-means.hpp"
+#include "pixel-k-means.hpp"
+#include "half-k-means.hpp"
+#include "dataset-file.hpp"
+
+#ifdef KMEANS_HAVE_STB
+#define STB_IMAGE_IMPLEMENTATION
+#include "STB/stb_image.h"
+#endif
+
+using namespace std;
+
+
+// non-interactive benchmark of every iterator. Sweeps over N, D, K and number of threads on synthetic data or on a
+// file, times Lloyd iterations from the same initial centroids (warmup runs are discarded, the rest give mean, stddev,
+// median and min of the time per iteration), and writes the results as JSON and/or CSV. Given a JSON written by an
+// earlier run, it compares every result with it and exits with 2 if anything got slower than the tolerance allows.
+//
+// usage: benchmark-suite [options]
+//   --data blobs|uniform|embeddings|<file.kmd>|<image>   what to cluster (default blobs; images need stb_image)
+//   --n 100000,1000000   --d 3   --k 4,16,64   --threads 1,2,4 (0 = all cores)
+//   --methods all|<name>,<name>...  (--list shows the names)
+//   --max-iter 20   --warmup 1   --reps 5   --seed 123
+//   --collapse                       fit the distinct points with weights (see collapseDuplicates)
+//                                    (the pixel methods only run on images, without --collapse)
+//                                    (the half methods don't run with --collapse, and also print how many points they
+//                                    label like parallel-simd)
+//   --json <file>   --csv <file>     write the results
+//   --baseline <file.json>   --tolerance 0.1   flag results more than 10% slower than the baseline
+//
+// e.g. benchmark-suite --k 4,16,64,256 --methods parallel-simd,parallel-hamerly,parallel-kdtree --json base.json
+// and later the same command with --baseline base.json instead
+
+
+double millisecondsSince(chrono::high_resolution_clock::time_point start) {
+    return chrono::duration<double, milli>(chrono::high_resolution_clock::now() - start).count();
+}
+
+
+
+/********************************************************************
+*                                                                   *
+*                            iterators                              *
+*                                                                   *
+********************************************************************/
+
+
+struct Method {
+    string name;
+    bool parallel; // whether the number of threads matters
+    function<unique_ptr<LloydIteration>(const DatasetView&, const float*)> make;
+    bool pixels = false; // needs 8 bit points (see isPixels)
+    bool half = false; // stores the points in 16 bits (in `format`), see labelAgreement
+    HalfFormat format = HalfFormat::Float16;
+};
+
+// args go to the constructor of the iterator, after the points and weights
+template <class Iterator, typename... Args>
+Method method(const string& name, bool parallel, Args... args) {
+    return { name, parallel, [=](const DatasetView& pts, const float* weights) -> unique_ptr<LloydIteration> {
+        return make_unique<Iterator>(pts, weights, args...);
+    } };
+}
+
+
+// whether the points can be given to the pixel iterators: at most 4 dimensions, all integers in [0, 255], no weights
+bool isPixels(const DatasetView& points, const float* weights) {
+    if (weights || points.dim() > 4) return false;
+
+    for (int i = 0; i < points.size(); ++i) {
+        for (int d = 0; d < points.dim(); ++d) {
+            float x = points[i][d];
+            if (!(x >= 0.0f && x <= 255.0f && x == floor(x))) return false;
+        }
+    }
+
+    return true;
+}
+
+// the points as 8 bit pixels, owned by the iterator (converting them is part of the setup)
+struct PixelBytes {
+    vector<unsigned char> bytes;
+
+    PixelBytes(const DatasetView& points) : bytes((size_t) points.size() * points.dim()) {
+        for (int i = 0; i < points.size(); ++i) {
+            for (int d = 0; d < points.dim(); ++d) bytes[(size_t) i * points.dim() + d] = (unsigned char) points[i][d];
+        }
+    }
+};
+
+template <class Iterator>
+struct WithPixelBytes : PixelBytes, Iterator {
+    WithPixelBytes(const DatasetView& points) : PixelBytes(points), Iterator(PixelView(bytes.data(), points.size(), points.dim())) {}
+};
+
+template <class Iterator>
+Method pixelMethod(const string& name, bool parallel) {
+    return { name, parallel, [](const DatasetView& pts, const float*) -> unique_ptr<LloydIteration> {
+        return make_unique<WithPixelBytes<Iterator>>(pts);
+    }, true };
+}
+
+// the points in 16 bits, owned by the iterator (converting them is part of the setup)
+struct HalfBytes {
+    HalfPoints half;
+
+    HalfBytes(const DatasetView& points, HalfFormat format) : half(points, format) {}
+};
+
+template <class Iterator>
+struct WithHalfBytes : HalfBytes, Iterator {
+    WithHalfBytes(const DatasetView& points, HalfFormat format) : HalfBytes(points, format), Iterator(half.view()) {}
+};
+
+template <class Iterator>
+Method halfMethod(const string& name, bool parallel, HalfFormat format) {
+    Method m = { name, parallel, [=](const DatasetView& pts, const float*) -> unique_ptr<LloydIteration> {
+        return make_unique<WithHalfBytes<Iterator>>(pts, format);
+    } };
+    m.half = true;
+    m.format = format;
+    return m;
+}
+
+vector<Method> allMethods() {
+    return {
+        method<BasicLloydIteration>("basic", false),
+        method<ParallelLloydIteration>("parallel", true),
+        method<SIMDLloydIteration>("simd", false),
+        method<ParallelSIMDLloydIteration>("parallel-simd", true),
+        method<HamerlyLloydIteration>("hamerly", false),
+        method<ParallelHamerlyLloydIteration>("parallel-hamerly", true),
+        method<SIMDHamerlyLloydIteration>("simd-hamerly", false),
+        method<ParallelSIMDHamerlyLloydIteration>("parallel-simd-hamerly", true),
+        method<ParallelSIMDHamerlyLloydIteration>("parallel-simd-hamerly-delta", true, 16),
+        method<ElkanLloydIteration<>>("elkan", false),
+        method<ParallelElkanLloydIteration<>>("parallel-elkan", true),
+        method<ParallelElkanLloydIteration<>>("parallel-elkan-delta", true, DEFAULT_MAX_BOUND_BYTES, 16),
+        method<ParallelElkanLloydIteration<HalfBounds>>("parallel-elkan-half", true),
+        method<KdTreeLloydIteration>("kdtree", false),
+        method<ParallelKdTreeLloydIteration>("parallel-kdtree", true),
+        method<GemmLloydIteration>("gemm", false),
+        method<ParallelGemmLloydIteration>("parallel-gemm", true),
+        method<SphericalLloydIteration>("spherical", false),
+        method<ParallelSphericalLloydIteration>("parallel-spherical", true),
+        pixelMethod<PixelLloydIteration>("pixels", false),
+        pixelMethod<ParallelPixelLloydIteration>("parallel-pixels", true),
+        halfMethod<HalfLloydIteration>("half", false, HalfFormat::Float16),
+        halfMethod<ParallelHalfLloydIteration>("parallel-half", true, HalfFormat::Float16),
+        halfMethod<ParallelHalfLloydIteration>("parallel-bfloat16", true, HalfFormat::BFloat16),
+    };
+}
+
+
+
+/********************************************************************
+*                                                                   *
+*                               data                                *
+*                                                                   *
+********************************************************************/
+
+
+// n points around `clusters` random centers in [0, 1)^D
+Dataset gaussianBlobs(int n, int D, int clusters, mt19937& gen) {
+    uniform_real_distribution<float> uniform(0.0f, 1.0f);
+    normal_distribution<float> normal(0.0f, 0.1f);
+
+    Dataset centers(clusters, D);
+    for (int c = 0; c < clusters; ++c) {
+        for (int d = 0; d < D; ++d) centers[c][d] = uniform(gen);
+    }
+
+    Dataset data(n, D);
+    for (int i = 0; i < n; ++i) {
+        int c = gen() % clusters;
+        for (int d = 0; d < D; ++d) data[i][d] = centers[c][d] + normal(gen);
+    }
+
+    return data;
+}
+
+// n points uniform in [0, 1)^D, the worst case for every pruning method
+Dataset uniformPoints(int n, int D, mt19937& gen) {
+    uniform_real_distribution<float> uniform(0.0f, 1.0f);
+
+    Dataset data(n, D);
+    for (int i = 0; i < n; ++i) {
+        for (int d = 0; d < D; ++d) data[i][d] = uniform(gen);
+    }
+
+    return data;
+}
+
+// something that looks like embeddings: blobs in a 16 dimensional space, randomly projected to D dimensions, plus a
+// bit of noise in every dimension
+Dataset embeddings(int n, int D, int clusters, mt19937& gen) {
+    const int latent = min(16, D);
+    normal_distribution<float> normal(0.0f, 1.0f);
+
+    Dataset projection(latent, D);
+    for (int l = 0; l < latent; ++l) {
+        for (int d = 0; d < D; ++d) projection[l][d] = normal(gen) / sqrt((float) latent);
+    }
+
+    Dataset centers(clusters, latent);
+    for (int c = 0; c < clusters; ++c) {
+        for (int l = 0; l < latent; ++l) centers[c][l] = 4.0f * normal(gen);
+    }
+
+    Dataset data(n, D);
+    vector<float> z(latent);
+    for (int i = 0; i < n; ++i) {
+        int c = gen() % clusters;
+        for (int l = 0; l < latent; ++l) z[l] = centers[c][l] + normal(gen);
+
+        for (int d = 0; d < D; ++d) {
+            float x = 0.05f * normal(gen);
+            for (int l = 0; l < latent; ++l) x += z[l] * projection[l][d];
+            data[i][d] = x;
+        }
+    }
+
+    return data;
+}
+
+
+// points given in a file (dataset file or image), loaded once
+struct FileData {
+    Dataset decoded;
+    MappedDataset mapped;
+
+    bool open(const string& src) {
+        if (src.size() > 4 && src.substr(src.size() - 4) == ".kmd") return mapped.open(src.c_str());
+
+#ifdef KMEANS_HAVE_STB
+        int w, h, n;
+        unsigned char *img = stbi_load(src.c_str(), &w, &h, &n, 3);
+        if (img == NULL) return false;
+
+        decoded = Dataset(w * h, 3);
+        for (int i = 0; i < w * h; ++i) {
+            for (int d = 0; d < 3; ++d) decoded[i][d] = (float) img[i * 3 + d];
+        }
+
+        stbi_image_free(img);
+        return true;
+#else
+        cerr << "built without stb_image, only .kmd files can be read (see convert-dataset)\n";
+        return false;
+#endif
+    }
+
+    DatasetView view() const {
+        return mapped.isOpen() ? mapped.view : decoded.view();
+    }
+};
+
+
+// k distinct points of the dataset, chosen with the seed
+Dataset initialCentroids(const DatasetView& points, int k, unsigned seed) {
+    mt19937 gen(seed);
+
+    vector<int> indices(points.size());
+    for (int i = 0; i < points.size(); ++i) indices[i] = i;
+
+    Dataset centroids(k, points.dim());
+    for (int j = 0; j < k; ++j) {
+        int r = j + gen() % (points.size() - j);
+        swap(indices[j], indices[r]);
+        copy(points[indices[j]], points[indices[j]] + points.dim(), centroids[j]);
+    }
+
+    return centroids;
+}
+
+
+
+/********************************************************************
+*                                                                   *
+*                            measuring                              *
+*                                                                   *
+********************************************************************/
+
+
+struct Options {
+    string data = "blobs";
+    vector<int> Ns = { 200000 }, Ds = { 3 }, Ks = { 16 }, threads = { 0 };
+    vector<string> methods = { "all" };
+    int maxIter = 20, warmup = 1, reps = 5;
+    unsigned seed = 123;
+    bool collapse = false;
+    string json, csv, baseline;
+    double tolerance = 0.1;
+};
+
+
+struct Result {
+    string method, data, isa;
+    int N = 0, D = 0, K = 0, threads = 0;
+    bool collapsed = false;
+    int points = 0; // points actually fitted (distinct ones with --collapse)
+    int iterations = 0;
+    double setupMs = 0.0; // constructing the iterator (the kd-tree is built there, for example)
+    double mean = 0.0, stddev = 0.0, median = 0.0, min = 0.0; // milliseconds per iteration
+    double agreement = -1.0; // fraction of points labeled like the float path, only for the half methods
+
+    string key() const {
+        ostringstream out;
+        out << method << "|" << data << "|" << N << "|" << D << "|" << K << "|" << threads << "|" << collapsed << "|" << isa;
+        return out.str();
+    }
+};
+
+
+// the centroids of the last rep are written to last, if it's not null
+Result measure(const Method& m, const DatasetView& points, const float* weights, const Dataset& initial, const Options& options, Dataset* last = nullptr) {
+
+    vector<double> samples;
+    Result result;
+
+    for (int rep = 0; rep < options.warmup + options.reps; ++rep) {
+
+        auto start = chrono::high_resolution_clock::now();
+        unique_ptr<LloydIteration> iterator = m.make(points, weights);
+        double setupMs = millisecondsSince(start);
+
+        Dataset centroids = initial;
+
+        start = chrono::high_resolution_clock::now();
+        int iter = 0;
+        while (iter < options.maxIter) {
+            ++iter;
+            if (iterator->iterate(centroids)) break;
+        }
+        double elapsed = millisecondsSince(start);
+
+        if (rep < options.warmup) continue;
+
+        samples.push_back(elapsed / iter);
+        result.setupMs += setupMs / options.reps;
+        result.iterations = iter;
+        if (last) *last = centroids;
+    }
+
+    double sum = 0.0;
+    for (double s : samples) sum += s;
+    result.mean = sum / samples.size();
+
+    double squares = 0.0;
+    for (double s : samples) squares += (s - result.mean) * (s - result.mean);
+    result.stddev = samples.size() > 1 ? sqrt(squares / (samples.size() - 1)) : 0.0;
+
+    sort(samples.begin(), samples.end());
+    result.min = samples.front();
+    result.median = samples.size() % 2 ? samples[samples.size() / 2] : 0.5 * (samples[samples.size() / 2 - 1] + samples[samples.size() / 2]);
+
+    return result;
+}
+
+
+
+// labels of parallel-simd after the iterations measure does from the initial centroids
+vector<int> floatLabels(const DatasetView& points, const Dataset& initial, const Options& options) {
+    ParallelSIMDLloydIteration iterator(points);
+    Dataset centroids = initial;
+
+    for (int iter = 0; iter < options.maxIter; ++iter) {
+        if (iterator.iterate(centroids)) break;
+    }
+
+    KMeans model(centroids.size());
+    model.centroids = centroids;
+
+    vector<int> labels(points.size());
+    model.predict(points, labels.data());
+    return labels;
+}
+
+// fraction of points that the centroids fitted on 16 bit points give the same label as the float path, each model
+// labeling its own copy of the points
+double labelAgreement(const DatasetView& points, const Dataset& centroids, HalfFormat format, const vector<int>& reference) {
+    const HalfPoints half(points, format);
+
+    KMeans model(centroids.size());
+    model.centroids = centroids;
+
+    vector<int> labels(points.size());
+    model.predict(half.view(), labels.data());
+
+    long long same = 0;
+    for (int i = 0; i < points.size(); ++i) same += labels[i] == reference[i];
+    return points.size() ? (double) same / points.size() : 1.0;
+}
+
+
+
+/********************************************************************
+*                                                                   *
+*                              output                               *
+*                                                                   *
+********************************************************************/
+
+
+bool writeJSON(const string& dst, const vector<Result>& results) {
+    ofstream out(dst);
+
+    out << "{\n  \"isa\": \"" << isaName(currentISA()) << "\",\n  \"results\": [\n";
+    for (size_t r = 0; r < results.size(); ++r) {
+        const Result& res = results[r];
+        out << "    {\"method\": \"" << res.method << "\", \"data\": \"" << res.data << "\", \"isa\": \"" << res.isa << "\", "
+            << "\"N\": " << res.N << ", \"D\": " << res.D << ", \"K\": " << res.K << ", \"threads\": " << res.threads << ", "
+            << "\"collapsed\": " << res.collapsed << ", \"points\": " << res.points << ", \"iterations\": " << res.iterations << ", "
+            << "\"setupMs\": " << res.setupMs << ", \"mean\": " << res.mean << ", \"stddev\": " << res.stddev << ", "
+            << "\"median\": " << res.median << ", \"min\": " << res.min << ", \"agreement\": " << res.agreement << "}" << (r + 1 < results.size() ? "," : "") << "\n";
+    }
+    out << "  ]\n}\n";
+
+    return out.good();
+}
+
+bool writeCSV(const string& dst, const vector<Result>& results) {
+    ofstream out(dst);
+
+    out << "method,data,isa,N,D,K,threads,collapsed,points,iterations,setupMs,mean,stddev,median,min,agreement\n";
+    for (const Result& res : results) {
+        out << res.method << "," << res.data << "," << res.isa << "," << res.N << "," << res.D << "," << res.K << ","
+            << res.threads << "," << res.collapsed << "," << res.points << "," << res.iterations << "," << res.setupMs << ","
+            << res.mean << "," << res.stddev << "," << res.median << "," << res.min << "," << res.agreement << "\n";
+    }
+
+    return out.good();
+}
+
+
+// reads the results of a file written by writeJSON (every result is a flat object on its own line)
+bool readJSON(const string& src, vector<Result>& results) {
+    ifstream in(src);
+    if (!in) return false;
+
+    const regex field("\"(\\w+)\": (\"([^\"]*)\"|[-+0-9.eE]+)");
+
+    string line;
+    while (getline(in, line)) {
+        if (line.find("\"method\"") == string::npos) continue;
+
+        map<string, string> values;
+        for (sregex_iterator it(line.begin(), line.end(), field), end; it != end; ++it) {
+            values[(*it)[1]] = (*it)[3].matched ? (*it)[3].str() : (*it)[2].str();
+        }
+
+        Result res;
+        res.method = values["method"];
+        res.data = values["data"];
+        res.isa = values["isa"];
+        res.N = atoi(values["N"].c_str());
+        res.D = atoi(values["D"].c_str());
+        res.K = atoi(values["K"].c_str());
+        res.threads = atoi(values["threads"].c_str());
+        res.collapsed = atoi(values["collapsed"].c_str());
+        res.points = atoi(values["points"].c_str());
+        res.iterations = atoi(values["iterations"].c_str());
+        res.setupMs = atof(values["setupMs"].c_str());
+        res.mean = atof(values["mean"].c_str());
+        res.stddev = atof(values["stddev"].c_str());
+        res.median = atof(values["median"].c_str());
+        res.min = atof(values["min"].c_str());
+        res.agreement = values.count("agreement") ? atof(values["agreement"].c_str()) : -1.0;
+        results.push_back(res);
+    }
+
+    return true;
+}
+
+
+// compares medians with the baseline, returns the number of regressions
+int compareWithBaseline(const vector<Result>& results, const vector<Result>& baseline, double tolerance) {
+
+    map<string, Result> byKey;
+    for (const Result& res : baseline) byKey[res.key()] = res;
+
+    int regressions = 0, compared = 0;
+
+    cout << "\ncomparison with baseline (median ms per iteration, tolerance " << 100.0 * tolerance << "%):\n";
+    for (const Result& res : results) {
+        auto it = byKey.find(res.key());
+        if (it == byKey.end()) {
+            cout << "  " << res.key() << ": not in baseline\n";
+            continue;
+        }
+
+        ++compared;
+        double ratio = res.median / it->second.median;
+
+        const char* verdict = "ok";
+        if (ratio > 1.0 + tolerance) {
+            verdict = "REGRESSION";
+            ++regressions;
+        } else if (ratio < 1.0 - tolerance) {
+            verdict = "faster";
+        }
+
+        cout << "  " << res.key() << ": " << it->second.median << " -> " << res.median << " (" << ratio << "x) " << verdict << "\n";
+    }
+
+    cout << compared << " compared, " << regressions << " regressions\n";
+
+    return regressions;
+}
+
+
+
+/********************************************************************
+*                                                                   *
+*                               main                                *
+*                                                                   *
+********************************************************************/
+
+
+vector<string> split(const string& s) {
+    vector<string> parts;
+    stringstream in(s);
+    string part;
+    while (getline(in, part, ',')) {
+        if (!part.empty()) parts.push_back(part);
+    }
+    return parts;
+}
+
+vector<int> splitInts(const string& s) {
+    vector<int> values;
+    for (const string& part : split(s)) values.push_back(atoi(part.c_str()));
+    return values;
+}
+
+
+bool parseOptions(int argc, char** argv, Options& options) {
+
+    for (int a = 1; a < argc; ++a) {
+        string arg = argv[a];
+        bool hasValue = a + 1 < argc;
+
+        if (arg == "--list") {
+            for (const Method& m : allMethods()) cout << m.name << "\n";
+            exit(0);
+        } else if (arg == "--collapse") {
+            options.collapse = true;
+        } else if (!hasValue) {
+            return false;
+        } else if (arg == "--data") {
+            options.data = argv[++a];
+        } else if (arg == "--n") {
+            options.Ns = splitInts(argv[++a]);
+        } else if (arg == "--d") {
+            options.Ds = splitInts(argv[++a]);
+        } else if (arg == "--k") {
+            options.Ks = splitInts(argv[++a]);
+        } else if (arg == "--threads") {
+            options.threads = splitInts(argv[++a]);
+        } else if (arg == "--methods") {
+            options.methods = split(argv[++a]);
+        } else if (arg == "--max-iter") {
+            options.maxIter = max(1, atoi(argv[++a]));
+        } else if (arg == "--warmup") {
+            options.warmup = max(0, atoi(argv[++a]));
+        } else if (arg == "--reps") {
+            options.reps = max(1, atoi(argv[++a]));
+        } else if (arg == "--seed") {
+            options.seed = strtoul(argv[++a], nullptr, 10);
+        } else if (arg == "--json") {
+            options.json = argv[++a];
+        } else if (arg == "--csv") {
+            options.csv = argv[++a];
+        } else if (arg == "--baseline") {
+            options.baseline = argv[++a];
+        } else if (arg == "--tolerance") {
+            options.tolerance = atof(argv[++a]);
+        } else {
+            return false;
+        }
+    }
+
+    return !options.Ns.empty() && !options.Ds.empty() && !options.Ks.empty() && !options.threads.empty();
+}
+
+
+int main(int argc, char** argv) {
+
+    Options options;
+    if (!parseOptions(argc, argv, options)) {
+        cerr << "usage: " << argv[0] << " [--data blobs|uniform|embeddings|<file>] [--n N,...] [--d D,...] [--k K,...]\n"
+             << "       [--threads T,...] [--methods all|name,...] [--list] [--max-iter 20] [--warmup 1] [--reps 5]\n"
+             << "       [--seed 123] [--collapse] [--json file] [--csv file] [--baseline file.json] [--tolerance 0.1]\n";
+        return 1;
+    }
+
+    vector<Method> methods;
+    for (const Method& m : allMethods()) {
+        if (options.methods == vector<string>{ "all" } || find(options.methods.begin(), options.methods.end(), m.name) != options.methods.end()) {
+            methods.push_back(m);
+        }
+    }
+
+    if (methods.empty()) {
+        cerr << "no methods selected (see --list)\n";
+        return 1;
+    }
+
+    const bool synthetic = options.data == "blobs" || options.data == "uniform" || options.data == "embeddings";
+
+    FileData file;
+    if (!synthetic) {
+        if (!file.open(options.data)) {
+            cerr << "can't read " << options.data << "\n";
+            return 1;
+        }
+
+        // the file decides N (at most) and D
+        options.Ds = { file.view().dim() };
+        for (int& n : options.Ns) n = min(n, file.view().size());
+    }
+
+    const int maxThreads = omp_get_max_threads();
+    const string isa = isaName(currentISA());
+
+    cout << "isa: " << isa << ", max threads: " << maxThreads << "\n";
+
+    vector<Result> results;
+
+    for (int N : options.Ns) {
+        for (int D : options.Ds) {
+
+            Dataset generated;
+            DatasetView points;
+
+            if (synthetic) {
+                mt19937 gen(options.seed);
+                if (options.data == "uniform") generated = uniformPoints(N, D, gen);
+                else if (options.data == "embeddings") generated = embeddings(N, D, 64, gen);
+                else generated = gaussianBlobs(N, D, 64, gen);
+                points = generated.view();
+            } else {
+                points = file.view().slice(0, N);
+            }
+
+            WeightedPoints distinct;
+            const float* weights = nullptr;
+            DatasetView fitted = points;
+
+            if (options.collapse) {
+                distinct = collapseDuplicates(points);
+                fitted = distinct.view();
+                weights = distinct.weights.data();
+            }
+
+            const bool pixels = isPixels(fitted, weights);
+
+            for (int K : options.Ks) {
+                if (K > points.size()) continue;
+
+                // same initial centroids for every method and number of threads
+                Dataset initial = initialCentroids(points, K, options.seed + K);
+
+                // labels of the float path, for the half methods (only computed if one runs)
+                vector<int> reference;
+
+                for (const Method& m : methods) {
+                    if (m.pixels && !pixels) continue;
+                    if (m.half && weights) continue;
+
+                    for (int t : options.threads) {
+
+                        int threads = m.parallel ? (t > 0 ? t : maxThreads) : 1;
+
+                        // serial methods only run once, with whatever number of threads comes first
+                        if (!m.parallel && t != options.threads.front()) continue;
+
+                        omp_set_num_threads(threads);
+
+                        Dataset last;
+                        Result res = measure(m, fitted, weights, initial, options, &last);
+                        res.method = m.name;
+                        res.data = synthetic ? options.data : "file";
+                        res.isa = isa;
+                        res.N = N;
+                        res.D = D;
+                        res.K = K;
+                        res.threads = threads;
+                        res.collapsed = options.collapse;
+                        res.points = fitted.size();
+
+                        if (m.half) {
+                            if (reference.empty()) reference = floatLabels(fitted, initial, options);
+                            res.agreement = labelAgreement(fitted, last, m.format, reference);
+                        }
+
+                        results.push_back(res);
+
+                        cout << m.name << " " << res.data << " N=" << N << " D=" << D << " K=" << K << " threads=" << threads
+                             << ": " << res.mean << " +- " << res.stddev << " ms per iteration (median " << res.median
+                             << ", min " << res.min << ", " << res.iterations << " iterations, setup " << res.setupMs << " ms)";
+                        if (m.half) cout << ", " << 100.0 * res.agreement << "% of labels like the float path";
+                        cout << "\n";
+                    }
+                }
+            }
+        }
+    }
+
+    omp_set_num_threads(maxThreads);
+
+    if (!options.json.empty() && !writeJSON(options.json, results)) {
+        cerr << "can't write " << options.json << "\n";
+        return 1;
+    }
+
+    if (!options.csv.empty() && !writeCSV(options.csv, results)) {
+        cerr << "can't write " << options.csv << "\n";
+        return 1;
+    }
+
+    if (!options.baseline.empty()) {
+        vector<Result> baseline;
+        if (!readJSON(options.baseline, baseline)) {
+            cerr << "can't read " << options.baseline << "\n";
+            return 1;
+        }
+
+        if (compareWithBaseline(results, baseline, options.tolerance) > 0) return 2;
+    }
+
+    return 0;
+}
@@ -1,6 +1,9 @@
 #include <vector>
 #include <iostream>
 #include <string>
+#include <chrono>
+#include <numeric>
+#include <random>
 
 #include "../rng.h"
 
@@ -8,6 +11,11 @@
 #include "parallel-k-means.hpp"
 #include "SIMD-k-means.hpp"
 #include "parallel-SIMD-k-means.hpp"
+#include "hamerly-k-means.hpp"
+#include "kd-tree-k-means.hpp"
+#include "gemm-k-means.hpp"
+#include "dataset-file.hpp"
+#include "weighted-points.hpp"
 
 #define STB_IMAGE_IMPLEMENTATION
 #include "STB/stb_image.h"
@@ -72,7 +80,7 @@ std::ostream& operator << (std::ostream& os, const std::vector<T>& m) {
 }
 
 
-std::vector<std::vector<float>> getImageData(const string& src) {
+Dataset getImageData(const string& src) {
 
     int w, h, n;
     unsigned char *img = stbi_load(src.c_str(), &w, &h, &n, 3);
@@ -81,16 +89,13 @@ std::vector<std::vector<float>> getImageData(const string& src) {
         exit(1);
     }
 
-    vector<vector<float>> data; data.reserve(w * h);
+    // one allocation for the whole image instead of one per pixel
+    Dataset data(w * h, 3);
 
-    for (int y = 0; y < h; ++y) {
-        for (int x = 0; x < w; ++x) {
-            data.push_back({
-                (float) img[(y * w + x) * 3 + 0], 
-                (float) img[(y * w + x) * 3 + 1], 
-                (float) img[(y * w + x) * 3 + 2]
-            });
-        }
+    for (int i = 0; i < w * h; ++i) {
+        data[i][0] = (float) img[i * 3 + 0];
+        data[i][1] = (float) img[i * 3 + 1];
+        data[i][2] = (float) img[i * 3 + 2];
     }
 
     stbi_image_free(img);
@@ -101,11 +106,38 @@ std::vector<std::vector<float>> getImageData(const string& src) {
 
 
 
-std::vector<std::vector<float>> getRandomCentroids(const std::vector<std::vector<float>>& dataset, int k) {
-    std::vector<std::vector<float>> newCentroids; newCentroids.reserve(k);
+// n points around `clusters` random centers in [0, 1)^D, for benchmarks that need more dimensions than an image has
+Dataset getGaussianBlobs(int n, int D, int clusters, unsigned seed) {
+    std::mt19937 gen(seed);
+    std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+    std::normal_distribution<float> normal(0.0f, 0.1f);
+
+    Dataset centers(clusters, D);
+    for (int c = 0; c < clusters; ++c) {
+        for (int d = 0; d < D; ++d) centers[c][d] = uniform(gen);
+    }
+
+    Dataset data(n, D);
+    for (int i = 0; i < n; ++i) {
+        int c = gen() % clusters;
+        for (int d = 0; d < D; ++d) data[i][d] = centers[c][d] + normal(gen);
+    }
+
+    return data;
+}
+
+
+Dataset getRandomCentroids(const DatasetView& dataset, int k) {
+    Dataset newCentroids(k, dataset.dim());
+
+    // choosing from the indices consumes the rng the same way choosing from the points did,
+    // so the same seed still gives the same centroids as before
+    std::vector<int> indices(dataset.size());
+    std::iota(indices.begin(), indices.end(), 0);
 
     for (int i = 0; i < k; ++i) {
-        newCentroids.push_back(rng::choice(dataset));
+        const float* point = dataset[rng::choice(indices)];
+        std::copy(point, point + dataset.dim(), newCentroids[i]);
     }
 
     return newCentroids;
@@ -113,12 +145,12 @@ std::vector<std::vector<float>> getRandomCentroids(const std::vector<std::vector
 
 
 template <class Method = BasicLloydIteration, typename = std::enable_if_t<std::is_base_of_v<LloydIteration, Method>>>
-double timePerIteration(const std::vector<std::vector<float>>& dataset, int k, const std::vector<std::vector<float>>& initialCentroids) {
+double timePerIteration(const DatasetView& dataset, int k, const Dataset& initialCentroids, const float* weights = nullptr) {
 
     KMeans model(k);
 
     // needed for other stuff besides initializing centroids (I just removed the initialization itself for benchmarks)
-    model.initializeCentroids(dataset);
+    model.initializeCentroids(dataset, weights);
 
     // set centroids that will actually be used
     model.centroids = initialCentroids;
@@ -146,7 +178,17 @@ int main() {
     string src;
     cout << "Image src: "; cin >> src;
 
-    std::vector<std::vector<float>> data = getImageData(src);
+    // files made by convert-dataset are just mmapped, anything else is decoded as an image
+    Dataset decoded;
+    MappedDataset mapped;
+
+    if (src.size() > 4 && src.substr(src.size() - 4) == ".kmd") {
+        if (!mapped.open(src.c_str())) exit(1);
+    } else {
+        decoded = getImageData(src);
+    }
+
+    DatasetView data = mapped.isOpen() ? mapped.view : decoded.view();
 
 
 
@@ -162,7 +204,7 @@ int main() {
     // just to print the same initial centroids and use them in other implementations
 /*  rng::setSeed(123);
     for (auto& k : Ks) {
-        cout << getRandomCentroids(data, k) << ", ";
+        cout << getRandomCentroids(data, k).toVectors() << ", ";
     }
 */
 
@@ -170,15 +212,29 @@ int main() {
     std::vector<double> timesSIMD;
     std::vector<double> timesOMP;
     std::vector<double> timesOMPSIMD;
+    std::vector<double> timesHamerly;
+    std::vector<double> timesKdTree;
+    std::vector<double> timesCollapsed;
+
+    // distinct colors weighted by their number of pixels, same assignments as using every pixel
+    Timer collapseTimer{};
+    collapseTimer.start();
+    WeightedPoints colors = collapseDuplicates(data);
+    collapseTimer.stop();
+
+    cout << "distinct colors: " << colors.size() << " of " << data.size() << " (collapsed in " << collapseTimer.elapsedMilliseconds() << " ms)\n";
 
     rng::setSeed(123);
     for (auto& k : Ks) {
-        std::vector<std::vector<float>> initialCentroids = getRandomCentroids(data, k);
+        Dataset initialCentroids = getRandomCentroids(data, k);
 
         timesBasic.push_back(timePerIteration<BasicLloydIteration>(data, k, initialCentroids));
         timesSIMD.push_back(timePerIteration<SIMDLloydIteration>(data, k, initialCentroids));
         timesOMP.push_back(timePerIteration<ParallelLloydIteration>(data, k, initialCentroids));
         timesOMPSIMD.push_back(timePerIteration<ParallelSIMDLloydIteration>(data, k, initialCentroids));
+        timesHamerly.push_back(timePerIteration<ParallelSIMDHamerlyLloydIteration>(data, k, initialCentroids));
+        timesKdTree.push_back(timePerIteration<ParallelKdTreeLloydIteration>(data, k, initialCentroids)); // includes building the tree
+        timesCollapsed.push_back(timePerIteration<ParallelSIMDLloydIteration>(colors.view(), k, initialCentroids, colors.weights.data()));
     }
 
     cout << "Ks: " << Ks << "\n";
@@ -186,6 +242,40 @@ int main() {
     cout << "timesSIMD: " << timesSIMD << "\n";
     cout << "timesOMP: " << timesOMP << "\n";
     cout << "timesOMPSIMD: " << timesOMPSIMD << "\n";
+    cout << "timesHamerly: " << timesHamerly << "\n";
+    cout << "timesKdTree: " << timesKdTree << "\n";
+    cout << "timesCollapsed: " << timesCollapsed << "\n";
+
+
+
+
+    /********************************************************************
+    *                                                                   *
+    *               benchmark on different values of D:                 *
+    *                                                                   *
+    ********************************************************************/
+
+
+    // images only have 3 dimensions, so this one uses synthetic data. Shows from which D the
+    // GEMM-style engine beats the SIMD kernel (3 and 4 also show the kernels compiled for a fixed D)
+    std::vector<int> Ds = { 2, 3, 4, 8, 16, 32, 64, 128, 256, 512, 1024 };
+    const int blobsN = 50000, blobsK = 64;
+
+    std::vector<double> timesOMPSIMDByD;
+    std::vector<double> timesGemmByD;
+
+    rng::setSeed(123);
+    for (auto& d : Ds) {
+        Dataset blobs = getGaussianBlobs(blobsN, d, blobsK, 123);
+        Dataset initialCentroids = getRandomCentroids(blobs, blobsK);
+
+        timesOMPSIMDByD.push_back(timePerIteration<ParallelSIMDLloydIteration>(blobs, blobsK, initialCentroids));
+        timesGemmByD.push_back(timePerIteration<ParallelGemmLloydIteration>(blobs, blobsK, initialCentroids));
+    }
+
+    cout << "Ds: " << Ds << "\n";
+    cout << "timesOMPSIMD: " << timesOMPSIMDByD << "\n";
+    cout << "timesGemm: " << timesGemmByD << "\n";
 
 
 
@@ -204,9 +294,9 @@ int main() {
     std::vector<double> timesOMPSIMD;
 
     rng::setSeed(123);
-    std::vector<std::vector<float>> initialCentroids = getRandomCentroids(data, K);
+    Dataset initialCentroids = getRandomCentroids(data, K);
 
-//  cout << initialCentroids << "\n";
+//  cout << initialCentroids.toVectors() << "\n";
 
     for (auto& k : numThreads) {
 
@@ -0,0 +1,67 @@
+#include <iostream>
+#include <string>
+#include <cstdlib>
+
+#include "dataset-file.hpp"
+
+#define STB_IMAGE_IMPLEMENTATION
+#include "STB/stb_image.h"
+
+using namespace std;
+
+
+// converts an image (one RGB point per pixel) or a raw float32 file to the mmappable format of dataset-file.hpp,
+// so benchmarks (and anything else) can start without decoding and converting the data every time
+//
+// usage: convert-dataset <image> <out>
+//        convert-dataset --raw <D> <in> <out>
+
+
+bool convertImage(const string& src, const string& dst) {
+
+    int w, h, n;
+    unsigned char *img = stbi_load(src.c_str(), &w, &h, &n, 3);
+
+    if (img == NULL) {
+        return false;
+    }
+
+    DatasetFileWriter writer(dst.c_str(), 3);
+    if (!writer.isOpen()) {
+        stbi_image_free(img);
+        return false;
+    }
+
+    for (int i = 0; i < w * h; ++i) {
+        float pixel[3] = { (float) img[i * 3 + 0], (float) img[i * 3 + 1], (float) img[i * 3 + 2] };
+        writer.write(pixel);
+    }
+
+    stbi_image_free(img);
+
+    return writer.close();
+}
+
+
+int main(int argc, char** argv) {
+
+    bool ok;
+    bool raw = argc == 5 && string(argv[1]) == "--raw";
+
+    if (raw && atoi(argv[2]) >= 1) {
+        ok = convertRawFloats(argv[3], argv[4], atoi(argv[2]));
+    } else if (argc == 3) {
+        ok = convertImage(argv[1], argv[2]);
+    } else {
+        cerr << "usage: " << argv[0] << " <image> <out>\n"
+             << "       " << argv[0] << " --raw <D> <in> <out>    (D >= 1)\n";
+        return 1;
+    }
+
+    if (!ok) {
+        cerr << "conversion failed" << (raw ? " (can't read or write the files, or the input isn't whole rows of D float32 values)" : "") << "\n";
+        return 1;
+    }
+
+    return 0;
+}
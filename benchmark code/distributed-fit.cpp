@@ -0,0 +1,143 @@
+#include <iostream>
+#include <string>
+#include <chrono>
+#include <cstdlib>
+#include <vector>
+#include <algorithm>
+
+#ifdef KMEANS_HAVE_MPI
+#include <mpi.h>
+#endif
+
+#include "distributed-k-means.hpp"
+#include "dataset-file.hpp"
+
+#ifndef KMEANS_HAVE_MPI
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+
+// fits a dataset file (see dataset-file.hpp) split between several processes (see distributed-k-means.hpp). Every rank
+// maps the file and only reads its own points, so each one only has its shard in memory. Rank 0 prints how long seeding
+// and fitting took and the centroids. Those are the ones KMeans gives fitting the whole file in one process with the
+// same seed and seedingSampleSize (both default to SEEDING_SAMPLE points per centroid) and ParallelSIMDLloydIteration.
+//
+// built with MPI (KMEANS_HAVE_MPI), it runs on the ranks mpirun starts:
+//     mpirun -n 4 distributed-fit <data.kmd> <k>
+// without MPI, it forks `ranks` processes that talk through shared memory:
+//     distributed-fit <data.kmd> <k> <ranks>
+
+
+double millisecondsSince(chrono::steady_clock::time_point start) {
+    return chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+}
+
+
+// true on every rank if ok is true on all of them. Every rank has to call it, so one that failed doesn't return
+// while the others wait for it in the next collective
+bool allRanksOk(Communicator& comm, bool ok) {
+    char flag = ok;
+    vector<char> flags(comm.size());
+    comm.allgather(&flag, flags.data(), vector<size_t>(comm.size(), 1));
+
+    return all_of(flags.begin(), flags.end(), [](char f) { return f != 0; });
+}
+
+
+int runRank(Communicator& comm, const char* path, int k) {
+
+    MappedDataset file(path);
+
+    if (!file.isOpen()) {
+        cerr << "rank " << comm.rank() << " can't open " << path << "\n";
+    }
+
+    if (!allRanksOk(comm, file.isOpen())) {
+        return 1;
+    }
+
+    DatasetView all = file.view;
+    DistributedKMeans model(comm, k, all.size(), all.dim(), 123);
+    DatasetView shard = all.slice(model.begin(), model.end());
+
+    auto start = chrono::steady_clock::now();
+    model.initializeCentroids(shard);
+    double seedMs = millisecondsSince(start);
+
+    start = chrono::steady_clock::now();
+    int iter = model.fit<ParallelSIMDLloydIteration>(500);
+    double fitMs = millisecondsSince(start);
+
+    if (comm.rank() == 0) {
+        cout << all.size() << " points on " << comm.size() << " ranks (" << shard.size() << " on rank 0)\n";
+        cout << "seeded in " << seedMs << " ms, fit in " << fitMs << " ms (" << iter << " iterations)\n";
+
+        for (int j = 0; j < k; ++j) {
+            for (int d = 0; d < all.dim(); ++d) cout << model.centroids[j][d] << (d + 1 < all.dim() ? " " : "\n");
+        }
+    }
+
+    return 0;
+}
+
+
+int main(int argc, char** argv) {
+
+#ifdef KMEANS_HAVE_MPI
+
+    if (argc != 3) {
+        cerr << "usage: mpirun -n <ranks> " << argv[0] << " <data.kmd> <k>\n";
+        return 1;
+    }
+
+    MPI_Init(&argc, &argv);
+
+    int result;
+    {
+        MPICommunicator comm;
+        result = runRank(comm, argv[1], atoi(argv[2]));
+    }
+
+    MPI_Finalize();
+    return result;
+
+#else
+
+    if (argc != 4) {
+        cerr << "usage: " << argv[0] << " <data.kmd> <k> <ranks>\n";
+        return 1;
+    }
+
+    int ranks = max(1, atoi(argv[3]));
+
+    // before anything uses OpenMP: its threads don't survive a fork
+    SharedMemoryGroup group(ranks);
+
+    if (!group.isOpen()) {
+        cerr << "can't map shared memory\n";
+        return 1;
+    }
+
+    for (int r = 0; r < ranks; ++r) {
+        if (fork() == 0) {
+            SharedMemoryCommunicator comm(group, r);
+            int result = runRank(comm, argv[1], atoi(argv[2]));
+            cout.flush(); // _exit doesn't
+            _exit(result);
+        }
+    }
+
+    int result = 0;
+    for (int r = 0; r < ranks; ++r) {
+        int status;
+        wait(&status);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) result = 1;
+    }
+
+    return result;
+
+#endif
+}
@@ -0,0 +1,106 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <cstdlib>
+#include <filesystem>
+
+#include "batch-quantizer.hpp"
+
+#define STB_IMAGE_IMPLEMENTATION
+#include "STB/stb_image.h"
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "STB/stb_image_write.h"
+
+using namespace std;
+namespace fs = std::filesystem;
+
+
+// quantizes every image of a folder to k colors and writes them as png to another folder, with decoding, fitting and
+// writing overlapped (see batch-quantizer.hpp). Prints how many images per second each stage did and how long it
+// waited, so the workers can be moved to whichever stage is the bottleneck
+//
+// usage: quantize-folder <in dir> <out dir> <k> [--decode N] [--fit N] [--fit-threads N] [--encode N] [--queue N] [--max-mb N]
+
+
+void printStage(const string& name, const StageStats& stats) {
+    cout << name << ": " << stats.workers << " workers, " << stats.images << " images, " << stats.imagesPerSecond() << " images/s per worker, "
+         << "busy " << stats.busyMs << " ms, waiting " << stats.waitInMs << " ms for input and " << stats.waitOutMs << " ms for output\n";
+}
+
+
+int main(int argc, char** argv) {
+
+    if (argc < 4 || argc % 2 != 0) {
+        cerr << "usage: " << argv[0] << " <in dir> <out dir> <k> [--decode N] [--fit N] [--fit-threads N] [--encode N] [--queue N] [--max-mb N]\n";
+        return 1;
+    }
+
+    const fs::path inDir = argv[1], outDir = argv[2];
+
+    BatchQuantizer batch(atoi(argv[3]));
+
+    // by default most cores fit, one at a time per image, and a quarter of them decode and encode
+    const int cores = max(1u, thread::hardware_concurrency());
+    batch.decodeWorkers = max(1, cores / 4);
+    batch.encodeWorkers = max(1, cores / 4);
+    batch.fitWorkers = max(1, cores - batch.decodeWorkers - batch.encodeWorkers);
+
+    for (int a = 4; a + 1 < argc; a += 2) {
+        string arg = argv[a];
+        int value = atoi(argv[a + 1]);
+
+        if (arg == "--decode") batch.decodeWorkers = max(1, value);
+        else if (arg == "--fit") batch.fitWorkers = max(1, value);
+        else if (arg == "--fit-threads") batch.threadsPerFit = max(1, value);
+        else if (arg == "--encode") batch.encodeWorkers = max(1, value);
+        else if (arg == "--queue") batch.queueSize = max(1, value);
+        else if (arg == "--max-mb") batch.maxBytes = (size_t) max(1, value) << 20;
+        else {
+            cerr << "unknown option " << arg << "\n";
+            return 1;
+        }
+    }
+
+    vector<fs::path> images;
+    error_code error;
+    for (const fs::directory_entry& entry : fs::directory_iterator(inDir, error)) {
+        if (entry.is_regular_file()) images.push_back(entry.path());
+    }
+
+    if (error) {
+        cerr << "can't read " << inDir << "\n";
+        return 1;
+    }
+
+    fs::create_directories(outDir, error);
+    if (error) {
+        cerr << "can't create " << outDir << "\n";
+        return 1;
+    }
+
+    batch.decode = [&](QuantizeJob& job) {
+        int n;
+        unsigned char* img = stbi_load(images[job.index].string().c_str(), &job.width, &job.height, &n, 0);
+        if (img == NULL) return false;
+
+        job.channels = n;
+        job.pixels.assign(img, img + (size_t) job.width * job.height * n);
+        stbi_image_free(img);
+        return true;
+    };
+
+    batch.encode = [&](const QuantizeJob& job) {
+        const fs::path dst = outDir / images[job.index].stem().concat(".png");
+        return stbi_write_png(dst.string().c_str(), job.width, job.height, job.channels, job.pixels.data(), job.width * job.channels) != 0;
+    };
+
+    int written = batch.run(images.size());
+
+    cout << written << " of " << images.size() << " images in " << batch.wallMs << " ms (" << written / batch.wallMs * 1000.0 << " images/s)\n";
+    printStage("decode", batch.decodeStats);
+    printStage("fit", batch.fitStats);
+    printStage("encode", batch.encodeStats);
+
+    return written == (int) images.size() ? 0 : 1;
+}
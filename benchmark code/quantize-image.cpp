@@ -0,0 +1,130 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <cstdlib>
+
+#include "k-means.hpp"
+#include "parallel-SIMD-k-means.hpp"
+#include "quantize.hpp"
+#include "model-file.hpp"
+
+#define STB_IMAGE_IMPLEMENTATION
+#include "STB/stb_image.h"
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "STB/stb_image_write.h"
+
+using namespace std;
+
+
+// color quantization from start to end: decodes an image, fits k colors to its distinct colors, labels every pixel
+// and writes the quantized image (png, jpg, bmp or tga, from the extension of out). Prints how long each step took.
+// With a model path, the centroids and their color table (see color-table.hpp) are written there too
+//
+// usage: quantize-image <image> <k> <out> [model.kmm]
+
+
+double millisecondsSince(chrono::high_resolution_clock::time_point start) {
+    return chrono::duration<double, milli>(chrono::high_resolution_clock::now() - start).count();
+}
+
+
+bool writeImage(const string& dst, int w, int h, int channels, const unsigned char* pixels) {
+
+    string ext = dst.size() > 4 ? dst.substr(dst.size() - 4) : "";
+
+    if (ext == ".jpg") return stbi_write_jpg(dst.c_str(), w, h, channels, pixels, 95);
+    if (ext == ".bmp") return stbi_write_bmp(dst.c_str(), w, h, channels, pixels);
+    if (ext == ".tga") return stbi_write_tga(dst.c_str(), w, h, channels, pixels);
+    return stbi_write_png(dst.c_str(), w, h, channels, pixels, w * channels);
+}
+
+
+int main(int argc, char** argv) {
+
+    if (argc != 4 && argc != 5) {
+        cerr << "usage: " << argv[0] << " <image> <k> <out> [model.kmm]\n";
+        return 1;
+    }
+
+    int k = atoi(argv[2]);
+
+    auto start = chrono::high_resolution_clock::now();
+
+    int w, h, n;
+    unsigned char *img = stbi_load(argv[1], &w, &h, &n, 3);
+
+    if (img == NULL || k <= 0) {
+        cerr << "can't read " << argv[1] << "\n";
+        return 1;
+    }
+
+    Dataset data(w * h, 3);
+    for (int i = 0; i < w * h; ++i) {
+        data[i][0] = (float) img[i * 3 + 0];
+        data[i][1] = (float) img[i * 3 + 1];
+        data[i][2] = (float) img[i * 3 + 2];
+    }
+
+    cout << "decoded " << w << "x" << h << " in " << millisecondsSince(start) << " ms\n";
+
+
+    start = chrono::high_resolution_clock::now();
+    WeightedPoints colors = collapseDuplicates(data);
+    cout << colors.size() << " distinct colors in " << millisecondsSince(start) << " ms\n";
+
+
+    start = chrono::high_resolution_clock::now();
+
+    KMeans model(k, 123);
+    model.seedingSampleSize = 100 * k;
+    model.initializeCentroids(colors);
+
+    cout << "seeded in " << millisecondsSince(start) << " ms\n";
+
+
+    start = chrono::high_resolution_clock::now();
+    int iter = model.fit<ParallelSIMDLloydIteration>(500);
+
+    cout << "fit in " << millisecondsSince(start) << " ms (" << millisecondsSince(start) / max(iter, 1) << " ms per iteration)\n";
+
+
+    // every pixel, not just the distinct colors, to show the cost of labeling a whole image
+    start = chrono::high_resolution_clock::now();
+    vector<int> labels(w * h);
+    model.predict(data, labels.data());
+    cout << "labeled every pixel in " << millisecondsSince(start) << " ms\n";
+
+    start = chrono::high_resolution_clock::now();
+    model.predict(colors, labels.data());
+    cout << "labeled every pixel through its distinct color in " << millisecondsSince(start) << " ms\n";
+
+    start = chrono::high_resolution_clock::now();
+    ColorTable table(model.centroids);
+    cout << "built a color table of " << table.bytes() / (1 << 20) << " MB in " << millisecondsSince(start) << " ms\n";
+
+    start = chrono::high_resolution_clock::now();
+    table.view().predict(PixelView(img, w * h, 3), labels.data());
+    cout << "labeled every pixel with the color table in " << millisecondsSince(start) << " ms\n";
+
+    if (argc == 5 && !writeModelFile(argv[4], model.centroids, &table)) {
+        cerr << "can't write " << argv[4] << "\n";
+        return 1;
+    }
+
+
+    start = chrono::high_resolution_clock::now();
+    quantizePixels(model.centroids, labels.data(), w * h, img);
+
+    bool ok = writeImage(argv[3], w, h, 3, img);
+    stbi_image_free(img);
+
+    if (!ok) {
+        cerr << "can't write " << argv[3] << "\n";
+        return 1;
+    }
+
+    cout << "quantized and written in " << millisecondsSince(start) << " ms\n";
+
+    return 0;
+}
@@ -0,0 +1,296 @@
+#pragma once
+
+#include "dataset.hpp"
+#include "helper.hpp"
+#include "pixel-k-means.hpp"
+#include "quantize.hpp"
+#include <vector>
+#include <cstdint>
+#include <cassert>
+#include <omp.h>
+
+
+// remapping 8 bit pixels to a palette that was fitted once, for when many more pixels are remapped than ever fitted.
+// There are only 2^(8C) different pixels, so the closest centroid of every one of them can be worked out once and
+// remapping a pixel is a lookup instead of K distances.
+//
+// the table is a grid with `bits` bits per channel (the top bits of each byte), so 2^(bits * C) cells:
+//   - bits = 8 (up to 3 channels): one cell per color with its label, 2^24 * 2 bytes = 32MB for RGB, built with the
+//     pixel kernel (see pixel-k-means.hpp). Every pixel is a single lookup
+//   - bits < 8: every cell keeps the centroids that can be the closest to some color in it (from the distances between
+//     the centroids and the box of the cell), which is usually only one. Pixels in a cell with more than one candidate
+//     compare the candidates, in index order with the same distances as KMeans::classify
+// either way the labels are exactly the ones KMeans::predict gives for the same pixels. At most 65535 centroids.
+//
+// ColorTable builds and owns one, ColorTableView only points to one (like Dataset and DatasetView), so a table can also
+// be used straight from a mapped model file (see model-file.hpp).
+
+
+struct ColorTableView {
+
+	int k = 0, C = 0, bits = 0;
+
+	// centroid j at centroids + j * stride, only used for the cells with more than one candidate
+	const float* centroids = nullptr;
+	size_t stride = 0;
+
+	// candidates of cell i are candidates[cellStart[i], cellStart[i + 1]). cellStart is null when bits = 8, and then
+	// candidates[i] is the label of color i
+	const uint32_t* cellStart = nullptr;
+	const uint16_t* candidates = nullptr;
+
+	bool isValid() const {
+		return candidates != nullptr;
+	}
+
+	size_t numCells() const {
+		return size_t(1) << (bits * C);
+	}
+
+	template <int FixedC>
+	size_t cellOf(const unsigned char* p) const {
+		const int channels = FixedC ? FixedC : C;
+
+		size_t cell = 0;
+		for (int c = 0; c < channels; ++c) cell = (cell << bits) | (p[c] >> (8 - bits));
+		return cell;
+	}
+
+	// index of color p in a table with one cell per color
+	template <int FixedC>
+	size_t colorOf(const unsigned char* p) const {
+		const int channels = FixedC ? FixedC : C;
+
+		size_t color = 0;
+		for (int c = 0; c < channels; ++c) color = (color << 8) | p[c];
+		return color;
+	}
+
+	template <int FixedC = 0>
+	int classify(const unsigned char* p) const {
+
+		if (!cellStart) return candidates[colorOf<FixedC>(p)];
+
+		const size_t cell = cellOf<FixedC>(p);
+
+		const uint32_t first = cellStart[cell], last = cellStart[cell + 1];
+		if (last - first == 1) return candidates[first];
+
+		const int channels = FixedC ? FixedC : C;
+		float point[4];
+		for (int c = 0; c < channels; ++c) point[c] = p[c];
+
+		float minDst = 1e30;
+		int centroidIndex = -1;
+
+		for (uint32_t i = first; i < last; ++i) {
+			const int j = candidates[i];
+			float dst = squaredEuclideanDistance<FixedC>(point, centroids + j * stride, channels);
+			if (dst < minDst) {
+				minDst = dst;
+				centroidIndex = j;
+			}
+		}
+
+		return centroidIndex;
+	}
+
+	// calls f(Dim<C>()), so the loops over pixels know the number of channels at compile time
+	template <class F>
+	void dispatchChannels(F&& f) const {
+		switch (C) {
+			case 1: f(Dim<1>()); break;
+			case 2: f(Dim<2>()); break;
+			case 3: f(Dim<3>()); break;
+			default: f(Dim<4>()); break;
+		}
+	}
+
+	// same labels as KMeans::predict
+	void predict(const PixelView& px, int* labels, bool parallel = true) const {
+		assert(px.dim() == C);
+
+		dispatchChannels([&](auto channels) {
+			if (!cellStart) {
+				const uint16_t* table = candidates;
+				const unsigned char* pixels = px.data;
+
+				#pragma omp parallel for if (parallel) schedule(static)
+				for (int i = 0; i < px.size(); ++i) labels[i] = table[colorOf<channels>(pixels + (size_t) i * channels)];
+			} else {
+				#pragma omp parallel for if (parallel) schedule(static)
+				for (int i = 0; i < px.size(); ++i) labels[i] = classify<channels>(px[i]);
+			}
+		});
+	}
+
+	// every pixel gets the color of its centroid (like quantizePixels, without the labels). out has room for
+	// px.size() * C bytes, and can be px.data itself
+	void quantize(const PixelView& px, unsigned char* out, bool parallel = true) const {
+		assert(px.dim() == C);
+
+		const std::vector<unsigned char> colors = palette(DatasetView(centroids, k, C, stride));
+
+		dispatchChannels([&](auto channels) {
+			#pragma omp parallel for if (parallel) schedule(static)
+			for (int i = 0; i < px.size(); ++i) {
+				const int j = classify<channels>(px[i]);
+				for (int c = 0; c < channels; ++c) out[(size_t) i * channels + c] = colors[(size_t) j * channels + c];
+			}
+		});
+	}
+};
+
+
+struct ColorTable {
+
+	Dataset centroids;
+	int bits = 0;
+
+	std::vector<uint32_t> cellStart;
+	std::vector<uint16_t> candidates;
+
+	ColorTable() = default;
+
+	// centroids have 1 ~ 4 dimensions (the channels). bits * C can be at most 24, 0 means defaultBits(C)
+	ColorTable(const Dataset& centroids, int bits = 0, bool parallel = true) : centroids(centroids.view()), bits(bits ? bits : defaultBits(centroids.dim())) {
+
+		const int k = centroids.size();
+		const int C = centroids.dim();
+		assert(k > 0 && k <= 65535 && C >= 1 && C <= 4 && this->bits >= 1 && this->bits <= 8 && this->bits * C <= 24);
+
+		if (this->bits == 8) buildColors(parallel);
+		else buildCells(parallel);
+	}
+
+	// one cell per color up to RGB (2^24 colors), 32 cells per channel for RGBA
+	static int defaultBits(int C) {
+		return C <= 3 ? 8 : 5;
+	}
+
+	ColorTableView view() const {
+		return { centroids.size(), centroids.dim(), bits, centroids.data(), centroids.stride, cellStart.empty() ? nullptr : cellStart.data(), candidates.data() };
+	}
+
+	size_t bytes() const {
+		return cellStart.size() * sizeof(uint32_t) + candidates.size() * sizeof(uint16_t);
+	}
+
+	// every color through the pixel kernel, so labels are the ones predict gives
+	void buildColors(bool parallel) {
+
+		constexpr int BLOCK = PackedPixelCentroids::BLOCK;
+
+		const int C = centroids.dim();
+		const long long colors = 1ll << (8 * C);
+
+		const PackedPixelCentroids packed(centroids);
+		candidates.resize(colors);
+
+		#pragma omp parallel for if (parallel) schedule(static)
+		for (long long begin = 0; begin < colors; begin += BLOCK) {
+
+			unsigned char pixels[BLOCK * 4];
+			int labels[BLOCK];
+
+			for (int i = 0; i < BLOCK; ++i) {
+				for (int c = 0; c < C; ++c) pixels[i * C + c] = (unsigned char) ((begin + i) >> (8 * (C - 1 - c)));
+			}
+
+			packed.closest(PixelView(pixels, BLOCK, C), 0, BLOCK, labels);
+			for (int i = 0; i < BLOCK; ++i) candidates[begin + i] = labels[i];
+		}
+	}
+
+	// a centroid is a candidate of a cell if its smallest distance to the box of colors of the cell isn't bigger than the
+	// largest distance of some other centroid, which every color of the cell is closer to than that. In double, and a
+	// bit looser than that (BOUND_SLACK), so float rounding in classify can't pick one that was left out.
+	//
+	// cells are split one bit per channel at a time, starting from a single cell with every centroid: the closest
+	// centroid of a color is a candidate of every bigger cell it's in, so each cell only looks at its parent's candidates
+	void buildCells(bool parallel) {
+
+		const int k = centroids.size();
+
+		cellStart = { 0, (uint32_t) k };
+		candidates.resize(k);
+		for (int j = 0; j < k; ++j) candidates[j] = j;
+
+		for (int level = 1; level <= bits; ++level) refine(level, parallel);
+	}
+
+	// from cells with level - 1 bits per channel to level bits
+	void refine(int level, bool parallel) {
+
+		constexpr int CELLS_PER_BLOCK = 4096;
+
+		const int k = centroids.size();
+		const int C = centroids.dim();
+		const long long cells = 1ll << (level * C);
+		const int width = 1 << (8 - level);
+		const int mask = (1 << level) - 1;
+		const long long numBlocks = (cells + CELLS_PER_BLOCK - 1) / CELLS_PER_BLOCK;
+
+		// candidates of every block of cells, put together after
+		std::vector<std::vector<uint16_t>> blockCandidates(numBlocks);
+		std::vector<uint32_t> counts(cells);
+
+		#pragma omp parallel for if (parallel) schedule(dynamic, 1)
+		for (long long block = 0; block < numBlocks; ++block) {
+
+			std::vector<double> minDst(k);
+
+			const long long last = std::min(cells, (block + 1) * CELLS_PER_BLOCK);
+			for (long long cell = block * CELLS_PER_BLOCK; cell < last; ++cell) {
+
+				long long parent = 0;
+				double lo[4];
+				for (int c = 0; c < C; ++c) {
+					const int coordinate = (cell >> (level * (C - 1 - c))) & mask;
+					parent = (parent << (level - 1)) | (coordinate >> 1);
+					lo[c] = coordinate * width;
+				}
+
+				const uint32_t first = cellStart[parent], end = cellStart[parent + 1];
+				double bound = std::numeric_limits<double>::infinity();
+
+				for (uint32_t i = first; i < end; ++i) {
+					const float* centroid = centroids[candidates[i]];
+					double nearest = 0.0, farthest = 0.0;
+
+					for (int c = 0; c < C; ++c) {
+						const double hi = lo[c] + width - 1;
+						const double x = centroid[c];
+
+						const double below = x < lo[c] ? lo[c] - x : x > hi ? x - hi : 0.0;
+						const double across = std::max(x - lo[c], hi - x);
+						nearest += below * below;
+						farthest += across * across;
+					}
+
+					minDst[i - first] = nearest;
+					bound = std::min(bound, farthest);
+				}
+
+				bound = bound * (1.0 + BOUND_SLACK) + 1e-6;
+
+				for (uint32_t i = first; i < end; ++i) {
+					if (minDst[i - first] <= bound) {
+						blockCandidates[block].push_back(candidates[i]);
+						++counts[cell];
+					}
+				}
+			}
+		}
+
+		std::vector<uint32_t> nextStart(cells + 1, 0);
+		for (long long cell = 0; cell < cells; ++cell) nextStart[cell + 1] = nextStart[cell] + counts[cell];
+
+		std::vector<uint16_t> next;
+		next.reserve(nextStart[cells]);
+		for (const std::vector<uint16_t>& list : blockCandidates) next.insert(next.end(), list.begin(), list.end());
+
+		cellStart = std::move(nextStart);
+		candidates = std::move(next);
+	}
+};
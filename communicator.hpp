@@ -0,0 +1,180 @@
+#pragma once
+
+#include <vector>
+#include <new>
+#include <atomic>
+#include <thread>
+#include <cstring>
+#include <cstddef>
+#include <algorithm>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#endif
+
+
+// how the processes that fit one model together (see distributed-k-means.hpp) talk to each other. Everything they
+// exchange goes through allgather, so a transport only has to implement that: SharedMemoryGroup for processes (or
+// threads) on the same machine, and MPICommunicator for anything MPI runs on, if mpi.h is included before this header.
+
+
+struct Communicator {
+
+	virtual ~Communicator() = default;
+
+	virtual int rank() const = 0;
+	virtual int size() const = 0;
+
+	// rank r gives bytes[r] bytes from send, and every rank gets what every rank gave in recv, in rank order. Every rank
+	// has to call it with the same bytes
+	virtual void allgather(const void* send, void* recv, const std::vector<size_t>& bytes) = 0;
+
+	// the bytes of root, to every rank
+	virtual void broadcast(void* data, size_t bytes, int root) {
+		std::vector<size_t> sizes(size(), 0);
+		sizes[root] = bytes;
+
+		std::vector<char> recv(bytes);
+		allgather(data, recv.data(), sizes);
+		if (rank() != root) std::memcpy(data, recv.data(), bytes);
+	}
+
+	// every rank waits for the others
+	void barrier() {
+		allgather(nullptr, nullptr, std::vector<size_t>(size(), 0));
+	}
+};
+
+
+#if defined(__unix__) || defined(__APPLE__)
+
+// ranks on the same machine, talking through an anonymous shared mapping. Make the group before forking (or before
+// starting the threads) and give every rank a SharedMemoryCommunicator with its own rank. Fork before anything uses
+// OpenMP, its threads don't survive a fork. Mostly for trying things out on one machine: the barrier spins (yielding),
+// so it's meant for at most one rank per core
+struct SharedMemoryGroup {
+
+	struct Header {
+		std::atomic<int> arrived;
+		std::atomic<int> generation;
+	};
+
+	int ranks = 0;
+	size_t capacity = 0; // bytes exchanged at a time, bigger allgathers go in several rounds
+	void* memory = nullptr;
+
+	SharedMemoryGroup(int ranks, size_t capacity = size_t(64) << 20) : ranks(ranks), capacity(capacity) {
+		static_assert(std::atomic<int>::is_always_lock_free, "the barrier needs lock free atomics to work between processes");
+
+		memory = mmap(nullptr, sizeof(Header) + capacity, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+		if (memory == MAP_FAILED) {
+			memory = nullptr;
+			return;
+		}
+
+		new (header()) Header{ {0}, {0} };
+	}
+
+	~SharedMemoryGroup() {
+		if (memory) munmap(memory, sizeof(Header) + capacity);
+	}
+
+	SharedMemoryGroup(const SharedMemoryGroup&) = delete;
+	SharedMemoryGroup& operator = (const SharedMemoryGroup&) = delete;
+
+	bool isOpen() const {
+		return memory != nullptr;
+	}
+
+	Header* header() { return static_cast<Header*>(memory); }
+	char* data() { return static_cast<char*>(memory) + sizeof(Header); }
+
+	void barrier() {
+		Header* h = header();
+		const int generation = h->generation.load();
+
+		if (h->arrived.fetch_add(1) + 1 == ranks) {
+			h->arrived.store(0);
+			h->generation.fetch_add(1);
+		} else {
+			while (h->generation.load() == generation) std::this_thread::yield();
+		}
+	}
+};
+
+struct SharedMemoryCommunicator : Communicator {
+
+	SharedMemoryGroup& group;
+	const int myRank;
+
+	SharedMemoryCommunicator(SharedMemoryGroup& group, int rank) : group(group), myRank(rank) {}
+
+	int rank() const override { return myRank; }
+	int size() const override { return group.ranks; }
+
+	// the whole result goes through the mapping `capacity` bytes at a time: every rank writes the part of its bytes that
+	// falls in the window, and after a barrier everyone copies the window out
+	void allgather(const void* send, void* recv, const std::vector<size_t>& bytes) override {
+
+		std::vector<size_t> offsets(bytes.size() + 1, 0);
+		for (size_t r = 0; r < bytes.size(); ++r) offsets[r + 1] = offsets[r] + bytes[r];
+
+		const size_t total = offsets.back();
+		const size_t mine = offsets[myRank], mineEnd = offsets[myRank + 1];
+
+		size_t window = 0;
+		do {
+			const size_t windowEnd = std::min(total, window + group.capacity);
+
+			const size_t from = std::max(mine, window), to = std::min(mineEnd, windowEnd);
+			if (from < to) std::memcpy(group.data() + (from - window), static_cast<const char*>(send) + (from - mine), to - from);
+
+			group.barrier();
+			if (windowEnd > window) std::memcpy(static_cast<char*>(recv) + window, group.data(), windowEnd - window);
+			group.barrier(); // nobody writes the next window before everyone has this one
+
+			window = windowEnd;
+		} while (window < total);
+	}
+};
+
+#endif
+
+
+#ifdef MPI_VERSION
+
+// any MPI communicator (MPI_COMM_WORLD by default). MPI has to be initialized already
+struct MPICommunicator : Communicator {
+
+	MPI_Comm comm;
+
+	MPICommunicator(MPI_Comm comm = MPI_COMM_WORLD) : comm(comm) {}
+
+	int rank() const override {
+		int r;
+		MPI_Comm_rank(comm, &r);
+		return r;
+	}
+
+	int size() const override {
+		int s;
+		MPI_Comm_size(comm, &s);
+		return s;
+	}
+
+	void allgather(const void* send, void* recv, const std::vector<size_t>& bytes) override {
+		std::vector<int> counts(bytes.size()), offsets(bytes.size(), 0);
+		for (size_t r = 0; r < bytes.size(); ++r) {
+			counts[r] = bytes[r];
+			if (r) offsets[r] = offsets[r - 1] + counts[r - 1];
+		}
+
+		MPI_Allgatherv(send, counts[rank()], MPI_BYTE, recv, counts.data(), offsets.data(), MPI_BYTE, comm);
+	}
+
+	void broadcast(void* data, size_t bytes, int root) override {
+		MPI_Bcast(data, bytes, MPI_BYTE, root, comm);
+	}
+};
+
+#endif
@@ -0,0 +1,225 @@
+#pragma once
+
+#include "dataset.hpp"
+#include <cstdio>
+#include <cstring>
+#include <climits>
+#include <vector>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+
+// simple on-disk format, made so a dataset can be mmapped and used as it is (no parsing, no copying):
+//
+//   [DatasetFileHeader][zeros up to dataOffset][row 0][row 1]...[row N-1]
+//
+// every row has `stride` values, the first `cols` are the point and the rest is padding. dataOffset is a multiple
+// of `alignment` (the page size by default), and since mmap returns page aligned memory, so is the first row.
+// Values are stored in the machine's byte order (the header has a marker to catch the wrong one).
+//
+// opening a file is just mmap + reading the header, so the time to "load" a dataset doesn't depend on its size,
+// and when it's already in the page cache (running again on the same data) the first iteration doesn't even touch the disk.
+
+
+enum class DType : uint32_t { Float32 = 0 };
+
+struct DatasetFileHeader {
+	char magic[8] = { 'K', 'M', 'D', 'A', 'T', 'A', 0, 0 };
+	uint32_t version = 1;
+	uint32_t byteOrder = 0x01020304;
+	DType dtype = DType::Float32;
+	uint32_t cols = 0;
+	uint64_t rows = 0;
+	uint64_t stride = 0; // values per row, >= cols
+	uint64_t alignment = 4096;
+	uint64_t dataOffset = 0;
+
+	// length is the size of the whole file. Rows and columns have to fit an int (what views index with), and every row
+	// has to end inside the file
+	bool isValid(size_t length) const {
+		DatasetFileHeader expected;
+		return std::memcmp(magic, expected.magic, sizeof(magic)) == 0 && version == expected.version && byteOrder == expected.byteOrder
+			&& dtype == DType::Float32 && rows <= INT_MAX && cols <= INT_MAX && stride >= cols && stride <= length / sizeof(float)
+			&& dataOffset >= sizeof(DatasetFileHeader) && dataOffset % sizeof(float) == 0
+			&& fitsIn(dataOffset, rows, stride * sizeof(float), length);
+	}
+};
+
+
+// writes points in the format above, one row at a time, so it works with a view of a dataset that is being generated
+// or converted. rowAlignment pads every row to a multiple of that many values (1 = no padding)
+struct DatasetFileWriter {
+
+	FILE* file = nullptr;
+	DatasetFileHeader header;
+	std::vector<float> row;
+
+	DatasetFileWriter(const char* path, int cols, int rowAlignment = 1, uint64_t alignment = 4096) : file(std::fopen(path, "wb")) {
+		header.cols = cols;
+		header.stride = roundUp(cols, rowAlignment);
+		header.alignment = alignment;
+		header.dataOffset = roundUp(sizeof(DatasetFileHeader), alignment);
+
+		row.assign(header.stride, 0.0f);
+
+		// header is written again when closing, with the final number of rows
+		if (file) writeHeader();
+	}
+
+	~DatasetFileWriter() {
+		close();
+	}
+
+	bool isOpen() const { return file != nullptr; }
+
+	void writeHeader() {
+		std::vector<char> block(header.dataOffset, 0);
+		std::memcpy(block.data(), &header, sizeof(header));
+
+		std::fseek(file, 0, SEEK_SET);
+		std::fwrite(block.data(), 1, block.size(), file);
+		std::fseek(file, 0, SEEK_END);
+	}
+
+	// does nothing if the file couldn't be opened (close then returns false)
+	void write(const float* point) {
+		if (!file) return;
+
+		std::copy(point, point + header.cols, row.begin());
+		std::fwrite(row.data(), sizeof(float), row.size(), file);
+		header.rows++;
+	}
+
+	void write(const DatasetView& points) {
+		for (int i = 0; i < points.size(); ++i) {
+			if (points.isRowMajor()) {
+				write(points[i]);
+			} else {
+				for (int d = 0; d < points.dim(); ++d) row[d] = points.at(i, d);
+				write(row.data());
+			}
+		}
+	}
+
+	// returns false if anything failed to be written
+	bool close() {
+		if (!file) return false;
+
+		writeHeader();
+		bool ok = !std::ferror(file);
+		ok = std::fclose(file) == 0 && ok;
+		file = nullptr;
+
+		return ok;
+	}
+};
+
+bool writeDatasetFile(const char* path, const DatasetView& points, int rowAlignment = 1) {
+	DatasetFileWriter writer(path, points.dim(), rowAlignment);
+	if (!writer.isOpen()) return false;
+
+	writer.write(points);
+	return writer.close();
+}
+
+
+// read-only mmap of a dataset file. The view stays valid while this object lives
+struct MappedDataset {
+
+	void* map = MAP_FAILED;
+	size_t length = 0;
+	DatasetFileHeader header;
+	DatasetView view;
+
+	MappedDataset() = default;
+
+	// populate asks the kernel to read the whole file right away instead of on the first access to each page
+	explicit MappedDataset(const char* path, bool populate = false) {
+		open(path, populate);
+	}
+
+	MappedDataset(const MappedDataset&) = delete;
+	MappedDataset& operator = (const MappedDataset&) = delete;
+
+	~MappedDataset() {
+		close();
+	}
+
+	bool isOpen() const { return map != MAP_FAILED; }
+
+	bool open(const char* path, bool populate = false) {
+		close();
+
+		int fd = ::open(path, O_RDONLY);
+		if (fd < 0) return false;
+
+		struct stat st;
+		if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(DatasetFileHeader)) {
+			::close(fd);
+			return false;
+		}
+
+		length = st.st_size;
+		map = mmap(nullptr, length, PROT_READ, MAP_SHARED | (populate ? MAP_POPULATE : 0), fd, 0);
+		::close(fd); // the mapping keeps the file alive
+
+		if (map == MAP_FAILED) return false;
+
+		std::memcpy(&header, map, sizeof(header));
+		if (!header.isValid(length)) {
+			close();
+			return false;
+		}
+
+		// iterators go through the points in order
+		madvise(map, length, MADV_SEQUENTIAL);
+
+		view = DatasetView((const float*) ((const char*) map + header.dataOffset), header.rows, header.cols, header.stride);
+		return true;
+	}
+
+	void close() {
+		if (map != MAP_FAILED) munmap(map, length);
+		map = MAP_FAILED;
+		length = 0;
+		view = DatasetView();
+	}
+
+	operator DatasetView() const { return view; }
+};
+
+
+// converts a file of raw float32 rows (D values each, no header) to the format above without loading it all. Fails if
+// D < 1 or if the file ends in the middle of a row (it's probably not D values per row then)
+bool convertRawFloats(const char* inPath, const char* outPath, int D, int rowAlignment = 1) {
+
+	if (D < 1) return false;
+
+	FILE* in = std::fopen(inPath, "rb");
+	if (!in) return false;
+
+	DatasetFileWriter writer(outPath, D, rowAlignment);
+	if (!writer.isOpen()) {
+		std::fclose(in);
+		return false;
+	}
+
+	const int rowsPerChunk = 1 << 16;
+	std::vector<float> chunk((size_t) rowsPerChunk * D);
+
+	size_t read, bytes = 0;
+	while ((read = std::fread(chunk.data(), 1, chunk.size() * sizeof(float), in)) > 0) {
+		bytes += read;
+		writer.write(DatasetView(chunk.data(), read / (sizeof(float) * D), D));
+
+		// only the last read can stop in the middle of a row
+		if (read % (sizeof(float) * D)) break;
+	}
+
+	const bool ok = !std::ferror(in) && bytes % (sizeof(float) * D) == 0;
+
+	std::fclose(in);
+	return writer.close() && ok;
+}
@@ -0,0 +1,229 @@
+#ifndef DATASET_HPP
+#define DATASET_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <cassert>
+#include <new>
+#include <vector>
+#include <utility>
+#include <algorithm>
+
+
+// all buffers are aligned to a cache line, which is also enough for aligned AVX / AVX-512 loads
+constexpr size_t DATASET_ALIGNMENT = 64;
+
+
+// how the values of a dataset are laid out in memory:
+//  - RowMajor: point i is the contiguous array [x0, x1, ..., xD-1] (this is what every iterator expects)
+//  - SoA: dimension d is the contiguous array [p0, p1, ..., pN-1]
+//  - AoSoA: points are grouped in blocks of `lanes` points, and each block is stored as SoA. With lanes = W
+//    one block dimension fits exactly in a vector of W floats, which is how PackedCentroids stores centroids
+enum class Layout { RowMajor, SoA, AoSoA };
+
+
+// rounds n up to a multiple of m
+inline size_t roundUp(size_t n, size_t m) {
+	return (n + m - 1) / m * m;
+}
+
+// true if `count` items of `size` bytes starting at byte `offset` end within `length` bytes. Written so that nothing can
+// overflow, for offsets and sizes read from a file
+inline bool fitsIn(uint64_t offset, uint64_t count, uint64_t size, uint64_t length) {
+	return offset <= length && (size == 0 || count <= (length - offset) / size);
+}
+
+
+// owning, aligned and uninitialized array of T. Only used for trivial types
+template <typename T>
+struct AlignedBuffer {
+
+	T* ptr = nullptr;
+	size_t n = 0;
+
+	AlignedBuffer() = default;
+	explicit AlignedBuffer(size_t n) : n(n) {
+		if (n) ptr = new (std::align_val_t(DATASET_ALIGNMENT)) T[n];
+	}
+
+	AlignedBuffer(const AlignedBuffer& other) : AlignedBuffer(other.n) {
+		if (n) std::memcpy(ptr, other.ptr, n * sizeof(T));
+	}
+
+	AlignedBuffer(AlignedBuffer&& other) noexcept : ptr(other.ptr), n(other.n) {
+		other.ptr = nullptr;
+		other.n = 0;
+	}
+
+	AlignedBuffer& operator = (AlignedBuffer other) noexcept {
+		std::swap(ptr, other.ptr);
+		std::swap(n, other.n);
+		return *this;
+	}
+
+	~AlignedBuffer() {
+		if (ptr) ::operator delete[] (ptr, std::align_val_t(DATASET_ALIGNMENT));
+	}
+
+	T* data() { return ptr; }
+	const T* data() const { return ptr; }
+	size_t size() const { return n; }
+
+	T& operator [] (size_t i) { return ptr[i]; }
+	const T& operator [] (size_t i) const { return ptr[i]; }
+};
+
+
+// shared indexing logic for views and owning datasets. For RowMajor, stride is the distance between two points;
+// for SoA, it's the distance between two dimensions; for AoSoA it's unused (blocks are cols * lanes floats)
+struct DatasetShape {
+
+	int rows = 0, cols = 0;
+	size_t stride = 0;
+	Layout layout = Layout::RowMajor;
+	int lanes = 1;
+
+	size_t index(size_t i, int d) const {
+		switch (layout) {
+			case Layout::RowMajor: return i * stride + d;
+			case Layout::SoA: return (size_t) d * stride + i;
+			case Layout::AoSoA: return ((i / lanes) * cols + d) * lanes + i % lanes;
+		}
+		return 0;
+	}
+
+	// number of floats needed to store this shape
+	size_t storageSize() const {
+		switch (layout) {
+			case Layout::RowMajor: return (size_t) rows * stride;
+			case Layout::SoA: return (size_t) cols * stride;
+			case Layout::AoSoA: return roundUp(rows, lanes) * cols;
+		}
+		return 0;
+	}
+
+	int size() const { return rows; }
+	int dim() const { return cols; }
+};
+
+
+// non-owning view of a dataset. Copying it is free, so this is what gets passed around to iterators
+struct DatasetView : DatasetShape {
+
+	const float* ptr = nullptr;
+
+	DatasetView() = default;
+	DatasetView(const float* ptr, int rows, int cols, size_t stride = 0) : ptr(ptr) {
+		this->rows = rows;
+		this->cols = cols;
+		this->stride = stride ? stride : cols;
+	}
+	DatasetView(const float* ptr, const DatasetShape& shape) : DatasetShape(shape), ptr(ptr) {}
+
+	// pointer to the i-th point (only valid for RowMajor)
+	const float* operator [] (size_t i) const { return ptr + i * stride; }
+
+	float at(size_t i, int d) const { return ptr[index(i, d)]; }
+
+	const float* data() const { return ptr; }
+
+	bool isRowMajor() const { return layout == Layout::RowMajor; }
+
+	// points [begin, end) of a RowMajor view
+	DatasetView slice(int begin, int end) const {
+		assert(isRowMajor());
+		return DatasetView(ptr + begin * stride, end - begin, cols, stride);
+	}
+};
+
+
+// owning dataset: one aligned allocation for all points, instead of one allocation per point
+struct Dataset : DatasetShape {
+
+	AlignedBuffer<float> buffer;
+
+	Dataset() = default;
+
+	// stride = 0 means tightly packed rows (or, for SoA, dimensions padded to a multiple of 16 floats)
+	Dataset(int rows, int cols, float fill = 0.0f, Layout layout = Layout::RowMajor, int lanes = 8, size_t stride = 0) {
+		this->rows = rows;
+		this->cols = cols;
+		this->layout = layout;
+		this->lanes = layout == Layout::AoSoA ? lanes : 1;
+
+		if (layout == Layout::RowMajor) this->stride = stride ? stride : cols;
+		else if (layout == Layout::SoA) this->stride = stride ? stride : roundUp(rows, DATASET_ALIGNMENT / sizeof(float));
+		else this->stride = 0;
+
+		buffer = AlignedBuffer<float>(storageSize());
+		std::fill(buffer.data(), buffer.data() + buffer.size(), fill);
+	}
+
+	// not explicit on purpose, so code using std::vector<std::vector<float>> keeps working (with one copy)
+	Dataset(const std::vector<std::vector<float>>& pts) : Dataset(pts.size(), pts.empty() ? 0 : pts[0].size()) {
+		for (int i = 0; i < rows; ++i) {
+			std::copy(pts[i].begin(), pts[i].end(), (*this)[i]);
+		}
+	}
+
+	// copies any view (of any layout) into a new RowMajor dataset
+	explicit Dataset(const DatasetView& view) : Dataset(view.rows, view.cols) {
+		if (view.isRowMajor()) {
+			for (int i = 0; i < rows; ++i) std::copy(view[i], view[i] + cols, (*this)[i]);
+		} else {
+			for (int i = 0; i < rows; ++i) {
+				for (int d = 0; d < cols; ++d) (*this)[i][d] = view.at(i, d);
+			}
+		}
+	}
+
+	// pointer to the i-th point (only valid for RowMajor)
+	float* operator [] (size_t i) { return buffer.data() + i * stride; }
+	const float* operator [] (size_t i) const { return buffer.data() + i * stride; }
+
+	float& at(size_t i, int d) { return buffer[index(i, d)]; }
+	float at(size_t i, int d) const { return buffer[index(i, d)]; }
+
+	float* data() { return buffer.data(); }
+	const float* data() const { return buffer.data(); }
+
+	bool isRowMajor() const { return layout == Layout::RowMajor; }
+
+	DatasetView view() const { return DatasetView(buffer.data(), *this); }
+	operator DatasetView() const { return view(); }
+
+	// same points in another layout. Padding lanes of AoSoA are filled with `pad`
+	Dataset toLayout(Layout newLayout, int newLanes = 8, float pad = 0.0f) const {
+		Dataset out(rows, cols, pad, newLayout, newLanes);
+		for (int i = 0; i < rows; ++i) {
+			for (int d = 0; d < cols; ++d) out.at(i, d) = at(i, d);
+		}
+		return out;
+	}
+
+	// same shape and exactly the same values
+	bool equals(const Dataset& other) const {
+		if (rows != other.rows || cols != other.cols) return false;
+
+		for (int i = 0; i < rows; ++i) {
+			for (int d = 0; d < cols; ++d) {
+				if (at(i, d) != other.at(i, d)) return false;
+			}
+		}
+
+		return true;
+	}
+
+	std::vector<std::vector<float>> toVectors() const {
+		std::vector<std::vector<float>> out(rows, std::vector<float>(cols));
+		for (int i = 0; i < rows; ++i) {
+			for (int d = 0; d < cols; ++d) out[i][d] = at(i, d);
+		}
+		return out;
+	}
+};
+
+
+
+#endif
@@ -0,0 +1,125 @@
+#pragma once
+
+#include "k-means-iteration.hpp"
+#include "slice-sums.hpp"
+#include <vector>
+#include <utility>
+
+
+// per-cluster sums kept from one iteration to the next, for the iterators that keep labels (Hamerly and Elkan). Late in
+// a fit almost no point changes cluster and those iterators barely compute any distance, so adding every point to the
+// sums again is most of what's left of an iteration. With refreshEvery > 0, every point is only added (with SliceSums,
+// as usual) in the first iteration and then every refreshEvery iterations; in between, only the points that changed
+// cluster are moved from the sums of their old cluster to the new one, which is O(changed * D) instead of O(N * D).
+//
+// the kept sums are doubles, so moving points back and forth loses next to nothing, and adding everything again now and
+// then keeps that from building up. It's still not the same floats as adding every point in slice order, so centroids
+// can differ from the other iterators in the last bits (labels are still the exact nearest centroid, for the centroids
+// there are). Moves are recorded per slice and applied in slice order, so results don't depend on the threads.
+//
+// points split between processes (see distributed-k-means.hpp) always add every point, their sums have to go through
+// the exchange of SliceSums.
+
+struct DeltaSums {
+
+	// 0 adds every point every iteration (the default, same centroids as every other iterator)
+	int refreshEvery = 0;
+
+	int k = 0, D = 0;
+	bool valid = false; // sums match the labels
+	int sinceRefresh = 0;
+
+	std::vector<double> sums, counts;
+	std::vector<long long> members; // points in each cluster, so a cluster that empties is exactly empty
+
+	// per slice: the points that changed cluster, and the cluster they left
+	std::vector<std::vector<std::pair<int, int>>> moved;
+
+	explicit DeltaSums(int refreshEvery = 0) : refreshEvery(refreshEvery) {}
+
+	bool enabled(const SliceSums& slices) const {
+		return refreshEvery > 0 && !slices.layout;
+	}
+
+	// whether this iteration adds every point (after slices.prepare). rebuild means the labels were all computed again
+	bool fullIteration(const SliceSums& slices, bool rebuild) {
+		if (!enabled(slices)) return true;
+
+		if (rebuild || slices.k != k || slices.D != D) valid = false;
+		k = slices.k;
+		D = slices.D;
+
+		if (moved.size() != (size_t) slices.numSlices) moved.assign(slices.numSlices, {});
+
+		return !valid || sinceRefresh >= refreshEvery;
+	}
+
+	// in the slice loop of an iteration that isn't full
+	void clear(int slice) {
+		moved[slice].clear();
+	}
+
+	void move(int slice, int i, int from) {
+		moved[slice].emplace_back(i, from);
+	}
+
+	// new centroids from the sums (slices.sums(0) after a full iteration). Labels are the ones of this iteration
+	bool update(LloydIteration& iterator, Dataset& centroids, SliceSums& slices, const std::vector<int>& labels, bool full, bool changed) {
+
+		if (!enabled(slices)) return iterator.updateCentroids(centroids, slices.sums(0), slices.D, slices.counts(0));
+
+		// a full iteration where nothing changed keeps the old sums, so centroids that didn't change stay the same
+		if (full && (!valid || changed)) load(slices, labels);
+		else if (!full) apply(iterator, labels);
+
+		Dataset means(k, D, 0.0f);
+		std::vector<float> nonEmpty(k, 0.0f);
+
+		for (int j = 0; j < k; ++j) {
+			if (!members[j]) continue;
+
+			nonEmpty[j] = 1.0f;
+			for (int d = 0; d < D; ++d) means[j][d] = sums[(size_t) j * D + d] / counts[j];
+		}
+
+		return iterator.updateCentroids(centroids, means, nonEmpty);
+	}
+
+	void load(SliceSums& slices, const std::vector<int>& labels) {
+
+		sums.assign(slices.sums(0), slices.sums(0) + (size_t) k * D);
+		counts.assign(slices.counts(0), slices.counts(0) + k);
+
+		members.assign(k, 0);
+		for (int a : labels) ++members[a];
+
+		valid = true;
+		sinceRefresh = 0;
+	}
+
+	void apply(const LloydIteration& iterator, const std::vector<int>& labels) {
+
+		for (const auto& slice : moved) {
+			for (auto [i, from] : slice) {
+				const int to = labels[i];
+				const double w = iterator.weight(i);
+				const float* p = iterator.points[i];
+
+				for (int d = 0; d < D; ++d) {
+					sums[(size_t) from * D + d] -= w * p[d];
+					sums[(size_t) to * D + d] += w * p[d];
+				}
+				counts[from] -= w;
+				counts[to] += w;
+
+				++members[to];
+				if (--members[from] == 0) {
+					std::fill(&sums[(size_t) from * D], &sums[(size_t) from * D] + D, 0.0);
+					counts[from] = 0.0;
+				}
+			}
+		}
+
+		++sinceRefresh;
+	}
+};
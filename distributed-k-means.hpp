@@ -0,0 +1,228 @@
+#pragma once
+
+#include "k-means.hpp"
+#include "parallel-SIMD-k-means.hpp"
+#include "communicator.hpp"
+#include "slice-sums.hpp"
+#include <vector>
+#include <random>
+#include <algorithm>
+#include <type_traits>
+
+
+// one model fitted by several processes (ranks), each with a shard of the points, for datasets bigger than the memory or
+// the cores of one machine. Every rank runs an ordinary iterator on its own shard; the only difference is that the
+// SliceSums of the iterator are given the layout of the whole dataset (see slice-sums.hpp). So the only thing the ranks
+// exchange is the K * D sums and K counts of each iteration (a few partial ones per rank), and every rank adds them up in
+// the same order a single process with every point would. Every rank computes the same centroids and they converge
+// together, without anything else being exchanged: the centroids are exactly the ones KMeans::fit gives on the whole
+// dataset with the parallel version of the same iterator.
+//
+// ranks don't get to choose their shard: slices are whole, so rank r has points [begin(), end()) of the whole dataset,
+// which depends on N, K and D (and is about N / ranks points each).
+//
+// seeding runs on a sample (see seedingPoints in seeding.hpp, same default as KMeans), drawn with the same generator on
+// every rank, and every rank sends the points of the sample it has. The centroids are the ones KMeans gives with the
+// same seedingSampleSize, weights included.
+//
+// the iterator has to add its sums with SliceSums: the parallel iterators, Hamerly, Elkan and Gemm do (their serial
+// versions too, and then they give the centroids of their parallel version). Pixels aren't supported.
+
+template <class Iterator, typename = void>
+struct SumsWithSlices : std::false_type {};
+
+template <class Iterator>
+struct SumsWithSlices<Iterator, std::void_t<decltype(std::declval<Iterator&>().slices.layout)>> : std::true_type {};
+
+
+struct DistributedKMeans {
+
+	Communicator& comm;
+	int k, N, D; // N is the number of points of every rank together
+
+	SliceLayout layout;
+
+	Dataset centroids;
+
+	// this rank's points (and weights), not copied
+	DatasetView points;
+	const float* weights = nullptr;
+	bool weighted = false; // if any rank has weights (a rank without points can have none either way)
+
+	Seeding seeding = Seeding::KMeansPlusPlus;
+	int seedingSampleSize = 0;
+	std::mt19937 gen;
+
+	// gets the stats of every iteration of this rank (see instrumentation.hpp). Not owned
+	IterationObserver* observer = nullptr;
+
+	// every rank has to use the same seed
+	DistributedKMeans(Communicator& comm, int k, int N, int D, unsigned seed) : comm(comm), k(k), N(N), D(D), layout(N, k, D, comm), gen(seed) {}
+
+	// the points this rank has to load
+	int begin() const { return layout.pointsBegin(comm.rank()); }
+	int end() const { return layout.pointsEnd(comm.rank()); }
+
+	// shard has points [begin(), end()) (and shardWeights their weights). Called by every rank
+	void initializeCentroids(const DatasetView& shard, const float* shardWeights = nullptr) {
+		assert(shard.size() == end() - begin() && shard.dim() == D);
+
+		points = shard;
+		weights = shardWeights;
+
+		std::vector<char> hasWeights(comm.size());
+		const char mine = weights != nullptr;
+		comm.allgather(&mine, hasWeights.data(), std::vector<size_t>(comm.size(), 1));
+
+		weighted = std::find(hasWeights.begin(), hasWeights.end(), 1) != hasWeights.end();
+		assert(!weighted || weights || points.size() == 0);
+
+		const int n = seedingPoints(seedingSampleSize, k, N);
+
+		if (n >= N) {
+			// KMeans seeds on every point then, so everyone gets every point
+			std::vector<int> rows(points.size());
+			for (int i = 0; i < points.size(); ++i) rows[i] = i;
+
+			std::vector<int> rowsPerRank(comm.size());
+			for (int r = 0; r < comm.size(); ++r) rowsPerRank[r] = layout.pointsEnd(r) - layout.pointsBegin(r);
+
+			Dataset all = gather(rows, rowsPerRank);
+			std::vector<float> allWeights(weighted ? N : 0);
+			if (weighted) comm.allgather(weights, allWeights.data(), byteCounts(rowsPerRank, sizeof(float)));
+
+			seed(all.view(), weighted ? allWeights.data() : nullptr);
+		} else {
+			seed(sample(n).view(), nullptr);
+		}
+
+		// ranks built differently could have rounded something differently, so everyone takes rank 0's
+		comm.broadcast(centroids.data(), (size_t) k * centroids.stride * sizeof(float), 0);
+	}
+
+	template <class It = ParallelSIMDLloydIteration, typename... Args>
+	int fit(int maxIter = 500, Args&&... args) {
+		static_assert(SumsWithSlices<It>::value, "the iterator has to add its sums with SliceSums (see distributed-k-means.hpp)");
+
+		It iterator(points, weights, std::forward<Args>(args)...);
+		iterator.slices.layout = &layout;
+
+		PerfCounters perf;
+		if (observer) {
+			iterator.trackChanges = observer->countChanges;
+			if (observer->hardwareCounters) perf.open();
+		}
+
+		int iter = 0;
+		bool converged = false;
+		while (++iter <= maxIter && !(converged = agreedStep(iterator, perf.isOpen() ? &perf : nullptr))) {}
+
+		--iter; // last iteration didn't count (centroids didn't move)
+
+		if (observer) observer->fitDone(iter, converged);
+		return iter;
+	}
+
+	// one iteration. Every rank gets the same sums and so the same centroids, but rank 0's are sent to everyone anyway
+	// (with whether they converged, K * D + 1 floats) so ranks can never end up stopping at different iterations
+	bool agreedStep(LloydIteration& iterator, const PerfCounters* perf) {
+
+		bool converged = iterator.step(centroids, observer, perf);
+
+		const size_t size = (size_t) k * centroids.stride;
+		std::vector<float> message(size + 1);
+		std::copy(centroids.data(), centroids.data() + size, message.begin());
+		message[size] = converged;
+
+		comm.broadcast(message.data(), message.size() * sizeof(float), 0);
+
+		std::copy(message.begin(), message.begin() + size, centroids.data());
+		return message[size] != 0.0f;
+	}
+
+	void seed(const DatasetView& pts, const float* w) {
+		if (seeding == Seeding::KMeansParallel) centroids = kMeansParallel(pts, k, gen, 5, 0.0, true, 0, w);
+		else centroids = kMeansPlusPlus(pts, k, gen, true, 0, w);
+	}
+
+	static std::vector<size_t> byteCounts(const std::vector<int>& rowsPerRank, size_t rowBytes) {
+		std::vector<size_t> bytes(rowsPerRank.size());
+		for (size_t r = 0; r < bytes.size(); ++r) bytes[r] = rowsPerRank[r] * rowBytes;
+		return bytes;
+	}
+
+	// the given rows of every rank's shard, rank after rank
+	Dataset gather(const std::vector<int>& rows, const std::vector<int>& rowsPerRank) {
+
+		std::vector<float> send(rows.size() * D);
+		for (size_t i = 0; i < rows.size(); ++i) std::copy(points[rows[i]], points[rows[i]] + D, &send[i * D]);
+
+		int total = 0;
+		for (int count : rowsPerRank) total += count;
+
+		std::vector<float> recv((size_t) total * D);
+		comm.allgather(send.data(), recv.data(), byteCounts(rowsPerRank, D * sizeof(float)));
+
+		Dataset result(total, D);
+		for (int i = 0; i < total; ++i) std::copy(&recv[(size_t) i * D], &recv[(size_t) i * D] + D, result[i]);
+
+		return result;
+	}
+
+	// the sample subsample (seeding.hpp) would draw from every point together: the same draws on every rank, and every
+	// rank sends the rows it has. Indices are sorted there, so those are already in rank order
+	Dataset sample(int n) {
+
+		const int ranks = comm.size();
+		const int me = comm.rank();
+
+		std::vector<int> owner(n), rows;
+
+		if (weighted) {
+			// cumulative weights exactly like subsample adds them up, one rank after the other
+			std::vector<double> cumulative(points.size());
+			std::vector<double> prefix(ranks + 1, 0.0); // weight of every point before rank r
+
+			for (int r = 0; r < ranks; ++r) {
+				if (r == me) {
+					double total = prefix[r];
+					for (int i = 0; i < points.size(); ++i) cumulative[i] = total += weights[i];
+					prefix[r + 1] = total;
+				}
+				comm.broadcast(&prefix[r + 1], sizeof(double), r);
+			}
+
+			int lastRank = ranks - 1; // where the last point is, for draws past the total
+			while (lastRank > 0 && layout.pointsEnd(lastRank) == layout.pointsBegin(lastRank)) --lastRank;
+
+			std::uniform_real_distribution<double> uniform(0.0, prefix[ranks]);
+			for (int s = 0; s < n; ++s) {
+				const double u = uniform(gen);
+
+				// first point with cumulative weight > u
+				int r = std::upper_bound(prefix.begin() + 1, prefix.end(), u) - (prefix.begin() + 1);
+				owner[s] = r < ranks ? r : lastRank;
+
+				if (owner[s] == me) {
+					int i = std::upper_bound(cumulative.begin(), cumulative.end(), u) - cumulative.begin();
+					rows.push_back(std::min(i, points.size() - 1));
+				}
+			}
+		} else {
+			std::uniform_int_distribution<int> uniform(0, N - 1);
+			for (int s = 0; s < n; ++s) {
+				const int i = uniform(gen);
+
+				owner[s] = layout.rankOfPoint(i);
+				if (owner[s] == me) rows.push_back(i - begin());
+			}
+		}
+
+		std::sort(rows.begin(), rows.end());
+
+		std::vector<int> rowsPerRank(ranks, 0);
+		for (int r : owner) ++rowsPerRank[r];
+
+		return gather(rows, rowsPerRank);
+	}
+};
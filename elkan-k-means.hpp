@@ -0,0 +1,305 @@
+#pragma once
+
+#include "k-means-iteration.hpp"
+#include "slice-sums.hpp"
+#include "hamerly-k-means.hpp"
+#include <omp.h>
+#include <memory>
+
+
+// Elkan's algorithm ("Using the triangle inequality to accelerate k-means", 2003). Each point keeps an upper bound to its
+// centroid and K lower bounds, one for every centroid, and we keep the K x K table of distances between centroids. A
+// centroid j is only looked at if the upper bound is bigger than both its lower bound and half the distance between j and
+// the point's current centroid. Compared to Hamerly this prunes way more distances when K is big (K = 64 ~ 256), at the
+// cost of N * K bounds in memory.
+//
+// like Hamerly, bounds are loosened by BOUND_SLACK and whenever two distances are really compared it's the same squared
+// distances BasicLloydIteration compares (with the same tie breaking), so assignments are exactly the same.
+//
+// the memory cost is boundBytes(N, K), and can be cut in half storing bounds as float16 (ElkanLloydIteration<HalfBounds>).
+// Lower bounds are always rounded down when converted, so they stay valid. If the bounds would need more than maxBoundBytes,
+// the iterator uses Hamerly's single lower bound instead (and its stats).
+//
+// refreshEvery > 0 keeps the sums between iterations, like Hamerly (see delta-sums.hpp).
+
+
+// how lower bounds are stored
+struct FloatBounds {
+	using type = float;
+
+	static float load(float x) { return x; }
+	static float store(float x) { return x; }
+
+	// l[j] = lowerBound(l[j] - moved[j]) for all k bounds of a point (auto-vectorizes)
+	static void decrease(float* l, const float* moved, int k) {
+		for (int j = 0; j < k; ++j) {
+			l[j] = std::max(0.0f, (l[j] - moved[j]) * (1.0f - BOUND_SLACK));
+		}
+	}
+};
+
+// float16 done with integer ops, so it doesn't need F16C. Bounds are never negative, so converting down is just
+// dropping the last 13 bits of the mantissa; anything too small for a normal float16 becomes 0 and anything too big
+// becomes the max float16, both still lower bounds
+struct HalfBounds {
+	using type = uint16_t;
+
+	static float load(uint16_t x) {
+		uint32_t bits = x ? ((uint32_t) x << 13) + (112u << 23) : 0; // rebias the exponent (127 - 15 = 112)
+
+		float value;
+		std::memcpy(&value, &bits, sizeof(value));
+		return value;
+	}
+
+	// rounding down keeps it a lower bound
+	static uint16_t store(float x) {
+		if (!(x >= 6.103515625e-05f)) return 0; // smallest normal float16, 2^-14
+		if (x >= 65504.0f) return 0x7BFF;
+
+		uint32_t bits;
+		std::memcpy(&bits, &x, sizeof(bits));
+		return (bits - (112u << 23)) >> 13;
+	}
+
+	static void decrease(uint16_t* l, const float* moved, int k) {
+		for (int j = 0; j < k; ++j) {
+			l[j] = store(std::max(0.0f, (load(l[j]) - moved[j]) * (1.0f - BOUND_SLACK)));
+		}
+	}
+};
+
+
+// 4GB, the iterator falls back to Hamerly past this
+constexpr size_t DEFAULT_MAX_BOUND_BYTES = size_t(4) << 30;
+
+
+template <typename Bounds>
+struct ElkanIterationBase : LloydIteration {
+
+	using BoundType = typename Bounds::type;
+
+	std::vector<int> labels;
+	std::vector<float> upper;
+	std::vector<float> assignedDst; // exact squared distance to the assigned centroid, or -1 if it moved since
+	AlignedBuffer<BoundType> lower; // N * K, lower[i * K + j] is the lower bound of point i to centroid j
+
+	Dataset lastCentroids;
+	const size_t maxBoundBytes;
+
+	SliceSums slices;
+	DeltaSums deltaSums;
+
+	// used when N * K bounds don't fit in maxBoundBytes
+	std::unique_ptr<HamerlyIterationBase> fallback;
+
+	ElkanIterationBase(const DatasetView& pts, const float* weights, size_t maxBoundBytes, int refreshEvery = 0) :
+		LloydIteration(pts, weights), labels(N, -1), upper(N), assignedDst(N, -1.0f), maxBoundBytes(maxBoundBytes), deltaSums(refreshEvery) {}
+
+	// memory needed for the bounds with N points and K centroids (the N * K lower bounds dominate)
+	static size_t boundBytes(int N, int k) {
+		return (size_t) N * k * sizeof(BoundType) + (size_t) N * (sizeof(int) + 2 * sizeof(float));
+	}
+
+	// memory actually being used for the bounds right now
+	size_t boundBytes() const {
+		return lower.size() * sizeof(BoundType) + labels.size() * sizeof(int) + (upper.size() + assignedDst.size()) * sizeof(float);
+	}
+
+	bool usingFallback() const {
+		return fallback != nullptr;
+	}
+
+	template <class Fallback>
+	bool elkanIterate(Dataset& centroids, bool parallel) {
+
+		const int k = centroids.size();
+		const int D = centroids.dim();
+
+		if (!fallback && boundBytes(N, k) > maxBoundBytes) {
+			lower = AlignedBuffer<BoundType>();
+			fallback = std::make_unique<Fallback>(points, weights, deltaSums.refreshEvery);
+
+			// what was set on this iterator from outside: a distributed fit adds the sums of every rank in the slices of the
+			// whole dataset, and the fallback has to add its sums the same way or the ranks would drift apart
+			fallback->slices.layout = slices.layout;
+			fallback->trackChanges = trackChanges;
+		}
+		if (fallback) {
+			bool converged = fallback->iterate(centroids);
+			stats = fallback->stats;
+			return converged;
+		}
+
+		const bool rebuild = !lastCentroids.equals(centroids) || lower.size() != (size_t) N * k;
+		if (lower.size() != (size_t) N * k) lower = AlignedBuffer<BoundType>((size_t) N * k);
+
+		// halfCC[a * k + j] = half the distance between centroids a and j, s[a] = min over j != a
+		std::vector<float> halfCC(k * k);
+		std::vector<float> s(k, std::numeric_limits<float>::infinity());
+
+		for (int a = 0; a < k; ++a) {
+			halfCC[a * k + a] = 0.0f;
+			for (int j = a + 1; j < k; ++j) {
+				float dst = lowerBound(0.5f * std::sqrt(squaredEuclideanDistance(centroids[a], centroids[j], D)));
+				halfCC[a * k + j] = halfCC[j * k + a] = dst;
+				s[a] = std::min(s[a], dst);
+				s[j] = std::min(s[j], dst);
+			}
+		}
+
+		// kept between iterations (see slice-sums.hpp)
+		slices.prepare(N, k, D, parallel);
+		const bool full = deltaSums.fullIteration(slices, rebuild);
+
+		long long distances = 0, changed = 0;
+
+		const auto start = InstrumentClock::now();
+		auto assigned = start;
+
+		#pragma omp parallel if (parallel)
+		{
+
+			#pragma omp for schedule(dynamic, 1) reduction(+ : distances, changed)
+			for (int slice = 0; slice < slices.numSlices; ++slice) {
+
+				if (full) slices.clear(slice);
+				else deltaSums.clear(slice);
+
+				float* sums = slices.sums(slice);
+				float* counts = slices.counts(slice);
+				const int first = slices.begin(slice), last = slices.end(slice);
+
+				for (int i = first; i < last; ++i) {
+
+					int& a = labels[i];
+					const int previous = a;
+					BoundType* l = &lower[(size_t) i * k];
+
+					if (rebuild) {
+						// full search, the same loop as BasicLloydIteration, keeping every distance as a lower bound
+						float minDst = 1e30;
+						for (int j = 0; j < k; ++j) {
+							float dst = squaredEuclideanDistance(points[i], centroids[j], D);
+							l[j] = Bounds::store(lowerBound(std::sqrt(dst)));
+							if (dst < minDst) {
+								minDst = dst;
+								a = j;
+							}
+						}
+
+						upper[i] = upperBound(std::sqrt(minDst));
+						assignedDst[i] = minDst;
+						distances += k;
+
+					} else if (upper[i] >= s[a]) {
+
+						// squared distance to the current centroid, computed only when some other centroid can't be pruned
+						float bestDst = assignedDst[i];
+
+						for (int j = 0; j < k; ++j) {
+							if (j == a || upper[i] < Bounds::load(l[j]) || upper[i] < halfCC[a * k + j]) continue;
+
+							if (bestDst < 0.0f) {
+								bestDst = squaredEuclideanDistance(points[i], centroids[a], D);
+								upper[i] = upperBound(std::sqrt(bestDst));
+								l[a] = Bounds::store(lowerBound(std::sqrt(bestDst)));
+								++distances;
+
+								if (upper[i] < Bounds::load(l[j]) || upper[i] < halfCC[a * k + j]) continue;
+							}
+
+							float dst = squaredEuclideanDistance(points[i], centroids[j], D);
+							l[j] = Bounds::store(lowerBound(std::sqrt(dst)));
+							++distances;
+
+							// same tie breaking as the scalar loop: smallest index wins
+							if (dst < bestDst || (dst == bestDst && j < a)) {
+								bestDst = dst;
+								a = j;
+								upper[i] = upperBound(std::sqrt(dst));
+							}
+						}
+
+						assignedDst[i] = bestDst;
+					}
+
+					changed += a != previous;
+
+					if (!full) {
+						if (a != previous) deltaSums.move(slice, i, previous);
+						continue;
+					}
+
+					const float w = weight(i);
+					counts[a] += w;
+					for (int j = 0; j < D; ++j) {
+						sums[a * D + j] += w * points[i][j];
+					}
+				}
+			}
+
+			#pragma omp master
+			assigned = InstrumentClock::now();
+
+			// add up the sums of all slices
+			if (full) slices.reduce();
+		}
+
+		const auto updateStart = InstrumentClock::now();
+		recordPhases(start, assigned, updateStart);
+		stats.distances = distances;
+		stats.changed = changed;
+
+		Dataset oldCentroids = centroids;
+		bool converged = deltaSums.update(*this, centroids, slices, labels, full, changed > 0);
+
+		std::vector<float> moved(k);
+		bool anyMoved = false;
+		for (int j = 0; j < k; ++j) {
+			moved[j] = upperBound(std::sqrt(squaredEuclideanDistance(oldCentroids[j], centroids[j], D)));
+			anyMoved = anyMoved || moved[j] > 0.0f;
+		}
+
+		if (anyMoved) {
+			#pragma omp parallel for if (parallel)
+			for (int i = 0; i < N; ++i) {
+				Bounds::decrease(&lower[(size_t) i * k], moved.data(), k);
+
+				if (moved[labels[i]] > 0.0f) {
+					upper[i] = upperBound(upper[i] + moved[labels[i]]);
+					assignedDst[i] = -1.0f;
+				}
+			}
+		}
+
+		lastCentroids = centroids;
+
+		stats.updateMs = millisecondsBetween(updateStart, InstrumentClock::now());
+
+		return converged;
+	}
+};
+
+
+template <typename Bounds = FloatBounds>
+struct ElkanLloydIteration : ElkanIterationBase<Bounds> {
+
+	ElkanLloydIteration(const DatasetView& pts, const float* weights = nullptr, size_t maxBoundBytes = DEFAULT_MAX_BOUND_BYTES, int refreshEvery = 0) :
+		ElkanIterationBase<Bounds>(pts, weights, maxBoundBytes, refreshEvery) {}
+
+	bool iterate(Dataset& centroids) override {
+		return this->template elkanIterate<HamerlyLloydIteration>(centroids, false);
+	}
+};
+
+template <typename Bounds = FloatBounds>
+struct ParallelElkanLloydIteration : ElkanIterationBase<Bounds> {
+
+	ParallelElkanLloydIteration(const DatasetView& pts, const float* weights = nullptr, size_t maxBoundBytes = DEFAULT_MAX_BOUND_BYTES, int refreshEvery = 0) :
+		ElkanIterationBase<Bounds>(pts, weights, maxBoundBytes, refreshEvery) {}
+
+	bool iterate(Dataset& centroids) override {
+		return this->template elkanIterate<ParallelSIMDHamerlyLloydIteration>(centroids, true);
+	}
+};
@@ -0,0 +1,201 @@
+#pragma once
+
+#include "k-means-iteration.hpp"
+#include "slice-sums.hpp"
+#include <omp.h>
+
+
+// assignment for high dimensional data (embeddings, D = 128 ~ 1024). The kernel of SIMDLloydIteration computes every
+// distance as its own sum of D squared differences, which is fine when D is small but turns into a long chain of
+// dependent adds per centroid as D grows. Here distances are written as ||x||^2 - 2 x.c + ||c||^2: the norms of the
+// points are computed once, the norms of the centroids once per iteration, and all that's left is the dot products of a
+// block of points with every centroid, which is a small matrix multiplication (see dotProducts in simd-kernels.hpp for
+// how it's blocked for registers and caches).
+//
+// the expanded form loses precision when distances are small compared to the norms. Points and centroids are centered
+// on the mean of the points (each block of points is centered while it's copied for the dot products), which keeps the
+// norms about as small as the distances themselves, and the expanded distances are only used to find candidates: the
+// rounding error of each approximate distance is at most `tolerance` times ||x||^2 + ||c||^2, and every centroid whose
+// approximate distance is within that error of the best one is compared with the exact squared distance, in index
+// order. So the assignments are exactly the same as BasicLloydIteration, and in practice the exact check almost never
+// runs (it needs two centroids at about the same distance).
+
+struct GemmIterationBase : LloydIteration {
+
+	// points per block (multiple of 4, the rows of a tile)
+	static constexpr int BLOCK = 64;
+
+	const int D;
+
+	// relative error of the approximate distances, including the error of the exact distance they're compared to
+	const float tolerance;
+
+	// mean of the points, and ||x - mean||^2 of every point
+	std::vector<float> mean;
+	std::vector<float> pointNorms;
+
+	SliceSums slices;
+
+	GemmIterationBase(const DatasetView& pts, const float* weights = nullptr) : LloydIteration(pts, weights), D(pts.dim()),
+		tolerance((2 * D + 4) * std::numeric_limits<float>::epsilon()), mean(D, 0.0f), pointNorms(N) {
+
+		std::vector<double> sum(D, 0.0);
+		for (int i = 0; i < N; ++i) {
+			for (int d = 0; d < D; ++d) sum[d] += points[i][d];
+		}
+		for (int d = 0; d < D; ++d) mean[d] = N ? sum[d] / N : 0.0;
+
+		#pragma omp parallel for
+		for (int i = 0; i < N; ++i) {
+			pointNorms[i] = squaredEuclideanDistance(points[i], mean.data(), D);
+		}
+	}
+
+	// closest centroid to point i, given the dot products of the point with the packed centroids
+	int closestCentroid(int i, const float* dots, const Dataset& centroids, const std::vector<float>& norms, const std::vector<int>& position, std::vector<float>& approx) const {
+
+		const int k = centroids.size();
+		const float x = pointNorms[i];
+
+		float best = std::numeric_limits<float>::infinity();
+		int first = 0;
+
+		for (int j = 0; j < k; ++j) {
+			approx[j] = x + norms[j] - 2.0f * dots[position[j]];
+			if (approx[j] < best) {
+				best = approx[j];
+				first = j;
+			}
+		}
+
+		// centroids that can't be told apart from the best one with the approximate distances
+		int a = first;
+		float bestDst = -1.0f; // exact squared distance to a, only computed if needed
+
+		for (int j = 0; j < k; ++j) {
+			if (j == first || approx[j] - best > tolerance * (2.0f * x + norms[j] + norms[first])) continue;
+
+			if (bestDst < 0.0f) bestDst = squaredEuclideanDistance(points[i], centroids[a], D);
+
+			// same tie breaking as the scalar loop: smallest index wins
+			float dst = squaredEuclideanDistance(points[i], centroids[j], D);
+			if (dst < bestDst || (dst == bestDst && j < a)) {
+				bestDst = dst;
+				a = j;
+			}
+		}
+
+		return a;
+	}
+
+	bool gemmIterate(Dataset& centroids, bool parallel) {
+
+		const int k = centroids.size();
+
+		// centroids - mean, ||c - mean||^2, and where the dot product with each centroid ends up (see PackedCentroids)
+		Dataset centered(k, D);
+		std::vector<float> norms(k);
+		std::vector<int> position(k);
+
+		for (int j = 0; j < k; ++j) {
+			for (int d = 0; d < D; ++d) centered[j][d] = centroids[j][d] - mean[d];
+			norms[j] = squaredEuclideanDistance(centroids[j], mean.data(), D);
+		}
+
+		// always the widest vectors: the tiles have 2 groups anyway, so nothing is wasted unless K is really small
+		PackedCentroids packed(centered.data(), k, D, centered.stride, currentISA());
+		const int W = lanes(packed.isa);
+		const int ld = packed.groups * W;
+
+		for (int j = 0; j < k; ++j) position[j] = (j % packed.groups) * W + j / packed.groups;
+
+		// kept between iterations (see slice-sums.hpp)
+		slices.prepare(N, k, D, parallel);
+
+		int* labels = trackedLabels();
+		long long changed = 0;
+
+		const auto start = InstrumentClock::now();
+		auto assigned = start;
+
+		#pragma omp parallel if (parallel)
+		{
+
+			AlignedBuffer<float> dots((size_t) BLOCK * ld);
+			Dataset block(BLOCK, D); // centered copy of the points of the block
+			std::vector<float> approx(k);
+			const float* rows[BLOCK];
+
+			#pragma omp for schedule(dynamic, 1) reduction(+ : changed)
+			for (int slice = 0; slice < slices.numSlices; ++slice) {
+
+				slices.clear(slice);
+				float* sums = slices.sums(slice);
+				float* counts = slices.counts(slice);
+				const int first = slices.begin(slice), last = slices.end(slice);
+
+				for (int begin = first; begin < last; begin += BLOCK) {
+
+					int end = std::min(begin + BLOCK, last);
+
+					for (int i = begin; i < end; ++i) {
+						for (int d = 0; d < D; ++d) block[i - begin][d] = points[i][d] - mean[d];
+					}
+
+					// the last block is padded to a multiple of 4 rows by repeating its last point
+					int numRows = roundUp(end - begin, 4);
+					for (int r = 0; r < numRows; ++r) rows[r] = block[std::min(begin + r, end - 1) - begin];
+
+					dotProducts(packed.isa, rows, numRows, packed.packed.data(), packed.groups, D, dots.data());
+
+					for (int i = begin; i < end; ++i) {
+						int centroidIndex = closestCentroid(i, &dots[(size_t) (i - begin) * ld], centroids, norms, position, approx);
+
+						if (labels) {
+							changed += labels[i] != centroidIndex;
+							labels[i] = centroidIndex;
+						}
+
+						// accumulate points assigned to given centroid to later get their mean
+						const float w = weight(i);
+						counts[centroidIndex] += w;
+						for (int j = 0; j < D; ++j) {
+							sums[centroidIndex * D + j] += w * points[i][j];
+						}
+					}
+				}
+			}
+
+			#pragma omp master
+			assigned = InstrumentClock::now();
+
+			// add up the sums of all slices
+			slices.reduce();
+		}
+
+		recordPhases(start, assigned, InstrumentClock::now());
+		stats.distances = (long long) N * k; // the dot products (the few exact checks aren't counted)
+		if (labels) stats.changed = changed;
+
+		return updateCentroids(centroids, slices.sums(0), D, slices.counts(0));
+	}
+};
+
+
+struct GemmLloydIteration : GemmIterationBase {
+
+	GemmLloydIteration(const DatasetView& pts, const float* weights = nullptr) : GemmIterationBase(pts, weights) {}
+
+	bool iterate(Dataset& centroids) override {
+		return gemmIterate(centroids, false);
+	}
+};
+
+struct ParallelGemmLloydIteration : GemmIterationBase {
+
+	ParallelGemmLloydIteration(const DatasetView& pts, const float* weights = nullptr) : GemmIterationBase(pts, weights) {}
+
+	bool iterate(Dataset& centroids) override {
+		return gemmIterate(centroids, true);
+	}
+};
@@ -0,0 +1,236 @@
+#pragma once
+
+#include "k-means-iteration.hpp"
+#include "slice-sums.hpp"
+#include "simd.hpp"
+#include <omp.h>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+
+
+// k-means on points stored as float16 or bfloat16, for big high dimensional data (embeddings, D = 128 and up). With
+// that many dimensions an iteration is mostly streaming the N * D floats from memory, and storing them in 16 bits halves
+// those bytes (and the memory they take). Centroids, distances and sums are still floats: the points are converted
+// right before they're used, a block at a time into a buffer small enough to stay in L1 (F16C for float16 on AVX and
+// up, a shift for bfloat16), and that block goes through the same kernel as ParallelSIMDLloydIteration and is added to
+// the sums from there. So the only thing lost is the rounding of the points: labels and centroids are exactly the ones
+// ParallelSIMDLloydIteration gives on the points converted back to floats (HalfPoints::toDataset).
+//
+// float16 keeps 11 bits of mantissa but only goes up to 65504 (and loses precision below 6e-5), bfloat16 has the range
+// of a float with 8 bits of mantissa. Normalized embeddings fit float16 well; bfloat16 is for data with any range.
+
+
+// round to nearest even, like F16C. Too big becomes inf
+uint16_t floatToHalf(float x) {
+	uint32_t bits;
+	std::memcpy(&bits, &x, sizeof(bits));
+
+	const uint16_t sign = (bits >> 16) & 0x8000;
+	const uint32_t magnitude = bits & 0x7FFFFFFF;
+
+	if (magnitude > 0x7F800000) return sign | 0x7E00; // nan
+	if (magnitude >= 0x477FF000) return sign | 0x7C00; // rounds to 65520 or more (or is inf)
+
+	// below 2^-14 it's a subnormal float16, a multiple of 2^-24 (and rounding up to 2^-14 gives the smallest normal)
+	if (magnitude < 0x38800000) {
+		float value;
+		std::memcpy(&value, &magnitude, sizeof(value));
+		return sign | (uint16_t) std::nearbyint(value * 16777216.0f);
+	}
+
+	// rebias the exponent (127 - 15 = 112) and drop 13 bits of mantissa, which can carry into the exponent
+	const uint32_t rebiased = magnitude - (112u << 23);
+	return sign | ((rebiased + 0xFFF + ((rebiased >> 13) & 1)) >> 13);
+}
+
+// round to nearest even
+uint16_t floatToBFloat16(float x) {
+	uint32_t bits;
+	std::memcpy(&bits, &x, sizeof(bits));
+
+	if ((bits & 0x7FFFFFFF) > 0x7F800000) return (bits >> 16) | 0x40; // keep nans nans
+	return (bits + 0x7FFF + ((bits >> 16) & 1)) >> 16;
+}
+
+
+// N points of D 16 bit values, tightly packed (point i at data + i * D). Never copied, and nothing past the last point
+// is ever read
+struct HalfView {
+
+	// floats a block of points takes once converted, so they stay in L1 while the kernel goes through them
+	static constexpr int BLOCK_FLOATS = 4096;
+
+	const uint16_t* data = nullptr;
+	int N = 0, D = 0;
+	HalfFormat format = HalfFormat::Float16;
+
+	HalfView() = default;
+	HalfView(const uint16_t* data, int N, int D, HalfFormat format) : data(data), N(N), D(D), format(format) {}
+
+	const uint16_t* operator [] (size_t i) const { return data + i * D; }
+
+	int size() const { return N; }
+	int dim() const { return D; }
+
+	float value(size_t i, int d) const {
+		return format == HalfFormat::Float16 ? halfToFloat(data[i * D + d]) : bfloat16ToFloat(data[i * D + d]);
+	}
+
+	// points per block (see BLOCK_FLOATS)
+	int blockRows() const {
+		return std::clamp(BLOCK_FLOATS / std::max(D, 1), 4, 256);
+	}
+
+	// floats the buffer of toFloats needs for blocks of blockRows points
+	size_t blockFloats() const {
+		return (size_t) blockRows() * D;
+	}
+
+	// points [begin, end) as floats, written to out (room for (end - begin) * D floats)
+	DatasetView toFloats(int begin, int end, float* out) const {
+		halfToFloats(currentISA(), format, (*this)[begin], (size_t) (end - begin) * D, out);
+		return DatasetView(out, end - begin, D);
+	}
+};
+
+
+// owns the 16 bit copy of some points
+struct HalfPoints {
+
+	AlignedBuffer<uint16_t> buffer;
+	int N = 0, D = 0;
+	HalfFormat format = HalfFormat::Float16;
+
+	HalfPoints() = default;
+
+	HalfPoints(const DatasetView& points, HalfFormat format = HalfFormat::Float16, bool parallel = true) :
+		buffer((size_t) points.size() * points.dim()), N(points.size()), D(points.dim()), format(format) {
+
+		#pragma omp parallel for if (parallel) schedule(static)
+		for (int i = 0; i < N; ++i) {
+			uint16_t* row = buffer.data() + (size_t) i * D;
+			for (int d = 0; d < D; ++d) row[d] = format == HalfFormat::Float16 ? floatToHalf(points[i][d]) : floatToBFloat16(points[i][d]);
+		}
+	}
+
+	HalfView view() const {
+		return HalfView(buffer.data(), N, D, format);
+	}
+
+	size_t bytes() const {
+		return buffer.size() * sizeof(uint16_t);
+	}
+
+	// the points as they're stored, back in floats
+	Dataset toDataset() const {
+		const HalfView half = view();
+
+		Dataset points(N, D);
+		for (int i = 0; i < N; ++i) {
+			for (int d = 0; d < D; ++d) points[i][d] = half.value(i, d);
+		}
+
+		return points;
+	}
+};
+
+
+struct HalfIterationBase : LloydIteration {
+
+	const HalfView half;
+
+	// kept between iterations (see slice-sums.hpp)
+	SliceSums slices;
+
+	// the points of LloydIteration only give the shape, there are no float points
+	HalfIterationBase(const HalfView& half) : LloydIteration(DatasetView(nullptr, half.size(), half.dim())), half(half) {}
+
+	bool halfIterate(Dataset& centroids, bool parallel) {
+
+		const int k = centroids.size();
+		const int D = half.dim();
+		const int rows = half.blockRows();
+
+		slices.prepare(N, k, D, parallel);
+
+		const PackedCentroids packed(centroids);
+
+		int* lastLabels = trackedLabels();
+		long long changed = 0;
+
+		const auto start = InstrumentClock::now();
+		auto assigned = start;
+
+		#pragma omp parallel if (parallel)
+		{
+
+			AlignedBuffer<float> block(half.blockFloats());
+			std::vector<int> labels(rows);
+
+			#pragma omp for schedule(dynamic, 1) reduction(+ : changed)
+			for (int slice = 0; slice < slices.numSlices; ++slice) {
+
+				slices.clear(slice);
+				float* sums = slices.sums(slice);
+				float* counts = slices.counts(slice);
+				const int first = slices.begin(slice), last = slices.end(slice);
+
+				for (int begin = first; begin < last; begin += rows) {
+
+					int end = std::min(begin + rows, last);
+					const DatasetView converted = half.toFloats(begin, end, block.data());
+					packed.closest(converted, 0, end - begin, labels.data());
+
+					for (int i = begin; i < end; ++i) {
+						int centroidIndex = labels[i - begin];
+
+						if (lastLabels) {
+							changed += lastLabels[i] != centroidIndex;
+							lastLabels[i] = centroidIndex;
+						}
+
+						// same adds as ParallelSIMDLloydIteration with weights of 1
+						const float* p = converted[i - begin];
+						counts[centroidIndex] += 1.0f;
+						for (int d = 0; d < D; ++d) {
+							sums[centroidIndex * D + d] += p[d];
+						}
+					}
+				}
+			}
+
+			#pragma omp master
+			assigned = InstrumentClock::now();
+
+			// add up the sums of all slices
+			slices.reduce();
+		}
+
+		recordPhases(start, assigned, InstrumentClock::now());
+		stats.distances = (long long) N * k;
+		if (lastLabels) stats.changed = changed;
+
+		return updateCentroids(centroids, slices.sums(0), D, slices.counts(0));
+	}
+};
+
+
+struct HalfLloydIteration : HalfIterationBase {
+
+	HalfLloydIteration(const HalfView& half) : HalfIterationBase(half) {}
+
+	bool iterate(Dataset& centroids) override {
+		return halfIterate(centroids, false);
+	}
+};
+
+struct ParallelHalfLloydIteration : HalfIterationBase {
+
+	ParallelHalfLloydIteration(const HalfView& half) : HalfIterationBase(half) {}
+
+	bool iterate(Dataset& centroids) override {
+		return halfIterate(centroids, true);
+	}
+};
@@ -0,0 +1,247 @@
+#pragma once
+
+#include "k-means-iteration.hpp"
+#include "slice-sums.hpp"
+#include "delta-sums.hpp"
+#include <omp.h>
+
+
+// Hamerly's algorithm ("Making k-means even faster", 2010). Instead of computing all K distances for every point, each
+// point keeps an upper bound u on the distance to its assigned centroid and a single lower bound l on the distance to
+// every other centroid. If u < max(l, s(a)), where s(a) is half the distance from centroid a to its closest centroid,
+// the point can't change cluster and no distance is computed. After the centroids move, bounds are updated using how
+// much each centroid moved (triangle inequality), so they stay valid without looking at the points again.
+//
+// late iterations barely move any centroid, so most points are skipped. The assignments are exactly the same as
+// BasicLloydIteration: when a point can't be skipped, all K squared distances are compared just like there, and the bounds
+// are slightly loosened (see BOUND_SLACK) so float rounding never prunes the real argmin.
+//
+// bounds only make sense for the centroids they were computed with, so the last centroids are kept and if iterate gets
+// anything else (first call, or someone changed them between calls) the bounds are rebuilt from scratch.
+//
+// labels are kept anyway, so stats.changed is always counted (before the first iteration, every label is -1). With
+// refreshEvery > 0, the sums are kept too and only the points that changed cluster are moved (see delta-sums.hpp).
+
+struct HamerlyIterationBase : LloydIteration {
+
+	std::vector<int> labels;
+	std::vector<float> upper, lower;
+
+	// centroids the bounds are valid for
+	Dataset lastCentroids;
+
+	SliceSums slices;
+	DeltaSums deltaSums;
+
+	HamerlyIterationBase(const DatasetView& pts, const float* weights = nullptr, int refreshEvery = 0) : LloydIteration(pts, weights), labels(N, -1), upper(N), lower(N), deltaSums(refreshEvery) {}
+
+	// carries on from labels and bounds kept from before (see KMeansSession). They must be valid for these points and
+	// lastCentroids (or lastCentroids empty, and then they're rebuilt)
+	HamerlyIterationBase(const DatasetView& pts, const float* weights, std::vector<int>&& labels, std::vector<float>&& upper, std::vector<float>&& lower, Dataset&& lastCentroids) :
+		LloydIteration(pts, weights), labels(std::move(labels)), upper(std::move(upper)), lower(std::move(lower)), lastCentroids(std::move(lastCentroids)) {
+
+		assert(this->labels.size() == (size_t) N && this->upper.size() == (size_t) N && this->lower.size() == (size_t) N);
+	}
+
+	// s[j] = half the distance from centroid j to its closest centroid
+	std::vector<float> halfClosestCentroidDistances(const Dataset& centroids) const {
+
+		const int k = centroids.size();
+		const int D = centroids.dim();
+
+		std::vector<float> s(k, std::numeric_limits<float>::infinity());
+
+		for (int i = 0; i < k; ++i) {
+			for (int j = i + 1; j < k; ++j) {
+				float dst = 0.5f * std::sqrt(squaredEuclideanDistance(centroids[i], centroids[j], D));
+				s[i] = std::min(s[i], dst);
+				s[j] = std::min(s[j], dst);
+			}
+		}
+
+		for (int j = 0; j < k; ++j) s[j] = lowerBound(s[j]);
+
+		return s;
+	}
+
+	// closest and second closest centroid with the scalar loop (same comparisons as BasicLloydIteration)
+	static int closestTwoCentroids(const float* point, const Dataset& centroids, float& minDst, float& secondMinDst) {
+
+		minDst = secondMinDst = std::numeric_limits<float>::infinity();
+		int centroidIndex = -1;
+
+		for (int j = 0; j < centroids.size(); ++j) {
+			float dst = squaredEuclideanDistance(point, centroids[j], centroids.dim());
+			if (dst < minDst) {
+				secondMinDst = minDst;
+				minDst = dst;
+				centroidIndex = j;
+			} else if (dst < secondMinDst) {
+				secondMinDst = dst;
+			}
+		}
+
+		return centroidIndex;
+	}
+
+	template <bool useSIMD>
+	bool hamerlyIterate(Dataset& centroids, bool parallel) {
+
+		const int k = centroids.size();
+		const int D = centroids.dim();
+
+		const bool rebuild = !lastCentroids.equals(centroids);
+		const std::vector<float> s = halfClosestCentroidDistances(centroids);
+
+		// kept between iterations (see slice-sums.hpp)
+		slices.prepare(N, k, D, parallel);
+		const bool full = deltaSums.fullIteration(slices, rebuild);
+
+		PackedCentroids packed = useSIMD ? PackedCentroids(centroids) : PackedCentroids();
+
+		long long distances = 0, changed = 0;
+
+		const auto start = InstrumentClock::now();
+		auto assigned = start;
+
+		#pragma omp parallel if (parallel)
+		{
+
+			#pragma omp for schedule(dynamic, 1) reduction(+ : distances, changed)
+			for (int slice = 0; slice < slices.numSlices; ++slice) {
+
+				if (full) slices.clear(slice);
+				else deltaSums.clear(slice);
+
+				float* sums = slices.sums(slice);
+				float* counts = slices.counts(slice);
+				const int first = slices.begin(slice), last = slices.end(slice);
+
+				for (int i = first; i < last; ++i) {
+
+					int& a = labels[i];
+					const int previous = a;
+
+					bool search = rebuild;
+
+					if (!search) {
+						float m = std::max(s[a], lower[i]);
+
+						// if the bounds fail, tighten the upper bound and try again before doing the full search
+						if (upper[i] >= m) {
+							upper[i] = upperBound(std::sqrt(squaredEuclideanDistance(points[i], centroids[a], D)));
+							search = upper[i] >= m;
+							++distances;
+						}
+					}
+
+					if (search) {
+						float minDst, secondMinDst;
+						a = useSIMD ? packed.closestTwo(points[i], minDst, secondMinDst)
+						           : closestTwoCentroids(points[i], centroids, minDst, secondMinDst);
+
+						upper[i] = upperBound(std::sqrt(minDst));
+						lower[i] = lowerBound(std::sqrt(secondMinDst));
+						distances += k;
+					}
+
+					changed += a != previous;
+
+					if (!full) {
+						if (a != previous) deltaSums.move(slice, i, previous);
+						continue;
+					}
+
+					const float w = weight(i);
+					counts[a] += w;
+					for (int j = 0; j < D; ++j) {
+						sums[a * D + j] += w * points[i][j];
+					}
+				}
+			}
+
+			#pragma omp master
+			assigned = InstrumentClock::now();
+
+			// add up the sums of all slices
+			if (full) slices.reduce();
+		}
+
+		const auto updateStart = InstrumentClock::now();
+		recordPhases(start, assigned, updateStart);
+		stats.distances = distances;
+		stats.changed = changed;
+
+		Dataset oldCentroids = centroids;
+		bool converged = deltaSums.update(*this, centroids, slices, labels, full, changed > 0);
+
+		// how much each centroid moved, and the two biggest moves (a point's lower bound only cares
+		// about centroids other than its own, so if its centroid moved the most, the second biggest is enough)
+		std::vector<float> moved(k);
+		int farthest = 0;
+		float maxMove = 0.0f, secondMaxMove = 0.0f;
+
+		for (int j = 0; j < k; ++j) {
+			moved[j] = upperBound(std::sqrt(squaredEuclideanDistance(oldCentroids[j], centroids[j], D)));
+
+			if (moved[j] > maxMove) {
+				secondMaxMove = maxMove;
+				maxMove = moved[j];
+				farthest = j;
+			} else if (moved[j] > secondMaxMove) {
+				secondMaxMove = moved[j];
+			}
+		}
+
+		if (maxMove > 0.0f) {
+			#pragma omp parallel for if (parallel)
+			for (int i = 0; i < N; ++i) {
+				upper[i] = upperBound(upper[i] + moved[labels[i]]);
+				lower[i] = lowerBound(lower[i] - (labels[i] == farthest ? secondMaxMove : maxMove));
+			}
+		}
+
+		lastCentroids = centroids;
+
+		stats.updateMs = millisecondsBetween(updateStart, InstrumentClock::now());
+
+		return converged;
+	}
+};
+
+
+struct HamerlyLloydIteration : HamerlyIterationBase {
+
+	HamerlyLloydIteration(const DatasetView& pts, const float* weights = nullptr, int refreshEvery = 0) : HamerlyIterationBase(pts, weights, refreshEvery) {}
+
+	bool iterate(Dataset& centroids) override {
+		return hamerlyIterate<false>(centroids, false);
+	}
+};
+
+struct ParallelHamerlyLloydIteration : HamerlyIterationBase {
+
+	ParallelHamerlyLloydIteration(const DatasetView& pts, const float* weights = nullptr, int refreshEvery = 0) : HamerlyIterationBase(pts, weights, refreshEvery) {}
+
+	bool iterate(Dataset& centroids) override {
+		return hamerlyIterate<false>(centroids, true);
+	}
+};
+
+struct SIMDHamerlyLloydIteration : HamerlyIterationBase {
+
+	SIMDHamerlyLloydIteration(const DatasetView& pts, const float* weights = nullptr, int refreshEvery = 0) : HamerlyIterationBase(pts, weights, refreshEvery) {}
+
+	bool iterate(Dataset& centroids) override {
+		return hamerlyIterate<true>(centroids, false);
+	}
+};
+
+struct ParallelSIMDHamerlyLloydIteration : HamerlyIterationBase {
+
+	ParallelSIMDHamerlyLloydIteration(const DatasetView& pts, const float* weights = nullptr, int refreshEvery = 0) : HamerlyIterationBase(pts, weights, refreshEvery) {}
+
+	bool iterate(Dataset& centroids) override {
+		return hamerlyIterate<true>(centroids, true);
+	}
+};
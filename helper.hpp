@@ -1,8 +1,17 @@
 #pragma once
 
-#include <x86intrin.h>
-
+#include "simd.hpp"
+#include <cstdint>
+#include <new>
+#include <limits>
+#include <algorithm>
+#include <cmath>
+
+// with FixedD != 0 the number of dimensions is known at compile time and n is ignored (see dispatchDim in simd.hpp)
+template <int FixedD = 0>
 float squaredEuclideanDistance(const float* p1, const float* p2, int n) {
+	if (FixedD) n = FixedD;
+
 	float dst = 0.0f;
 	for (size_t i = 0; i < n; ++i) {
 		dst += (p1[i] - p2[i]) * (p1[i] - p2[i]);
@@ -12,87 +21,15 @@ float squaredEuclideanDistance(const float* p1, const float* p2, int n) {
 }
 
 
-__m256* allocAVX(uint32_t n) {
-	return new (std::align_val_t(32)) __m256[n];
-}
-
-void freeAVX(__m256* vecs) {
-	::operator delete[] (vecs, std::align_val_t(32));
-}
-
-
-__m128 hminSSE(__m128 vec) {
-	// vec = [x3, x2, x1, x0]
-	vec = _mm_min_ps(vec, _mm_shuffle_ps(vec, vec, _MM_SHUFFLE(2, 1, 0, 3))); // vec = [min(x3, x2), min(x2, x1), min(x1, x0), min(x0, x3)]
-	vec = _mm_min_ps(vec, _mm_shuffle_ps(vec, vec, _MM_SHUFFLE(1, 0, 3, 2)));
-	// vec = [min(x3, x2, x1, x0), min(x2, x1, x0, x3), min(x1, x0, x3, x2), min(x0, x3, x2, x1)] (min of all elements)
-
-	return vec;
-}
-
-__m256 hminAVX(__m256 vec) {
-
-	vec = _mm256_min_ps(vec, _mm256_permute2f128_ps(vec, vec, 0b11)); // gets min of first 4 with last 4
-
-	// same idea as SSE
-	vec = _mm256_min_ps(vec, _mm256_permute_ps(vec, 0b01001110));
-	vec = _mm256_min_ps(vec, _mm256_permute_ps(vec, 0b10110001));
+// bounds used by the triangle inequality methods (Hamerly, Elkan) are computed in float, so they are made slightly
+// looser than the real distances. Summing D positive squared terms has a relative error around D * 2^-24, so this
+// covers any D we care about, and rounding can never make a bound prune the centroid that the exact comparison picks
+constexpr float BOUND_SLACK = 1e-4f;
 
-	return vec;
+float upperBound(float dst) {
+	return dst * (1.0f + BOUND_SLACK);
 }
 
-
-void updateArgmin(__m256& minIdxs, __m256 currentIdxs, __m256& minDistances, __m256 currentDistances) {
-	__m256 mask = _mm256_cmp_ps(minDistances, currentDistances, _CMP_GT_OQ); // where new distance is smaller than min distance
-	minIdxs = _mm256_blendv_ps(minIdxs, currentIdxs, mask); // update index where distance is smaller
-	minDistances = _mm256_min_ps(currentDistances, minDistances); // update min distances
-}
-
-int argminAVX(__m256 vec) {
-
-	// example: vec = [5, 2, 3, 7, 11, 2, 4, 10]
-	// indices:        0  1  2  3   4  5  6   7 --> argmin = 1
-
-	__m256 minVal = hminAVX(vec); // minVal = [2, 2, 2, 2, 2, 2, 2, 2]
-	int mask = _mm256_movemask_ps(_mm256_cmp_ps(minVal, vec, _CMP_EQ_OQ)); // mask = 0b00100010 (1 where vec's element == minVal)
-	//                                                                                       ^
-	return __builtin_ctz(mask); // index of first bit set in mask  --------------------------| = 1
-}
-
-
-// sets a single value of a __m256
-template <int index>
-void setValue(__m256& vec, float value) {
-	constexpr uint8_t mask = 1 << index;
-    vec = _mm256_blend_ps(vec, _mm256_set1_ps(value), mask); // value will be set where mask is 1
-}
-
-void setValue(__m256& vec, float value, uint32_t index = 0) {
-
-	// index should be a compile-time constant
-	switch (index % 8) { // modulo by power of two is basically free
-		case 0: vec = _mm256_blend_ps(vec, _mm256_set1_ps(value), 1 << 0); break;
-		case 1: vec = _mm256_blend_ps(vec, _mm256_set1_ps(value), 1 << 1); break;
-		case 2: vec = _mm256_blend_ps(vec, _mm256_set1_ps(value), 1 << 2); break;
-		case 3: vec = _mm256_blend_ps(vec, _mm256_set1_ps(value), 1 << 3); break;
-		case 4: vec = _mm256_blend_ps(vec, _mm256_set1_ps(value), 1 << 4); break;
-		case 5: vec = _mm256_blend_ps(vec, _mm256_set1_ps(value), 1 << 5); break;
-		case 6: vec = _mm256_blend_ps(vec, _mm256_set1_ps(value), 1 << 6); break;
-		case 7: vec = _mm256_blend_ps(vec, _mm256_set1_ps(value), 1 << 7); break;
-	}
-}
-
-
-// calculates distances between one points to 8 points simultaneously
-__m256 calculateDistances8x(const float* point, const __m256* points, int n) {
-
-	// this works really well with low dimensions, opposed to calculating
-	// one distance 8 dimensions at a time (for obvious reasons)
-	__m256 dst = _mm256_setzero_ps();
-	for (int d = 0; d < n; ++d) {
-		__m256 diff = _mm256_sub_ps(_mm256_set1_ps(point[d]), points[d]);
-		dst = _mm256_add_ps(dst, _mm256_mul_ps(diff, diff));
-	}
-
-	return dst;
+float lowerBound(float dst) {
+	return std::max(0.0f, dst * (1.0f - BOUND_SLACK));
 }
@@ -0,0 +1,194 @@
+#pragma once
+
+#include <vector>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <ostream>
+#include <omp.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#endif
+
+
+// what each iteration of a fit did, to know where the time of a job goes without a profiler. Every iterator fills the
+// phases and counters of LloydIteration::stats as it goes (a few clock reads per iteration, nothing per point), and
+// LloydIteration::step adds the total time and the hardware counters and hands them to an IterationObserver.
+
+
+using InstrumentClock = std::chrono::steady_clock;
+
+inline double millisecondsBetween(InstrumentClock::time_point start, InstrumentClock::time_point end) {
+	return std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+
+// summed over every thread that was counted (see PerfCounters)
+struct HardwareCounts {
+	bool valid = false; // false if the counters couldn't be opened (or weren't asked for)
+	uint64_t cycles = 0, instructions = 0, cacheMisses = 0;
+
+	double ipc() const {
+		return cycles ? (double) instructions / cycles : 0.0;
+	}
+
+	HardwareCounts operator - (const HardwareCounts& other) const {
+		return { valid && other.valid, cycles - other.cycles, instructions - other.instructions, cacheMisses - other.cacheMisses };
+	}
+};
+
+
+struct IterationStats {
+
+	int iteration = 0; // 1 for the first iteration an iterator did
+
+	// parallel iterators: assignment lasts until the slowest thread is done with its points, and whatever the parallel
+	// region takes after that is reducing (the pairwise additions of the slice sums, see slice-sums.hpp, or adding the
+	// sums of every thread for the kd-tree)
+	double assignMs = 0.0;
+	double reduceMs = 0.0;
+	double updateMs = 0.0; // new centroids from the sums (and moving the bounds, for Hamerly and Elkan)
+	double totalMs = 0.0;
+
+	long long distances = 0; // distances computed from a point (or a kd-tree box) to a centroid
+	long long changed = -1; // points that changed cluster, -1 if not counted (see LloydIteration::trackChanges)
+	float maxShift = 0.0f; // how far the centroid that moved the most went
+
+	HardwareCounts hardware;
+};
+
+
+struct IterationObserver {
+
+	// brute force iterators only know how many points changed cluster if they keep the labels of the last iteration, and
+	// the kd-tree has to go through every point of the subtrees it assigns at once, so this costs O(N) per iteration
+	bool countChanges = true;
+
+	// cycles, instructions and cache misses of every iteration (Linux only, see PerfCounters)
+	bool hardwareCounters = false;
+
+	virtual ~IterationObserver() = default;
+
+	virtual void iterationDone(const IterationStats& /* stats */) {}
+	virtual void fitDone(int /* iterations */, bool /* converged */) {}
+};
+
+
+// one line per iteration
+struct PrintingObserver : IterationObserver {
+
+	std::ostream& out;
+
+	PrintingObserver(std::ostream& out, bool hardwareCounters = false) : out(out) {
+		this->hardwareCounters = hardwareCounters;
+	}
+
+	void iterationDone(const IterationStats& s) override {
+		out << "iteration " << s.iteration << ": " << s.totalMs << " ms (assign " << s.assignMs << ", reduce " << s.reduceMs
+		    << ", update " << s.updateMs << "), " << s.distances << " distances";
+		if (s.changed >= 0) out << ", " << s.changed << " changed";
+		out << ", max shift " << s.maxShift;
+		if (s.hardware.valid) {
+			out << ", " << s.hardware.cycles << " cycles, ipc " << s.hardware.ipc() << ", " << s.hardware.cacheMisses << " cache misses";
+		}
+		out << "\n";
+	}
+
+	void fitDone(int iterations, bool converged) override {
+		out << (converged ? "Converged in " : "Stopped after ") << iterations << " iterations.\n";
+	}
+};
+
+
+// hardware counters with perf_event_open. A counter only counts the thread that opened it, so every OpenMP thread opens
+// its own (in a parallel region, so these are the threads of the pool that later parallel regions reuse) and reading
+// sums them. Only user space is counted, which most systems allow without privileges (perf_event_paranoid <= 2).
+// open returns false where that's not possible (other systems, containers without perf), and reads are then invalid.
+struct PerfCounters {
+
+	static constexpr int EVENTS = 3; // cycles, instructions, cache misses
+
+	std::vector<int> fds; // EVENTS per thread, -1 if not open
+
+	PerfCounters() = default;
+	PerfCounters(const PerfCounters&) = delete;
+	PerfCounters& operator = (const PerfCounters&) = delete;
+
+	~PerfCounters() {
+		close();
+	}
+
+	bool isOpen() const {
+		return !fds.empty();
+	}
+
+	bool open() {
+		close();
+
+#ifdef __linux__
+		const uint64_t configs[EVENTS] = { PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES };
+
+		std::vector<int> opened(omp_get_max_threads() * EVENTS, -1);
+		bool failed = false;
+
+		#pragma omp parallel
+		{
+			const int t = omp_get_thread_num();
+
+			for (int e = 0; e < EVENTS; ++e) {
+				perf_event_attr attr;
+				std::memset(&attr, 0, sizeof(attr));
+				attr.size = sizeof(attr);
+				attr.type = PERF_TYPE_HARDWARE;
+				attr.config = configs[e];
+				attr.exclude_kernel = 1;
+				attr.exclude_hv = 1;
+
+				int fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+				if (fd < 0) {
+					#pragma omp atomic write
+					failed = true;
+				}
+				opened[t * EVENTS + e] = fd;
+			}
+		}
+
+		fds = std::move(opened);
+		if (failed) close();
+#endif
+
+		return isOpen();
+	}
+
+	void close() {
+#ifdef __linux__
+		for (int fd : fds) {
+			if (fd >= 0) ::close(fd);
+		}
+#endif
+		fds.clear();
+	}
+
+	HardwareCounts read() const {
+		HardwareCounts counts;
+		if (!isOpen()) return counts;
+
+#ifdef __linux__
+		uint64_t* fields[EVENTS] = { &counts.cycles, &counts.instructions, &counts.cacheMisses };
+
+		for (size_t f = 0; f < fds.size(); ++f) {
+			uint64_t value;
+			if (fds[f] < 0 || ::read(fds[f], &value, sizeof(value)) != sizeof(value)) continue;
+			*fields[f % EVENTS] += value;
+		}
+
+		counts.valid = true;
+#endif
+
+		return counts;
+	}
+};
@@ -2,58 +2,152 @@
 #define K_MEANS_ITERATION_HPP
 
 #include "helper.hpp"
+#include "dataset.hpp"
+#include "instrumentation.hpp"
 
 #include <vector>
 
+// every centroid with points becomes their mean: sums + i * stride has the weighted sum of the points of cluster i, and
+// counts[i] their total weight. Returns whether no centroid changed, and writes how far the one that moved the most went
+bool moveCentroids(Dataset& centroids, const float* sums, size_t stride, const float* counts, float& maxShift) {
+
+	const int K = centroids.size();
+	const int D = centroids.dim();
+
+	bool converged = true;
+	float maxSquaredShift = 0.0f;
+
+	for (int i = 0; i < K; ++i) {
+		if (!counts[i]) {
+			converged = converged && std::all_of(centroids[i], centroids[i] + D, [](float x) { return x == 0.0f; });
+			continue;
+		}
+
+		float invCount = 1.0f / counts[i];
+		float shift = 0.0f;
+		for (int j = 0; j < D; ++j) {
+			float newVal = sums[i * stride + j] * invCount;
+
+			converged = converged && (newVal == centroids[i][j]);
+
+			shift += (newVal - centroids[i][j]) * (newVal - centroids[i][j]);
+			centroids[i][j] = newVal;
+		}
+
+		maxSquaredShift = std::max(maxSquaredShift, shift);
+	}
+
+	maxShift = std::sqrt(maxSquaredShift);
+
+	return converged;
+}
+
+
 struct LloydIteration {
 
-	const std::vector<std::vector<float>>& points;
+	// points are never copied, so whatever owns them must outlive the iterator
+	const DatasetView points;
 	const int N;
 
-	LloydIteration(const std::vector<std::vector<float>>& pts) : points(pts), N(pts.size()) {}
+	// weight of every point (nullptr means all 1, and the same for whatever owns them). A point with weight w counts
+	// like w copies of it, so the N distinct colors of an image with their number of pixels (see collapseDuplicates)
+	// give the same assignments as the whole image
+	const float* const weights;
 
-	bool updateCentroids(std::vector<std::vector<float>>& centroids, const std::vector<std::vector<float>>& newCenters, const std::vector<float>& counts) {
+	// what the last iteration did (see instrumentation.hpp). Iterators that don't keep labels between iterations only
+	// count the points that changed cluster with trackChanges, keeping the last labels in lastLabels
+	IterationStats stats;
+	bool trackChanges = false;
+	std::vector<int> lastLabels;
 
-		const int K = centroids.size();
-		const int D = centroids[0].size();
+	int iterations = 0;
 
-		bool converged = true;
+	LloydIteration(const DatasetView& pts, const float* weights = nullptr) : points(pts), N(pts.size()), weights(weights) {
+		assert(pts.isRowMajor());
+	}
 
-		for (int i = 0; i < centroids.size(); ++i) {
-			if (!counts[i]) {
-				converged = converged && (centroids[i] == std::vector<float>(D, 0.0f));
-				continue;
-			}
+	virtual ~LloydIteration() = default;
 
-			float invCount = 1.0f / counts[i];
-			for (int j = 0; j < centroids[0].size(); ++j) {
-				float newVal = newCenters[i][j] * invCount;
+	float weight(int i) const {
+		return weights ? weights[i] : 1.0f;
+	}
 
-				converged = converged && (newVal == centroids[i][j]);
+	// labels of the last iteration, or nullptr if changes aren't being tracked (the first tracked iteration counts every point)
+	int* trackedLabels() {
+		if (!trackChanges) return nullptr;
+		if (lastLabels.size() != (size_t) N) lastLabels.assign(N, -1);
+		return lastLabels.data();
+	}
 
-				centroids[i][j] = newVal;
-			}
-		}
+	// assignment ends when the slowest thread is done with its points, the rest of the parallel region is the reduction
+	void recordPhases(InstrumentClock::time_point start, InstrumentClock::time_point assigned, InstrumentClock::time_point end) {
+		stats.assignMs = millisecondsBetween(start, assigned);
+		stats.reduceMs = millisecondsBetween(assigned, end);
+	}
+
+	// newCenters has the weighted sum of the points of each cluster, and counts their total weight
+	bool updateCentroids(Dataset& centroids, const Dataset& newCenters, const std::vector<float>& counts) {
+		return updateCentroids(centroids, newCenters.data(), newCenters.stride, counts.data());
+	}
+
+	// same, with the sums of cluster i at sums + i * stride
+	bool updateCentroids(Dataset& centroids, const float* sums, size_t stride, const float* counts) {
+
+		const auto start = InstrumentClock::now();
+
+		bool converged = moveCentroids(centroids, sums, stride, counts, stats.maxShift);
+
+		stats.updateMs = millisecondsBetween(start, InstrumentClock::now());
 
 		return converged;
 	}
 
-	virtual bool iterate(std::vector<std::vector<float>>& centroids) = 0;
+	virtual bool iterate(Dataset& centroids) = 0;
+
+	// iterate, and then the total time and hardware counters (if perf is open) of the iteration, and tell the observer
+	bool step(Dataset& centroids, IterationObserver* observer = nullptr, const PerfCounters* perf = nullptr) {
+
+		stats = IterationStats();
+
+		const HardwareCounts before = perf ? perf->read() : HardwareCounts();
+		const auto start = InstrumentClock::now();
+
+		bool converged = iterate(centroids);
+
+		stats.totalMs = millisecondsBetween(start, InstrumentClock::now());
+		if (perf) stats.hardware = perf->read() - before;
+		stats.iteration = ++iterations;
+
+		if (observer) observer->iterationDone(stats);
+
+		return converged;
+	}
 };
 
 
 struct BasicLloydIteration : LloydIteration {
 
-    BasicLloydIteration(const std::vector<std::vector<float>>& pts) : LloydIteration(pts) {}
+    BasicLloydIteration(const DatasetView& pts, const float* weights = nullptr) : LloydIteration(pts, weights) {}
+
+	bool iterate(Dataset& centroids) override {
+		return dispatchDim(centroids.dim(), [&](auto fixedD) { return iterateFixed<fixedD>(centroids); });
+	}
 
-	bool iterate(std::vector<std::vector<float>>& centroids) override {
+	// FixedD != 0 means D is known at compile time, so the loops over dimensions are unrolled (see dispatchDim in simd.hpp)
+	template <int FixedD>
+	bool iterateFixed(Dataset& centroids) {
 
 		const int k = centroids.size();
-		const int D = centroids[0].size();
+		const int D = FixedD ? FixedD : centroids.dim();
 
-		std::vector<std::vector<float>> newCenters(k, std::vector<float>(D, 0.0f));
+		Dataset newCenters(k, D, 0.0f);
 		std::vector<float> counts(k, 0.0f);
 
+		int* labels = trackedLabels();
+		long long changed = 0;
+
+		const auto start = InstrumentClock::now();
+
 		for (size_t i = 0; i < N; ++i) {
 
 			float minDst = 1e30;
@@ -61,20 +155,31 @@ struct BasicLloydIteration : LloydIteration {
 
 			// find nearest centroid for this point
 			for (size_t j = 0; j < k; ++j) {
-				float dst = squaredEuclideanDistance(points[i].data(), centroids[j].data(), D);
+				float dst = squaredEuclideanDistance<FixedD>(points[i], centroids[j], D);
 				if (dst < minDst) {
 					minDst = dst;
 					centroidIndex = j;
 				}
 			}
 
+			if (labels) {
+				changed += labels[i] != centroidIndex;
+				labels[i] = centroidIndex;
+			}
+
 			// accumulate points assigned to given centroid to later get their mean
-			counts[centroidIndex]++;
+			const float w = weight(i);
+			counts[centroidIndex] += w;
 			for (int j = 0; j < D; ++j) {
-				newCenters[centroidIndex][j] += points[i][j];
+				newCenters[centroidIndex][j] += w * points[i][j];
 			}
 		}
 
+		const auto assigned = InstrumentClock::now();
+		recordPhases(start, assigned, assigned);
+		stats.distances = (long long) N * k;
+		if (labels) stats.changed = changed;
+
 		return updateCentroids(centroids, newCenters, counts);
 	}
 };
@@ -0,0 +1,143 @@
+#pragma once
+
+#include "k-means.hpp"
+#include "hamerly-k-means.hpp"
+#include <omp.h>
+#include <cmath>
+
+
+// k-means on a sequence of datasets that barely change from one to the next, like the frames of a video being
+// quantized. KMeans::fit starts every fit from nothing; a session starts each frame from the centroids of the last one,
+// and also keeps the labels and the bounds of Hamerly's algorithm (see hamerly-k-means.hpp) from one frame to the next.
+//
+// the bounds are about distances from the points, so when a point moves they're moved the same way the centroids move
+// them: the upper bound grows by how far the point went and the lower bound shrinks by as much (triangle inequality).
+// Points that didn't change at all keep their bounds as they are. So a frame that is mostly the same as the last one
+// starts with almost every point already assigned, and the first iteration only computes distances for the points that
+// changed. That needs the last frame, which is copied (the caller's buffer is usually reused for the next frame).
+//
+// each frame stops when the centroids stop moving or the one that moved the most went at most `tolerance`, which is
+// usually after one or two iterations. Assignments are the same as SIMDLloydIteration from the same centroids. If a
+// frame has a different number of points or dimensions than the last one, nothing is kept but the centroids.
+
+struct KMeansSession {
+
+	// the centroids, seeding and observer are the ones of this model
+	KMeans model;
+
+	// stop a frame when no centroid moved more than this (0 means only when they stop moving at all)
+	float tolerance = 0.0f;
+
+	int maxIter = 500;
+	bool parallel = true;
+
+	// copy of the last frame, and the labels and bounds of its points (valid for boundCentroids)
+	Dataset previous;
+	std::vector<int> labels;
+	std::vector<float> upper, lower;
+	Dataset boundCentroids;
+
+	int frames = 0;
+
+	KMeansSession(int k, unsigned seed = std::random_device{}()) : model(k, seed) {}
+
+	struct FrameIteration : HamerlyIterationBase {
+
+		const bool parallel;
+
+		FrameIteration(const DatasetView& pts, const float* weights, KMeansSession& session) :
+			HamerlyIterationBase(pts, weights, std::move(session.labels), std::move(session.upper), std::move(session.lower), std::move(session.boundCentroids)),
+			parallel(session.parallel) {}
+
+		bool iterate(Dataset& centroids) override {
+			return hamerlyIterate<true>(centroids, parallel);
+		}
+	};
+
+	// fits the next frame, starting from the centroids of the last one (seeded like KMeans if there are none, or they
+	// have the wrong shape). The frame (and weights) are only used during the call. Returns the number of iterations,
+	// like KMeans::fit
+	int fit(const DatasetView& frame, const float* weights = nullptr) {
+
+		if (model.centroids.size() != model.k || model.centroids.dim() != frame.dim()) model.initializeCentroids(frame, weights);
+		++frames;
+
+		carryOver(frame);
+
+		FrameIteration iterator(frame, weights, *this);
+
+		PerfCounters perf;
+		if (model.observer && model.observer->hardwareCounters) perf.open();
+
+		int steps = 0;
+		bool converged = false, settled = false;
+
+		while (steps < maxIter && !settled) {
+			++steps;
+			converged = iterator.step(model.centroids, model.observer, perf.isOpen() ? &perf : nullptr);
+			settled = converged || iterator.stats.maxShift <= tolerance;
+		}
+
+		const int iterations = steps - converged; // last iteration didn't count if the centroids didn't move
+
+		labels = std::move(iterator.labels);
+		upper = std::move(iterator.upper);
+		lower = std::move(iterator.lower);
+		boundCentroids = std::move(iterator.lastCentroids);
+
+		if (model.observer) model.observer->fitDone(iterations, settled);
+		return iterations;
+	}
+
+	// starts over with the next frame (e.g. after a scene cut), seeding it like the first one
+	void reset() {
+		model.centroids = Dataset();
+		previous = Dataset();
+	}
+
+	const Dataset& centroids() const {
+		return model.centroids;
+	}
+
+	// clusters of the last frame, from its last assignment (so for the final centroids unless the last iteration moved them)
+	const std::vector<int>& frameLabels() const {
+		return labels;
+	}
+
+	// moves the bounds by how far every point went since the last frame and keeps a copy of this one, or starts the bounds
+	// over if the shape changed
+	void carryOver(const DatasetView& frame) {
+
+		const int N = frame.size();
+		const int D = frame.dim();
+
+		const bool fresh = previous.size() != N || previous.dim() != D;
+
+		if (fresh) {
+			previous = Dataset(N, D);
+			labels.assign(N, -1);
+			upper.assign(N, 0.0f);
+			lower.assign(N, 0.0f);
+			boundCentroids = Dataset(); // rebuilt at the first iteration
+		}
+
+		#pragma omp parallel for if (parallel) schedule(static)
+		for (int i = 0; i < N; ++i) {
+
+			if (fresh) {
+				std::copy(frame[i], frame[i] + D, previous[i]);
+				continue;
+			}
+
+			float moved = squaredEuclideanDistance(frame[i], previous[i], D);
+
+			if (moved > 0.0f) {
+				moved = upperBound(std::sqrt(moved));
+				upper[i] = upperBound(upper[i] + moved);
+				lower[i] = lowerBound(lower[i] - moved);
+
+				std::copy(frame[i], frame[i] + D, previous[i]);
+			}
+		}
+	}
+};
@@ -1,81 +1,294 @@
 #ifndef K_MEANS_HPP
 #define K_MEANS_HPP
 
-#include "../rng.h"
 #include "helper.hpp"
 #include "k-means-iteration.hpp"
+#include "dataset.hpp"
+#include "seeding.hpp"
+#include "mini-batch-k-means.hpp"
+#include "weighted-points.hpp"
+#include "pixel-k-means.hpp"
+#include "half-k-means.hpp"
 
 #include <vector>
+#include <iostream>
+#include <random>
+#include <algorithm>
+#include <omp.h>
+
+
+enum class Seeding { KMeansPlusPlus, KMeansParallel };
+
+
+// fitProgressive runs Lloyd on random samples of the points that grow by `growth` each time (the smallest one has at
+// least minSample points), each one starting from the centroids of the last, and then on every point. Most of the
+// iterations of a fit are spent moving centroids across the space, which a sample a fraction of the size does just as
+// well, so the iterations on every point only have to settle the last details. It ends like fit, at a fixed point of
+// the iterator on every point, just for a fraction of the passes over them.
+struct ProgressiveOptions {
+	int growth = 4;
+	int minSample = 0; // 0 means 64 points per centroid
+
+	// the iterations on a sample stop when no centroid moves more than this (0 means when they stop moving at all)
+	float sampleTolerance = 0.0f;
+};
+
+struct ProgressiveReport {
+	std::vector<int> sampleSizes; // of every stage, the last one is every point
+	std::vector<int> iterations; // in every stage
+
+	int totalIterations = 0;
+	double fullPasses = 0.0; // points read by every iteration together, in multiples of N
+	bool converged = false;
+
+	// iterations run on samples (every stage but the last). What this saves can only be measured against a fit on every
+	// point, which can take a very different number of iterations than the last stage
+	int sampleIterations() const {
+		return iterations.empty() ? 0 : totalIterations - iterations.back();
+	}
+};
 
 
 struct KMeans {
 
-	std::vector<std::vector<float>> centroids;
-	std::vector<std::vector<float>> points;
+	Dataset centroids;
+	DatasetView points;
 	int k;
 
-	int N, D;
+	// only used when points are given as std::vector<std::vector<float>>, otherwise we just keep a view
+	Dataset ownedPoints;
 
-	KMeans(int k) : k(k) {
+	// weight of every point (nullptr means all 1), not copied either. Used by seeding and passed to the iterators
+	const float* weights = nullptr;
 
-	}
+	// 8 bit pixels for the pixel iterators (see pixel-k-means.hpp), not copied either
+	PixelView pixels;
 
+	// 16 bit points for the half iterators (see half-k-means.hpp), not copied either
+	HalfView half;
 
-	// k-means++ (slow!)
-	std::vector<std::vector<float>> initializeCentroids() {
+	int N, D;
 
-		std::vector<std::vector<float>> newCentroids;
-		std::vector<float> distances(N, 0.0f);
+	// how initializeCentroids chooses the centroids. Seeding only looks at seedingSampleSize points chosen at random,
+	// SEEDING_SAMPLE per centroid if it's 0 (a few hundred per centroid is plenty and makes it basically free), or at
+	// every point if it's negative (see seedingPoints in seeding.hpp)
+	Seeding seeding = Seeding::KMeansPlusPlus;
+	int seedingSampleSize = 0;
+	std::mt19937 gen;
 
-		newCentroids.push_back(rng::choice(points));
+	// gets the stats of every iteration of fit (see instrumentation.hpp). Not owned
+	IterationObserver* observer = nullptr;
 
-		for (int numCentroids = 1; numCentroids < k; ++numCentroids) {
+	// prints "Converged in N iterations." at the end of fit
+	bool verbose = false;
 
-			for (size_t i = 0; i < N; ++i) {
-				distances[i] = squaredEuclideanDistance(&newCentroids[0][0], &points[i][0], D);
+	KMeans(int k, unsigned seed = std::random_device{}()) : k(k), gen(seed) {
 
-				for (size_t j = 1; j < numCentroids; ++j) {
-					distances[i] = std::min(distances[i], squaredEuclideanDistance(newCentroids[j].data(), points[i].data(), D));
-				}
-			}
+	}
 
-			newCentroids.push_back(points[rng::sample(distances)]);
-		}
 
-		return newCentroids;
+	Dataset initializeCentroids() {
+		const int n = seedingPoints(seedingSampleSize, k, N);
+
+		if (seeding == Seeding::KMeansParallel) return kMeansParallel(points, k, gen, 5, 0.0, true, n, weights);
+		return kMeansPlusPlus(points, k, gen, true, n, weights);
 	}
 
-	void initializeCentroids(const std::vector<std::vector<float>>& pts) {
+	// the points (and weights) are NOT copied, they must outlive this model
+	void initializeCentroids(const DatasetView& pts, const float* pointWeights = nullptr) {
 		N = pts.size();
-		D = pts[0].size();
+		D = pts.dim();
 		points = pts;
+		weights = pointWeights;
 
 		centroids = initializeCentroids();
 	}
 
+	void initializeCentroids(const std::vector<std::vector<float>>& pts) {
+		ownedPoints = Dataset(pts);
+		initializeCentroids(ownedPoints.view());
+	}
+
+	// distinct points of collapseDuplicates, weighted by their number of copies
+	void initializeCentroids(const WeightedPoints& pts) {
+		initializeCentroids(pts.view(), pts.weights.data());
+	}
+	void initializeCentroids(WeightedPoints&&) = delete; // they would be gone before fit
+
+	// 8 bit pixels, for fit with PixelLloydIteration or ParallelPixelLloydIteration (the other iterators need float points).
+	// The pixels seeding looks at (see seedingSampleSize) are converted to floats, so the float copy of the image is
+	// never made
+	void initializeCentroids(const PixelView& px) {
+		N = px.size();
+		D = px.dim();
+		pixels = px;
+		points = DatasetView();
+		weights = nullptr;
+
+		initializeFromSample([&](int i, float* point) {
+			const unsigned char* p = pixels[i];
+			for (int d = 0; d < D; ++d) point[d] = p[d];
+		});
+	}
+
+	// 16 bit points, for fit with HalfLloydIteration or ParallelHalfLloydIteration. Seeded from a sample converted to
+	// floats, like pixels
+	void initializeCentroids(const HalfView& pts) {
+		N = pts.size();
+		D = pts.dim();
+		half = pts;
+		points = DatasetView();
+		weights = nullptr;
+
+		initializeFromSample([&](int i, float* point) {
+			for (int d = 0; d < D; ++d) point[d] = half.value(i, d);
+		});
+	}
 
-	template <class Iterator = BasicLloydIteration, typename = std::enable_if_t<std::is_base_of_v<LloydIteration, Iterator>>>
-	int fit(int maxIter = 500) {
+	// seeds from the points seedingSampleSize asks for, chosen at random, or all of them if there aren't more.
+	// copy(i, point) writes point i as floats
+	template <class Copy>
+	void initializeFromSample(Copy&& copy) {
+		const int n = seedingPoints(seedingSampleSize, k, N);
+		Dataset sample(n, D);
 
-		Iterator iterator(points);
+		std::uniform_int_distribution<int> pick(0, N - 1);
+		for (int i = 0; i < n; ++i) copy(n == N ? i : pick(gen), sample[i]);
+
+		if (seeding == Seeding::KMeansParallel) centroids = kMeansParallel(sample.view(), k, gen, 5, 0.0, true);
+		else centroids = kMeansPlusPlus(sample.view(), k, gen, true);
+	}
 
-		int iter = 0;
-		while (++iter <= maxIter && !iterator.iterate(centroids)) {}
 
-		--iter; // last iteration didn't count (centroids didn't move)
+	// pixel iterators take the pixels, half iterators the 16 bit points, every other one the points and their weights
+	template <class Iterator, typename... Args>
+	Iterator makeIterator(Args&&... args) {
+		if constexpr (std::is_base_of_v<PixelIterationBase, Iterator>) return Iterator(pixels, std::forward<Args>(args)...);
+		else if constexpr (std::is_base_of_v<HalfIterationBase, Iterator>) return Iterator(half, std::forward<Args>(args)...);
+		else return Iterator(points, weights, std::forward<Args>(args)...);
+	}
 
-		cout << "Converged in " << iter << " iterations.\n";
+	// any extra arguments are forwarded to the iterator's constructor (after the points and weights, the pixels or the
+	// 16 bit points)
+	template <class Iterator = BasicLloydIteration, typename = std::enable_if_t<std::is_base_of_v<LloydIteration, Iterator>>, typename... Args>
+	int fit(int maxIter = 500, Args&&... args) {
+
+		Iterator iterator = makeIterator<Iterator>(std::forward<Args>(args)...);
+
+		bool converged;
+		int iter = iterate(iterator, maxIter, 0.0f, converged);
+
+		if (observer) observer->fitDone(iter, converged);
+		if (verbose) std::cout << "Converged in " << iter << " iterations.\n";
 		return iter;
 	}
 
+	// steps until the centroids stop moving (or no centroid moves more than tolerance), at most maxIter times. Returns
+	// the number of iterations, where the last one doesn't count if the centroids didn't move
+	int iterate(LloydIteration& iterator, int maxIter, float tolerance, bool& converged) {
+
+		PerfCounters perf;
+		if (observer) {
+			iterator.trackChanges = observer->countChanges;
+			if (observer->hardwareCounters) perf.open();
+		}
+
+		int iter = 0;
+		converged = false;
+		while (++iter <= maxIter && !(converged = iterator.step(centroids, observer, perf.isOpen() ? &perf : nullptr))) {
+			if (tolerance > 0.0f && iterator.stats.maxShift <= tolerance) return iter;
+		}
+
+		return iter - 1; // last iteration didn't count (centroids didn't move)
+	}
+
+	// fit on growing samples, and then every point (see ProgressiveOptions). Samples are nested (each one has every point
+	// of the last) and keep the weights of their points. maxIter is for each stage. Not for pixels or 16 bit points
+	template <class Iterator = BasicLloydIteration, typename... Args>
+	ProgressiveReport fitProgressive(int maxIter = 500, const ProgressiveOptions& options = {}, Args&&... args) {
+		static_assert(!std::is_base_of_v<PixelIterationBase, Iterator> && !std::is_base_of_v<HalfIterationBase, Iterator>, "fitProgressive needs float points");
+
+		const int growth = std::max(2, options.growth);
+		const int minSample = options.minSample > 0 ? options.minSample : 64 * k;
+
+		ProgressiveReport report;
+		for (int n = N / growth; n >= minSample && n >= k; n /= growth) report.sampleSizes.insert(report.sampleSizes.begin(), n);
+		report.sampleSizes.push_back(N);
+
+		// the first n of a random order are the sample of n points
+		std::vector<int> order(report.sampleSizes.size() > 1 ? N : 0);
+		for (int i = 0; i < (int) order.size(); ++i) order[i] = i;
+		std::shuffle(order.begin(), order.end(), gen);
+
+		for (size_t stage = 0; stage < report.sampleSizes.size(); ++stage) {
+
+			const int n = report.sampleSizes[stage];
+			const bool last = stage + 1 == report.sampleSizes.size();
+
+			Dataset sample;
+			std::vector<float> sampleWeights;
+
+			if (!last) {
+				std::vector<int> rows(order.begin(), order.begin() + n);
+				std::sort(rows.begin(), rows.end()); // friendlier to the cache
+
+				sample = Dataset(n, D);
+				if (weights) sampleWeights.resize(n);
+
+				for (int s = 0; s < n; ++s) {
+					std::copy(points[rows[s]], points[rows[s]] + D, sample[s]);
+					if (weights) sampleWeights[s] = weights[rows[s]];
+				}
+			}
+
+			Iterator iterator(last ? points : sample.view(), last ? weights : (weights ? sampleWeights.data() : nullptr), args...);
+
+			bool converged;
+			int iter = iterate(iterator, maxIter, last ? 0.0f : options.sampleTolerance, converged);
+
+			// the iteration that found the centroids didn't move still read the points
+			const int steps = iterator.iterations;
+			report.iterations.push_back(iter);
+			report.totalIterations += steps;
+			report.fullPasses += (double) steps * n / N;
+			report.converged = converged;
+		}
+
+		if (observer) observer->fitDone(report.iterations.back(), report.converged);
+		if (verbose) std::cout << "Converged in " << report.iterations.back() << " iterations on every point (" << report.fullPasses << " passes in total).\n";
+		return report;
+	}
+
+
+	// mini-batch k-means over any source of points (they don't have to fit in memory, and `points` isn't used).
+	// Starts from the current centroids if they have the right shape. Returns the number of batches used
+	long fitMiniBatch(BatchSource& source, const MiniBatchOptions& options = {}) {
+
+		MiniBatchKMeans model(k);
+		model.centroids = std::move(centroids);
+
+		long numBatches = model.fit(source, options, gen());
+
+		centroids = std::move(model.centroids);
+		D = centroids.dim();
+
+		return numBatches;
+	}
+
 
 	// returns index of closest centroid
-	int classify(const std::vector<float>& point) {
+	int classify(const float* point) {
+		return dispatchDim(D, [&](auto fixedD) { return classify<fixedD>(point); });
+	}
+
+	// same, with D known at compile time if FixedD != 0 (see dispatchDim in simd.hpp)
+	template <int FixedD>
+	int classify(const float* point) {
 		float minDst = 1e30;
 		int centroidIndex = -1;
 
 		for (size_t i = 0; i < k; ++i) {
-			float dst = squaredEuclideanDistance(point.data(), centroids[i].data(), D);
+			float dst = squaredEuclideanDistance<FixedD>(point, centroids[i], D);
 			if (dst < minDst) {
 				minDst = dst;
 				centroidIndex = i;
@@ -85,6 +298,79 @@ struct KMeans {
 		return centroidIndex;
 	}
 
+	int classify(const std::vector<float>& point) {
+		return classify(point.data());
+	}
+
+
+	// closest centroid of every point, written to labels[0, N) (and the squared distances to minDst if it's not null).
+	// Same labels as classify, but with the SIMD kernel of SIMDLloydIteration and split between threads, which is what
+	// remapping the pixels of an image after fitting should use
+	void predict(const DatasetView& pts, int* labels, float* minDst = nullptr, bool parallel = true) const {
+
+		constexpr int BLOCK = 256;
+
+		const PackedCentroids packed(centroids);
+		const int n = pts.size();
+
+		#pragma omp parallel for if (parallel) schedule(static)
+		for (int begin = 0; begin < n; begin += BLOCK) {
+			int end = std::min(begin + BLOCK, n);
+			packed.closest(pts, begin, end, &labels[begin], minDst ? &minDst[begin] : nullptr);
+		}
+	}
+
+	// same for 8 bit pixels, with the kernel of the pixel iterators (same labels as predicting them as floats)
+	void predict(const PixelView& px, int* labels, bool parallel = true) const {
+
+		constexpr int BLOCK = PackedPixelCentroids::BLOCK;
+
+		const PackedPixelCentroids packed(centroids);
+		const int n = px.size();
+
+		#pragma omp parallel for if (parallel) schedule(static)
+		for (int begin = 0; begin < n; begin += BLOCK) {
+			int end = std::min(begin + BLOCK, n);
+			packed.closest(px, begin, end, &labels[begin]);
+		}
+	}
+
+	// same for 16 bit points, a block at a time converted to floats (same labels as predicting them as floats)
+	void predict(const HalfView& pts, int* labels, bool parallel = true) const {
+
+		const PackedCentroids packed(centroids);
+		const int n = pts.size();
+		const int rows = pts.blockRows();
+
+		#pragma omp parallel if (parallel)
+		{
+			AlignedBuffer<float> block(pts.blockFloats());
+
+			#pragma omp for schedule(static)
+			for (int begin = 0; begin < n; begin += rows) {
+				int end = std::min(begin + rows, n);
+				packed.closest(pts.toFloats(begin, end, block.data()), 0, end - begin, &labels[begin]);
+			}
+		}
+	}
+
+	// labels of the points collapseDuplicates was called with: every distinct point is labeled once and copied to its
+	// duplicates, so this costs about as much as labeling the distinct points
+	void predict(const WeightedPoints& pts, int* labels, float* minDst = nullptr, bool parallel = true) const {
+
+		std::vector<int> distinctLabels(pts.size());
+		std::vector<float> distinctDst(minDst ? pts.size() : 0);
+		predict(pts.view(), distinctLabels.data(), minDst ? distinctDst.data() : nullptr, parallel);
+
+		const int n = pts.index.size();
+
+		#pragma omp parallel for if (parallel) schedule(static)
+		for (int i = 0; i < n; ++i) {
+			labels[i] = distinctLabels[pts.index[i]];
+			if (minDst) minDst[i] = distinctDst[pts.index[i]];
+		}
+	}
+
 };
 
 
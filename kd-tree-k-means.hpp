@@ -0,0 +1,366 @@
+#pragma once
+
+#include "k-means-iteration.hpp"
+#include <omp.h>
+
+
+// filtering algorithm (Kanungo et al., "An efficient k-means clustering algorithm: analysis and implementation", 2002).
+// a kd-tree is built once over the points, and every node caches the sum and count of the points inside it. Each
+// iteration walks the tree carrying a list of candidate centroids: at each node, the candidate closest to the middle of
+// the node's box (z*) is found, and any candidate z that is farther than z* from every point of the box is dropped (it's
+// enough to check the box corner in the direction of z - z*). When a single candidate is left, the whole subtree goes to
+// it in O(1) using the cached sums, so no distance to any of its points is ever computed.
+//
+// this works great when D is small (color quantization!) and gets worse quickly as D grows, since boxes stop being
+// "small" compared to the distances between centroids.
+//
+// assignments are the same as BasicLloydIteration: candidates are only dropped when they are farther by a margin bigger
+// than float rounding (see BOUND_SLACK) and leaves compare the same squared distances, in the same order. Sums are
+// accumulated in double (they're added per node instead of per point), so centroids can differ from the other iterators
+// in the last bits.
+//
+// with trackChanges, assigning a whole subtree has to go through its points to update their labels (kept in the order
+// of sortedPoints), which makes every iteration O(N) again.
+
+struct KdTreeIterationBase : LloydIteration {
+
+	// leaves with this many points or less aren't split
+	static constexpr int LEAF_SIZE = 32;
+
+	struct Node {
+		int begin, end; // range of points in sortedPoints
+		int left = -1, right = -1; // children (-1 for leaves)
+	};
+
+	const int D;
+
+	std::vector<Node> nodes;
+	std::vector<float> boxMin, boxMax, boxMid; // nodes * D
+	std::vector<float> halfDiagonals; // half the length of the box diagonal, for each node
+	std::vector<double> nodeSums; // nodes * D, weighted
+	std::vector<double> nodeWeights; // total weight of the points of each node
+
+	// points (and their weights) reordered so every node is a contiguous range
+	Dataset sortedPoints;
+	std::vector<float> sortedWeights;
+
+	int depth = 0;
+
+	KdTreeIterationBase(const DatasetView& pts, const float* weights = nullptr) : LloydIteration(pts, weights), D(pts.dim()) {
+
+		std::vector<int> order(N);
+		for (int i = 0; i < N; ++i) order[i] = i;
+
+		nodes.reserve(2 * (N / LEAF_SIZE + 1));
+		if (N) build(order, 0, N, 1);
+
+		sortedPoints = Dataset(N, D);
+		sortedWeights.resize(N);
+		for (int i = 0; i < N; ++i) {
+			std::copy(points[order[i]], points[order[i]] + D, sortedPoints[i]);
+			sortedWeights[i] = weight(order[i]);
+		}
+	}
+
+	// builds the node for order[begin, end), splitting at the median of the widest dimension. Returns the node index
+	int build(std::vector<int>& order, int begin, int end, int level) {
+
+		depth = std::max(depth, level);
+
+		int node = nodes.size();
+		nodes.push_back({ begin, end });
+
+		boxMin.resize(boxMin.size() + D, std::numeric_limits<float>::infinity());
+		boxMid.resize(boxMid.size() + D);
+		boxMax.resize(boxMax.size() + D, -std::numeric_limits<float>::infinity());
+		nodeSums.resize(nodeSums.size() + D, 0.0);
+		nodeWeights.push_back(0.0);
+
+		for (int i = begin; i < end; ++i) {
+			const float* p = points[order[i]];
+			const double w = weight(order[i]);
+
+			nodeWeights[node] += w;
+			for (int d = 0; d < D; ++d) {
+				boxMin[node * D + d] = std::min(boxMin[node * D + d], p[d]);
+				boxMax[node * D + d] = std::max(boxMax[node * D + d], p[d]);
+				nodeSums[node * D + d] += w * p[d];
+			}
+		}
+
+		float halfDiagonal = 0.0f;
+		for (int d = 0; d < D; ++d) {
+			float lo = boxMin[node * D + d], hi = boxMax[node * D + d];
+			boxMid[node * D + d] = 0.5f * (lo + hi);
+			halfDiagonal += 0.25f * (hi - lo) * (hi - lo);
+		}
+		halfDiagonals.push_back(std::sqrt(halfDiagonal));
+
+		int widest = 0;
+		for (int d = 1; d < D; ++d) {
+			if (boxMax[node * D + d] - boxMin[node * D + d] > boxMax[node * D + widest] - boxMin[node * D + widest]) widest = d;
+		}
+
+		// all points equal (very common with pixels) or few enough points
+		if (end - begin <= LEAF_SIZE || boxMax[node * D + widest] == boxMin[node * D + widest]) return node;
+
+		int mid = begin + (end - begin) / 2;
+		std::nth_element(order.begin() + begin, order.begin() + mid, order.begin() + end, [&](int a, int b) {
+			return points[a][widest] < points[b][widest];
+		});
+
+		int left = build(order, begin, mid, level + 1);
+		int right = build(order, mid, end, level + 1);
+
+		nodes[node].left = left;
+		nodes[node].right = right;
+
+		return node;
+	}
+
+
+	// sums and counts for one thread
+	struct Accumulator {
+		std::vector<double> sums;
+		std::vector<double> counts;
+
+		long long distances = 0, changed = 0;
+		int* labels; // of the sorted points, nullptr if changes aren't tracked
+
+		Accumulator(int k, int D, int* labels) : sums(k * D, 0.0), counts(k, 0.0), labels(labels) {}
+	};
+
+	void setLabels(int begin, int end, int centroidIndex, Accumulator& acc) const {
+		for (int i = begin; i < end; ++i) {
+			acc.changed += acc.labels[i] != centroidIndex;
+			acc.labels[i] = centroidIndex;
+		}
+	}
+
+	// candidates that survive the filter at node are written to `out` (in the same order, so ties are still broken by
+	// the smallest index). Returns how many survived
+	int filterCandidates(int node, const int* candidates, int numCandidates, const Dataset& centroids, int* out) const {
+
+		const float* lo = &boxMin[node * D];
+		const float* hi = &boxMax[node * D];
+		const float* m = &boxMid[node * D];
+
+		// candidate closest to the middle of the box
+		float closestDst = std::numeric_limits<float>::infinity();
+		int closest = candidates[0];
+		for (int c = 0; c < numCandidates; ++c) {
+			float dst = squaredEuclideanDistance(m, centroids[candidates[c]], D);
+			if (dst < closestDst) {
+				closestDst = dst;
+				closest = candidates[c];
+			}
+		}
+
+		const float* zStar = centroids[closest];
+
+		int numOut = 0;
+		for (int c = 0; c < numCandidates; ++c) {
+			int z = candidates[c];
+			if (z == closest) {
+				out[numOut++] = z;
+				continue;
+			}
+
+			const float* zc = centroids[z];
+
+			// corner of the box in the direction of z - z*, the point of the box where z has the best chance against z*
+			// (d(z, x)^2 - d(z*, x)^2 is linear in x, so its min over the box is at that corner)
+			float dstZ = 0.0f, dstZStar = 0.0f;
+			for (int d = 0; d < D; ++d) {
+				float v = zc[d] > zStar[d] ? hi[d] : lo[d];
+				dstZ += (zc[d] - v) * (zc[d] - v);
+				dstZStar += (zStar[d] - v) * (zStar[d] - v);
+			}
+
+			// margin to cover float rounding of the distances of any point in the box
+			float far = std::sqrt(squaredEuclideanDistance(m, zc, D)) + halfDiagonals[node];
+			float margin = 2.0f * BOUND_SLACK * far * far;
+
+			if (dstZ - dstZStar <= margin) out[numOut++] = z;
+		}
+
+		return numOut;
+	}
+
+	void assignLeaf(int node, const int* candidates, int numCandidates, const Dataset& centroids, Accumulator& acc) const {
+
+		acc.distances += (long long) (nodes[node].end - nodes[node].begin) * numCandidates;
+
+		for (int i = nodes[node].begin; i < nodes[node].end; ++i) {
+			const float* p = sortedPoints[i];
+
+			float minDst = 1e30;
+			int centroidIndex = candidates[0];
+
+			for (int c = 0; c < numCandidates; ++c) {
+				float dst = squaredEuclideanDistance(p, centroids[candidates[c]], D);
+				if (dst < minDst) {
+					minDst = dst;
+					centroidIndex = candidates[c];
+				}
+			}
+
+			if (acc.labels) setLabels(i, i + 1, centroidIndex, acc);
+
+			const double w = sortedWeights[i];
+			acc.counts[centroidIndex] += w;
+			for (int d = 0; d < D; ++d) {
+				acc.sums[centroidIndex * D + d] += w * p[d];
+			}
+		}
+	}
+
+	void assignNode(int node, int centroidIndex, Accumulator& acc) const {
+		if (acc.labels) setLabels(nodes[node].begin, nodes[node].end, centroidIndex, acc);
+
+		acc.counts[centroidIndex] += nodeWeights[node];
+		for (int d = 0; d < D; ++d) {
+			acc.sums[centroidIndex * D + d] += nodeSums[node * D + d];
+		}
+	}
+
+	// scratch must have room for K * (depth + 1) ints: each level writes its filtered list right after its parent's
+	void filter(int node, const int* candidates, int numCandidates, const Dataset& centroids, Accumulator& acc, int* scratch) const {
+
+		if (numCandidates == 1) {
+			assignNode(node, candidates[0], acc);
+			return;
+		}
+
+		int* filtered = scratch;
+		int numFiltered = filterCandidates(node, candidates, numCandidates, centroids, filtered);
+		acc.distances += numCandidates;
+
+		if (numFiltered == 1) {
+			assignNode(node, filtered[0], acc);
+		} else if (nodes[node].left == -1) {
+			assignLeaf(node, filtered, numFiltered, centroids, acc);
+		} else {
+			filter(nodes[node].left, filtered, numFiltered, centroids, acc, scratch + numFiltered);
+			filter(nodes[node].right, filtered, numFiltered, centroids, acc, scratch + numFiltered);
+		}
+	}
+
+
+	struct Task {
+		int node;
+		std::vector<int> candidates;
+	};
+
+	// filters the top of the tree serially until there are enough subtrees to keep every thread busy
+	void collectTasks(int node, const int* candidates, int numCandidates, const Dataset& centroids, Accumulator& acc, int minTasks, std::vector<Task>& tasks) const {
+
+		std::vector<Task> frontier = { { node, std::vector<int>(candidates, candidates + numCandidates) } };
+
+		while (!frontier.empty() && (int) (frontier.size() + tasks.size()) < minTasks) {
+
+			std::vector<Task> next;
+			for (auto& task : frontier) {
+				std::vector<int> filtered(task.candidates.size());
+				filtered.resize(filterCandidates(task.node, task.candidates.data(), task.candidates.size(), centroids, filtered.data()));
+				acc.distances += task.candidates.size();
+
+				if (filtered.size() == 1) {
+					assignNode(task.node, filtered[0], acc);
+				} else if (nodes[task.node].left == -1) {
+					tasks.push_back({ task.node, filtered });
+				} else {
+					next.push_back({ nodes[task.node].left, filtered });
+					next.push_back({ nodes[task.node].right, filtered });
+				}
+			}
+
+			frontier = std::move(next);
+		}
+
+		for (auto& task : frontier) tasks.push_back(std::move(task));
+	}
+
+	bool kdTreeIterate(Dataset& centroids, bool parallel) {
+
+		const int k = centroids.size();
+
+		std::vector<int> all(k);
+		for (int j = 0; j < k; ++j) all[j] = j;
+
+		int numThreads = parallel ? omp_get_max_threads() : 1;
+		std::vector<Accumulator> accs(numThreads, Accumulator(k, D, trackedLabels()));
+
+		const auto start = InstrumentClock::now();
+
+		if (N) {
+			if (numThreads == 1) {
+				std::vector<int> scratch(k * (depth + 1));
+				filter(0, all.data(), k, centroids, accs[0], scratch.data());
+			} else {
+				std::vector<Task> tasks;
+				collectTasks(0, all.data(), k, centroids, accs[0], 16 * numThreads, tasks);
+
+				#pragma omp parallel num_threads(numThreads)
+				{
+					std::vector<int> scratch(k * (depth + 1));
+					Accumulator& acc = accs[omp_get_thread_num()];
+
+					#pragma omp for schedule(dynamic, 1)
+					for (int t = 0; t < (int) tasks.size(); ++t) {
+						filter(tasks[t].node, tasks[t].candidates.data(), tasks[t].candidates.size(), centroids, acc, scratch.data());
+					}
+				}
+			}
+		}
+
+		const auto assigned = InstrumentClock::now();
+
+		// combine the results of all threads
+		Dataset newCenters(k, D, 0.0f);
+		std::vector<float> counts(k, 0.0f);
+
+		long long changed = 0;
+		stats.distances = 0;
+		for (auto& acc : accs) {
+			stats.distances += acc.distances;
+			changed += acc.changed;
+		}
+		if (trackChanges) stats.changed = changed;
+
+		for (int j = 0; j < k; ++j) {
+			double count = 0.0;
+			for (auto& acc : accs) count += acc.counts[j];
+			counts[j] = count;
+
+			for (int d = 0; d < D; ++d) {
+				double sum = 0.0;
+				for (auto& acc : accs) sum += acc.sums[j * D + d];
+				newCenters[j][d] = sum;
+			}
+		}
+
+		recordPhases(start, assigned, InstrumentClock::now());
+
+		return updateCentroids(centroids, newCenters, counts);
+	}
+};
+
+
+struct KdTreeLloydIteration : KdTreeIterationBase {
+
+	KdTreeLloydIteration(const DatasetView& pts, const float* weights = nullptr) : KdTreeIterationBase(pts, weights) {}
+
+	bool iterate(Dataset& centroids) override {
+		return kdTreeIterate(centroids, false);
+	}
+};
+
+struct ParallelKdTreeLloydIteration : KdTreeIterationBase {
+
+	ParallelKdTreeLloydIteration(const DatasetView& pts, const float* weights = nullptr) : KdTreeIterationBase(pts, weights) {}
+
+	bool iterate(Dataset& centroids) override {
+		return kdTreeIterate(centroids, true);
+	}
+};
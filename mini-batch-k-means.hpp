@@ -0,0 +1,209 @@
+#pragma once
+
+#include "helper.hpp"
+#include "dataset.hpp"
+#include "seeding.hpp"
+#include <omp.h>
+#include <cstdio>
+#include <chrono>
+#include <functional>
+#include <random>
+
+
+// mini-batch k-means (Sculley, "Web-scale k-means clustering", 2010). Instead of passing over all points every iteration,
+// each step takes a small batch, assigns it with the same SIMD kernel as SIMDLloydIteration and moves every centroid
+// towards the mean of its points in the batch. Each centroid has its own learning rate, 1 / (points it has seen so far),
+// so a centroid is always the mean of every point ever assigned to it (as if they were all assigned to it in one go).
+//
+// points come from a BatchSource, so only one batch has to be in memory at a time: a view of points already in memory,
+// a raw float file read sequentially, or any function that generates points.
+
+
+// fills batch (already sized to the batch size) with the next points and returns how many were written.
+// 0 means there's nothing left (for sources that end). D is fixed for the whole source
+struct BatchSource {
+	virtual ~BatchSource() = default;
+	virtual int dim() const = 0;
+	virtual int next(Dataset& batch) = 0;
+};
+
+
+// points sampled uniformly (with replacement) from a view. Never ends
+struct ViewBatchSource : BatchSource {
+
+	const DatasetView points;
+	std::mt19937 gen;
+
+	ViewBatchSource(const DatasetView& pts, unsigned seed = 0) : points(pts), gen(seed) {}
+
+	int dim() const override { return points.dim(); }
+
+	int next(Dataset& batch) override {
+		std::uniform_int_distribution<int> uniform(0, points.size() - 1);
+
+		for (int b = 0; b < batch.size(); ++b) {
+			const float* p = points[uniform(gen)];
+			std::copy(p, p + points.dim(), batch[b]);
+		}
+
+		return batch.size();
+	}
+};
+
+
+// rows of D float32 values, one after the other, read sequentially. Starts over at the end of the file if loop is set
+// (so a fit can take more than one pass), otherwise it ends with the file
+struct FileBatchSource : BatchSource {
+
+	FILE* file = nullptr;
+	const int D;
+	const bool loop;
+
+	FileBatchSource(const char* path, int D, bool loop = true) : file(std::fopen(path, "rb")), D(D), loop(loop) {}
+
+	~FileBatchSource() override {
+		if (file) std::fclose(file);
+	}
+
+	bool isOpen() const { return file != nullptr; }
+
+	int dim() const override { return D; }
+
+	int next(Dataset& batch) override {
+		if (!file) return 0;
+
+		int read = 0;
+		while (read < batch.size()) {
+
+			// batch rows are tightly packed, so contiguous rows can be read in one call
+			read += std::fread(batch[read], sizeof(float) * D, batch.size() - read, file);
+
+			if (read < batch.size()) {
+				if (!loop || std::ftell(file) < (long) (sizeof(float) * D)) break; // don't spin on an empty file
+				std::rewind(file);
+			}
+		}
+
+		return read;
+	}
+};
+
+
+// points from a function that writes one point and returns false when it has no more
+struct GeneratorBatchSource : BatchSource {
+
+	const int D;
+	std::function<bool(float*)> generator;
+
+	GeneratorBatchSource(int D, std::function<bool(float*)> generator) : D(D), generator(std::move(generator)) {}
+
+	int dim() const override { return D; }
+
+	int next(Dataset& batch) override {
+		int b = 0;
+		while (b < batch.size() && generator(batch[b])) ++b;
+		return b;
+	}
+};
+
+
+struct MiniBatchOptions {
+	int batchSize = 4096;
+	long maxBatches = 1000;
+	double timeBudgetSeconds = 0.0; // 0 = no limit
+
+	// stops when the (exponential moving average of the) mean squared centroid shift per batch goes below this
+	float tolerance = 1e-4f;
+	int minBatches = 10;
+};
+
+
+struct MiniBatchKMeans {
+
+	Dataset centroids;
+	std::vector<double> counts; // points each centroid has seen, its learning rate is 1 / counts
+	const int k;
+
+	MiniBatchKMeans(int k) : k(k) {}
+
+	// assigns the batch and updates the centroids. Returns the mean squared shift of the centroids
+	float step(const DatasetView& batch) {
+
+		const int n = batch.size();
+		const int D = batch.dim();
+
+		PackedCentroids packed(centroids);
+
+		std::vector<int> labels(n);
+
+		#pragma omp parallel for schedule(static)
+		for (int begin = 0; begin < n; begin += 256) {
+			packed.closest(batch, begin, std::min(begin + 256, n), &labels[begin]);
+		}
+
+		Dataset sums(k, D, 0.0f);
+		std::vector<float> batchCounts(k, 0.0f);
+
+		for (int i = 0; i < n; ++i) {
+			batchCounts[labels[i]]++;
+			for (int d = 0; d < D; ++d) sums[labels[i]][d] += batch[i][d];
+		}
+
+		// c += (n_c / counts_c) * (mean_c - c), which is c += (sum_c - n_c * c) / counts_c
+		float shift = 0.0f;
+		for (int j = 0; j < k; ++j) {
+			if (!batchCounts[j]) continue;
+
+			counts[j] += batchCounts[j];
+			float rate = 1.0f / counts[j];
+
+			for (int d = 0; d < D; ++d) {
+				float delta = rate * (sums[j][d] - batchCounts[j] * centroids[j][d]);
+				centroids[j][d] += delta;
+				shift += delta * delta;
+			}
+		}
+
+		return shift / k;
+	}
+
+	// uses the first batch to choose the centroids (with k-means++) if there aren't any yet. Returns the number of batches
+	long fit(BatchSource& source, const MiniBatchOptions& options = {}, unsigned seed = 0) {
+
+		const int D = source.dim();
+		const auto start = std::chrono::steady_clock::now();
+
+		Dataset batch(options.batchSize, D);
+
+		if (centroids.size() != k || centroids.dim() != D) {
+			int n = source.next(batch);
+			if (n == 0) return 0;
+
+			std::mt19937 gen(seed);
+			centroids = kMeansPlusPlus(DatasetView(batch.data(), n, D), k, gen);
+		}
+		if ((int) counts.size() != k) counts.assign(k, 0.0);
+
+		float averageShift = -1.0f;
+
+		long numBatches = 0;
+		while (numBatches < options.maxBatches) {
+
+			int n = source.next(batch);
+			if (n == 0) break;
+
+			float shift = step(DatasetView(batch.data(), n, D));
+			++numBatches;
+
+			averageShift = averageShift < 0.0f ? shift : 0.9f * averageShift + 0.1f * shift;
+			if (numBatches >= options.minBatches && averageShift < options.tolerance) break;
+
+			if (options.timeBudgetSeconds > 0.0) {
+				std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+				if (elapsed.count() > options.timeBudgetSeconds) break;
+			}
+		}
+
+		return numBatches;
+	}
+};
@@ -0,0 +1,204 @@
+#pragma once
+
+#include "dataset.hpp"
+#include "color-table.hpp"
+#include <cstdio>
+#include <cstring>
+#include <climits>
+#include <vector>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+
+// a fitted model on disk, to be fitted once and loaded by whatever remaps points with it. Made to be mmapped and used as
+// it is, like dataset files (see dataset-file.hpp):
+//
+//   [ModelFileHeader][centroids][color table cellStart][color table candidates]
+//
+// centroids are k rows of D floats, and the color table (see color-table.hpp) is optional. Every part starts at a
+// multiple of 64 bytes. Opening a file with a prebuilt table is mmap + reading the header + one pass over the table to
+// check it (so a bad file can't make a lookup read outside of it), which is a lot less than building the table, so a
+// service starting up doesn't spend time on it. Values are in the machine's byte order (the header has a marker to
+// catch the wrong one).
+
+
+constexpr uint64_t MODEL_FILE_ALIGNMENT = 64;
+
+
+struct ModelFileHeader {
+	char magic[8] = { 'K', 'M', 'M', 'O', 'D', 'E', 'L', 0 };
+	uint32_t version = 1;
+	uint32_t byteOrder = 0x01020304;
+	uint32_t k = 0;
+	uint32_t D = 0;
+	uint32_t tableBits = 0; // 0 if there's no color table
+	uint32_t reserved = 0;
+	uint64_t centroidsOffset = 0;
+	uint64_t cellStartOffset = 0, cellStartCount = 0;
+	uint64_t candidatesOffset = 0, candidatesCount = 0;
+
+	// and everything fits in length bytes, at the offsets writeModelFile uses. Only looks at the header, the contents of
+	// the table are checked by MappedModel::open
+	bool isValid(size_t length) const {
+		ModelFileHeader expected;
+		if (std::memcmp(magic, expected.magic, sizeof(magic)) != 0 || version != expected.version || byteOrder != expected.byteOrder) return false;
+		if (k == 0 || D == 0 || k > INT_MAX || D > INT_MAX) return false;
+		if (centroidsOffset % MODEL_FILE_ALIGNMENT || cellStartOffset % MODEL_FILE_ALIGNMENT || candidatesOffset % MODEL_FILE_ALIGNMENT) return false;
+		if (!fitsIn(centroidsOffset, k, (uint64_t) D * sizeof(float), length)) return false;
+		if (!tableBits) return true;
+
+		const uint64_t cells = tableBits * D <= 24 ? uint64_t(1) << (tableBits * D) : 0;
+		const bool sizes = tableBits == 8 ? cellStartCount == 0 && candidatesCount == cells : cellStartCount == cells + 1;
+
+		return cells && D <= 4 && k <= 65535 && sizes && fitsIn(cellStartOffset, cellStartCount, sizeof(uint32_t), length)
+			&& fitsIn(candidatesOffset, candidatesCount, sizeof(uint16_t), length);
+	}
+};
+
+
+// writes centroids (and the color table built for them, if any). Returns false if anything failed to be written
+bool writeModelFile(const char* path, const Dataset& centroids, const ColorTable* table = nullptr) {
+
+	ModelFileHeader header;
+	header.k = centroids.size();
+	header.D = centroids.dim();
+	header.centroidsOffset = roundUp(sizeof(ModelFileHeader), MODEL_FILE_ALIGNMENT);
+
+	uint64_t end = header.centroidsOffset + (uint64_t) header.k * header.D * sizeof(float);
+
+	if (table) {
+		header.tableBits = table->bits;
+		header.cellStartOffset = roundUp(end, MODEL_FILE_ALIGNMENT);
+		header.cellStartCount = table->cellStart.size();
+		end = header.cellStartOffset + header.cellStartCount * sizeof(uint32_t);
+
+		header.candidatesOffset = roundUp(end, MODEL_FILE_ALIGNMENT);
+		header.candidatesCount = table->candidates.size();
+	}
+
+	FILE* file = std::fopen(path, "wb");
+	if (!file) return false;
+
+	// zeros up to `offset`, then the bytes
+	uint64_t written = 0;
+	auto put = [&](uint64_t offset, const void* data, size_t bytes) {
+		static const char zeros[MODEL_FILE_ALIGNMENT] = {};
+		if (offset > written) std::fwrite(zeros, 1, offset - written, file);
+		if (bytes) std::fwrite(data, 1, bytes, file); // data is null for an empty cellStart
+		written = offset + bytes;
+	};
+
+	put(0, &header, sizeof(header));
+	for (int j = 0; j < centroids.size(); ++j) put(header.centroidsOffset + (uint64_t) j * header.D * sizeof(float), centroids[j], header.D * sizeof(float));
+	if (table) {
+		put(header.cellStartOffset, table->cellStart.data(), table->cellStart.size() * sizeof(uint32_t));
+		put(header.candidatesOffset, table->candidates.data(), table->candidates.size() * sizeof(uint16_t));
+	}
+
+	bool ok = !std::ferror(file);
+	ok = std::fclose(file) == 0 && ok;
+
+	return ok;
+}
+
+
+// read-only mmap of a model file. The centroids and table stay valid while this object lives
+struct MappedModel {
+
+	void* map = MAP_FAILED;
+	size_t length = 0;
+	ModelFileHeader header;
+
+	DatasetView centroids;
+	ColorTableView table; // table.isValid() is false if the file has none
+
+	MappedModel() = default;
+
+	// populate asks the kernel to read the whole file right away instead of on the first access to each page
+	explicit MappedModel(const char* path, bool populate = false) {
+		open(path, populate);
+	}
+
+	MappedModel(const MappedModel&) = delete;
+	MappedModel& operator = (const MappedModel&) = delete;
+
+	~MappedModel() {
+		close();
+	}
+
+	bool isOpen() const { return map != MAP_FAILED; }
+
+	bool open(const char* path, bool populate = false) {
+		close();
+
+		int fd = ::open(path, O_RDONLY);
+		if (fd < 0) return false;
+
+		struct stat st;
+		if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(ModelFileHeader)) {
+			::close(fd);
+			return false;
+		}
+
+		length = st.st_size;
+		map = mmap(nullptr, length, PROT_READ, MAP_SHARED | (populate ? MAP_POPULATE : 0), fd, 0);
+		::close(fd); // the mapping keeps the file alive
+
+		if (map == MAP_FAILED) return false;
+
+		std::memcpy(&header, map, sizeof(header));
+		if (!header.isValid(length)) {
+			close();
+			return false;
+		}
+
+		const char* base = (const char*) map;
+		centroids = DatasetView((const float*) (base + header.centroidsOffset), header.k, header.D);
+
+		if (header.tableBits) {
+			// lookups go anywhere in the table
+			madvise(map, length, MADV_RANDOM);
+
+			table.k = header.k;
+			table.C = header.D;
+			table.bits = header.tableBits;
+			table.centroids = centroids[0];
+			table.stride = centroids.stride;
+			table.cellStart = header.cellStartCount ? (const uint32_t*) (base + header.cellStartOffset) : nullptr;
+			table.candidates = (const uint16_t*) (base + header.candidatesOffset);
+
+			if (!tableIsValid()) {
+				close();
+				return false;
+			}
+		}
+
+		return true;
+	}
+
+	// every cell's range is inside candidates and every candidate is a centroid, so a lookup never reads outside the file
+	bool tableIsValid() const {
+		if (table.cellStart) {
+			if (table.cellStart[0] != 0 || table.cellStart[header.cellStartCount - 1] != header.candidatesCount) return false;
+			for (uint64_t i = 1; i < header.cellStartCount; ++i) {
+				if (table.cellStart[i] < table.cellStart[i - 1]) return false;
+			}
+		}
+
+		for (uint64_t i = 0; i < header.candidatesCount; ++i) {
+			if (table.candidates[i] >= header.k) return false;
+		}
+
+		return true;
+	}
+
+	void close() {
+		if (map != MAP_FAILED) munmap(map, length);
+		map = MAP_FAILED;
+		length = 0;
+		centroids = DatasetView();
+		table = ColorTableView();
+	}
+};
@@ -0,0 +1,185 @@
+#pragma once
+
+#include "k-means.hpp"
+#include "slice-sums.hpp"
+#include <omp.h>
+#include <vector>
+#include <random>
+
+
+// several models fitted together, for choosing K (elbow, silhouette...) or keeping the best of a few restarts. Fitting
+// them one after the other goes through the whole dataset once per iteration of every model, and that's what bounds the
+// time on big datasets. Here every pass goes through the points once, one block at a time, and every model still being
+// fitted assigns the block while it's in L1 (the centroids of each model stay in registers, see closestBatch in
+// simd-kernels.hpp). Models drop out of the passes as they converge.
+//
+// the sums of every model live side by side in the same slices (see slice-sums.hpp), added in the same order as when a
+// model is fitted by itself: each model ends up with exactly the centroids ParallelSIMDLloydIteration (or
+// SIMDLloydIteration with parallel = false) would give it, as long as the sums of all models together don't take so
+// much memory that there are fewer slices (K * D of all models in the thousands).
+
+struct MultiKMeans {
+
+	struct Model {
+		int k;
+		std::mt19937 gen;
+		Dataset centroids;
+
+		int passes = 0; // passes over the points this model was in
+		int iterations = 0; // same, without the last one if it converged (like KMeans::fit)
+		bool converged = false;
+
+		// weighted sum of the squared distances of the points to their centroid, in the last pass this model was in
+		double inertia = 0.0;
+	};
+
+	// points per block: every model assigns a block before the next one is loaded
+	static constexpr int BLOCK = 256;
+
+	std::vector<Model> models;
+
+	DatasetView points;
+	const float* weights = nullptr;
+	int N = 0, D = 0;
+
+	// seeding of every model, same as KMeans
+	Seeding seeding = Seeding::KMeansPlusPlus;
+	int seedingSampleSize = 0;
+
+	SliceSums slices;
+
+	// every k in ks `restarts` times (restarts of the same k are next to each other), each model with its own seed
+	MultiKMeans(const std::vector<int>& ks, int restarts = 1, unsigned seed = std::random_device{}()) {
+		std::mt19937 seeds(seed);
+		for (int k : ks) {
+			for (int r = 0; r < restarts; ++r) models.push_back({ k, std::mt19937(seeds()), Dataset() });
+		}
+	}
+
+	// the points (and weights) are NOT copied, they must outlive this
+	void initializeCentroids(const DatasetView& pts, const float* pointWeights = nullptr) {
+		N = pts.size();
+		D = pts.dim();
+		points = pts;
+		weights = pointWeights;
+
+		for (Model& m : models) {
+			const int n = seedingPoints(seedingSampleSize, m.k, N);
+
+			if (seeding == Seeding::KMeansParallel) m.centroids = kMeansParallel(points, m.k, m.gen, 5, 0.0, true, n, weights);
+			else m.centroids = kMeansPlusPlus(points, m.k, m.gen, true, n, weights);
+
+			m.passes = m.iterations = 0;
+			m.converged = false;
+		}
+	}
+
+	// fits every model until it converges or does maxIter iterations. Returns the number of passes over the points
+	int fit(int maxIter = 500, bool parallel = true) {
+
+		int passes = 0;
+
+		while (true) {
+
+			std::vector<int> active; // models in this pass
+			std::vector<int> offsets; // where the clusters of each active model start in the slices
+			int totalK = 0;
+
+			for (size_t m = 0; m < models.size(); ++m) {
+				if (models[m].converged || models[m].passes >= maxIter) continue;
+				active.push_back(m);
+				offsets.push_back(totalK);
+				totalK += models[m].k;
+			}
+
+			if (active.empty()) break;
+
+			pass(active, offsets, totalK, parallel);
+			++passes;
+		}
+
+		return passes;
+	}
+
+	// index of the model with the smallest inertia among the ones with k centroids (-1 if there's none)
+	int best(int k) const {
+		int bestModel = -1;
+		for (size_t m = 0; m < models.size(); ++m) {
+			if (models[m].k == k && (bestModel < 0 || models[m].inertia < models[bestModel].inertia)) bestModel = m;
+		}
+		return bestModel;
+	}
+
+	// one Lloyd iteration of every active model
+	void pass(const std::vector<int>& active, const std::vector<int>& offsets, int totalK, bool parallel) {
+
+		const int numActive = active.size();
+
+		std::vector<PackedCentroids> packed;
+		for (int m : active) packed.emplace_back(models[m].centroids);
+
+		// kept between passes (see slice-sums.hpp)
+		slices.prepare(N, totalK, D, parallel);
+
+		// inertia of every slice and model, added in slice order afterwards so it doesn't depend on the threads either
+		std::vector<double> inertias((size_t) slices.numSlices * numActive, 0.0);
+
+		#pragma omp parallel if (parallel)
+		{
+
+			int labels[BLOCK];
+			float minDst[BLOCK];
+
+			#pragma omp for schedule(dynamic, 1)
+			for (int slice = 0; slice < slices.numSlices; ++slice) {
+
+				slices.clear(slice);
+				const int first = slices.begin(slice), last = slices.end(slice);
+
+				for (int begin = first; begin < last; begin += BLOCK) {
+
+					int end = std::min(begin + BLOCK, last);
+
+					for (int a = 0; a < numActive; ++a) {
+
+						packed[a].closest(points, begin, end, labels, minDst);
+
+						float* sums = slices.sums(slice) + (size_t) offsets[a] * D;
+						float* counts = slices.counts(slice) + offsets[a];
+						double inertia = 0.0;
+
+						for (int i = begin; i < end; ++i) {
+							const int centroidIndex = labels[i - begin];
+
+							// accumulate points assigned to given centroid to later get their mean
+							const float w = weights ? weights[i] : 1.0f;
+							counts[centroidIndex] += w;
+							for (int j = 0; j < D; ++j) {
+								sums[centroidIndex * D + j] += w * points[i][j];
+							}
+
+							inertia += w * minDst[i - begin];
+						}
+
+						inertias[(size_t) slice * numActive + a] += inertia;
+					}
+				}
+			}
+
+			// add up the sums of all slices
+			slices.reduce();
+		}
+
+		for (int a = 0; a < numActive; ++a) {
+			Model& model = models[active[a]];
+
+			float maxShift;
+			model.converged = moveCentroids(model.centroids, slices.sums(0) + (size_t) offsets[a] * D, D, slices.counts(0) + offsets[a], maxShift);
+			++model.passes;
+			model.iterations = model.passes - model.converged;
+
+			model.inertia = 0.0;
+			for (int slice = 0; slice < slices.numSlices; ++slice) model.inertia += inertias[(size_t) slice * numActive + a];
+		}
+	}
+};
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "k-means-iteration.hpp"
+#include "slice-sums.hpp"
 #include <omp.h>
 
 
@@ -9,57 +10,78 @@
 
 struct ParallelLloydIteration : LloydIteration {
 
-    ParallelLloydIteration(const std::vector<std::vector<float>>& pts) : LloydIteration(pts) {}
+	SliceSums slices;
 
-	bool iterate(std::vector<std::vector<float>>& centroids) override {
+    ParallelLloydIteration(const DatasetView& pts, const float* weights = nullptr) : LloydIteration(pts, weights) {}
+
+	bool iterate(Dataset& centroids) override {
+		return dispatchDim(centroids.dim(), [&](auto fixedD) { return iterateFixed<fixedD>(centroids); });
+	}
+
+	// FixedD != 0 means D is known at compile time, so the loops over dimensions are unrolled (see dispatchDim in simd.hpp)
+	template <int FixedD>
+	bool iterateFixed(Dataset& centroids) {
 
 		const int k = centroids.size();
-		const int D = centroids[0].size();
+		const int D = FixedD ? FixedD : centroids.dim();
+
+		// kept between iterations (see slice-sums.hpp)
+		slices.prepare(N, k, D, true);
 
-		std::vector<std::vector<float>> newCenters(k, std::vector<float>(D, 0.0f));
-		std::vector<float> counts(k, 0.0f);
+		int* labels = trackedLabels();
+		long long changed = 0;
+
+		const auto start = InstrumentClock::now();
+		auto assigned = start;
 
 		#pragma omp parallel
 		{
 
-			// create vectors to accumulate the points for each thread
-			std::vector<std::vector<float>> newCentersThread(k, std::vector<float>(D, 0.0f));
-			std::vector<float> countsThread(k, 0.0f);
+			#pragma omp for schedule(dynamic, 1) reduction(+ : changed)
+			for (int slice = 0; slice < slices.numSlices; ++slice) {
 
-			#pragma omp for nowait
-			for (size_t i = 0; i < N; ++i) {
+				slices.clear(slice);
+				float* sums = slices.sums(slice);
+				float* counts = slices.counts(slice);
+				const int first = slices.begin(slice), last = slices.end(slice);
 
-				float minDst = 1e30;
-				int centroidIndex = -1;
+				for (int i = first; i < last; ++i) {
 
-				for (size_t j = 0; j < k; ++j) {
-					float dst = squaredEuclideanDistance(points[i].data(), centroids[j].data(), D);
-					if (dst < minDst) {
-						minDst = dst;
-						centroidIndex = j;
-					}
-				}
+					float minDst = 1e30;
+					int centroidIndex = -1;
 
-				countsThread[centroidIndex]++;
-				for (int j = 0; j < D; ++j) {
-					newCentersThread[centroidIndex][j] += points[i][j];
-				}
-			}
+					for (int j = 0; j < k; ++j) {
+						float dst = squaredEuclideanDistance<FixedD>(points[i], centroids[j], D);
+						if (dst < minDst) {
+							minDst = dst;
+							centroidIndex = j;
+						}
+					}
 
-			// combine the results of all threads
-			#pragma omp critical
-			{
-				for (int j = 0; j < k; ++j) {
-					counts[j] += countsThread[j];
+					if (labels) {
+						changed += labels[i] != centroidIndex;
+						labels[i] = centroidIndex;
+					}
 
-					for (int l = 0; l < D; ++l) {
-						newCenters[j][l] += newCentersThread[j][l];
+					const float w = weight(i);
+					counts[centroidIndex] += w;
+					for (int j = 0; j < D; ++j) {
+						sums[centroidIndex * D + j] += w * points[i][j];
 					}
 				}
 			}
 
+			#pragma omp master
+			assigned = InstrumentClock::now();
+
+			// combine the results of all slices
+			slices.reduce();
 		}
 
-		return updateCentroids(centroids, newCenters, counts);
+		recordPhases(start, assigned, InstrumentClock::now());
+		stats.distances = (long long) N * k;
+		if (labels) stats.changed = changed;
+
+		return updateCentroids(centroids, slices.sums(0), D, slices.counts(0));
 	}
 };
\ No newline at end of file
@@ -0,0 +1,244 @@
+#pragma once
+
+#include "k-means-iteration.hpp"
+#include "slice-sums.hpp"
+#include "simd.hpp"
+#include <omp.h>
+#include <cmath>
+#include <cassert>
+#include <cstdint>
+#include <limits>
+
+
+// k-means straight on 8 bit pixels (gray, gray + alpha, RGB or RGBA, interleaved like stb_image loads them), without
+// converting them to floats first. Big images are bound by memory bandwidth on every other iterator, and this goes
+// through 4 times fewer bytes per iteration (and doesn't need the float copy at all).
+//
+// distances are integers: centroids are rounded to multiples of 1 / SCALE (int16), and the score of centroid c for pixel
+// p is SCALE * (||c||^2 - 2 p.c), which is SCALE times the squared distance minus ||p||^2 (the same for every centroid).
+// The kernel does W pixels at a time and two channels per multiply-add (pmaddwd, see closestPixelsBatch in
+// simd-kernels.hpp). Scores are only used to find the closest centroid when it's clear, like the approximate distances
+// of GemmLloydIteration: the rounding error of a score is at most sum(p) + 1/2, and if the second best score isn't far
+// enough from the best one to cover that and the rounding of the float distances, the pixel is labeled with the float
+// kernel instead. So labels are
+// exactly the ones BasicLloydIteration gives with the same centroids, and the float kernel only runs for pixels right on
+// the boundary between two clusters (a few percent of them).
+//
+// sums are added as integers (exact) and only turned into float centroids at the update, so after the first iteration
+// the centroids can differ from the float iterators' by their rounding error. Centroids outside [0, 256) (which only
+// happens if they're set by hand) can't be rounded to int16, so those iterations use the float kernel for every pixel.
+
+
+// 8 bit pixels with C = 1 ~ 4 channels, one byte per channel, pixel i at data + i * C. Never copied
+struct PixelView {
+
+	const unsigned char* data = nullptr;
+	int N = 0, C = 0;
+
+	PixelView() = default;
+	// the kernels keep a pixel in 4 floats and only have code for 1 to 4 channels
+	PixelView(const unsigned char* data, int N, int C) : data(data), N(N), C(C) {
+		assert(C >= 1 && C <= 4);
+	}
+
+	const unsigned char* operator [] (size_t i) const { return data + i * C; }
+
+	int size() const { return N; }
+	int dim() const { return C; }
+};
+
+
+// centroids for the pixel kernel: rounded to int16, two channels per int32 (see closestPixelsBatch), plus the float
+// centroids for the pixels the scores can't settle
+struct PackedPixelCentroids {
+
+	static constexpr int SCALE = 128; // so any coordinate below 256 fits in an int16
+	static constexpr float MAX_COORDINATE = 32767.0f / SCALE;
+	static constexpr int BLOCK = 256; // pixels per block of the iterators and predict
+
+	ISA isa = ISA::Scalar;
+	int k = 0, C = 0;
+
+	// false if some coordinate is outside [0, MAX_COORDINATE], and then every pixel uses the float centroids
+	bool quantized = false;
+
+	// how far the float squared distances can be off, in score units (see closest)
+	int32_t floatSlack = 0;
+
+	std::vector<int32_t> pairs; // pairs[j * (C + 1) / 2 + q] = channels 2q and 2q + 1 of centroid j
+	std::vector<int32_t> norms; // SCALE * ||c||^2
+	PackedCentroids floats;
+
+	PackedPixelCentroids(const Dataset& centroids) : isa(currentISA()), k(centroids.size()), C(centroids.dim()), floats(centroids) {
+		assert(C >= 1 && C <= 4);
+
+		quantized = true;
+		for (int j = 0; j < k; ++j) {
+			for (int d = 0; d < C; ++d) quantized = quantized && centroids[j][d] >= 0.0f && centroids[j][d] <= MAX_COORDINATE;
+		}
+		if (!quantized) return;
+
+		const int numPairs = (C + 1) / 2;
+		pairs.assign((size_t) k * numPairs, 0);
+		norms.resize(k);
+
+		for (int j = 0; j < k; ++j) {
+			double norm = 0.0;
+			for (int d = 0; d < C; ++d) {
+				const double c = centroids[j][d];
+				const int32_t q = std::lround(c * SCALE);
+
+				pairs[j * numPairs + d / 2] |= q << (d % 2 * 16);
+				norm += c * c;
+			}
+
+			norms[j] = std::lround(norm * SCALE);
+		}
+
+		// the float squared distances (what BasicLloydIteration compares) are within (2C + 4) epsilon of the real ones,
+		// and no real one is bigger than C * 256^2
+		const double floatError = (2 * C + 4) * (double) std::numeric_limits<float>::epsilon() * C * 256.0 * 256.0;
+		floatSlack = (int32_t) std::ceil(2.0 * SCALE * floatError) + 1;
+	}
+
+	// closest centroid of pixels [begin, end), written to labels[0, end - begin). Same labels as PackedCentroids::closest
+	// with the pixels as floats. Returns how many pixels needed the float centroids
+	int closest(const PixelView& pixels, int begin, int end, int* labels) const {
+
+		// two scores are each off by at most sum(p) + 1/2, and the float distances by floatSlack (both ways)
+		if (quantized) closestPixels(isa, C, pixels[begin], end - begin, pairs.data(), norms.data(), k, floatSlack + 1, labels);
+		else std::fill(labels, labels + (end - begin), -1);
+
+		int checked = 0;
+
+		for (int i = begin; i < end; ++i) {
+			if (labels[i - begin] >= 0) continue;
+
+			const unsigned char* p = pixels[i];
+			float point[4];
+			for (int d = 0; d < C; ++d) point[d] = p[d];
+
+			labels[i - begin] = floats.closest(point);
+			++checked;
+		}
+
+		return checked;
+	}
+};
+
+
+struct PixelIterationBase : LloydIteration {
+
+	const PixelView pixels;
+
+	// integer sums, kept between iterations (see slice-sums.hpp)
+	SliceSumsOf<int64_t> slices;
+
+	// the points of LloydIteration only give the shape, there are no float pixels
+	PixelIterationBase(const PixelView& pixels) : LloydIteration(DatasetView(nullptr, pixels.size(), pixels.dim())), pixels(pixels) {}
+
+	bool pixelIterate(Dataset& centroids, bool parallel) {
+		return dispatchDim(pixels.dim(), [&](auto fixedC) { return pixelIterateFixed<fixedC>(centroids, parallel); });
+	}
+
+	// FixedC != 0 means the number of channels is known at compile time (see dispatchDim in simd.hpp)
+	template <int FixedC>
+	bool pixelIterateFixed(Dataset& centroids, bool parallel) {
+
+		constexpr int BLOCK = PackedPixelCentroids::BLOCK;
+
+		const int k = centroids.size();
+		const int C = FixedC ? FixedC : pixels.dim();
+
+		const PackedPixelCentroids packed(centroids);
+
+		slices.prepare(N, k, C, parallel);
+
+		int* labels = trackedLabels();
+		long long changed = 0, checked = 0;
+
+		const auto start = InstrumentClock::now();
+		auto assigned = start;
+
+		#pragma omp parallel if (parallel)
+		{
+
+			int blockLabels[BLOCK];
+
+			#pragma omp for schedule(dynamic, 1) reduction(+ : changed, checked)
+			for (int slice = 0; slice < slices.numSlices; ++slice) {
+
+				slices.clear(slice);
+				int64_t* sums = slices.sums(slice);
+				int64_t* counts = slices.counts(slice);
+				const int first = slices.begin(slice), last = slices.end(slice);
+
+				for (int begin = first; begin < last; begin += BLOCK) {
+
+					int end = std::min(begin + BLOCK, last);
+					checked += packed.closest(pixels, begin, end, blockLabels);
+
+					for (int i = begin; i < end; ++i) {
+						const int centroidIndex = blockLabels[i - begin];
+
+						if (labels) {
+							changed += labels[i] != centroidIndex;
+							labels[i] = centroidIndex;
+						}
+
+						const unsigned char* p = pixels[i];
+						++counts[centroidIndex];
+						for (int d = 0; d < C; ++d) {
+							sums[centroidIndex * C + d] += p[d];
+						}
+					}
+				}
+			}
+
+			#pragma omp master
+			assigned = InstrumentClock::now();
+
+			// add up the sums of all slices
+			slices.reduce();
+		}
+
+		recordPhases(start, assigned, InstrumentClock::now());
+		stats.distances = (N + checked) * k; // the scores, and the float distances of the pixels that needed them
+		if (labels) stats.changed = changed;
+
+		// the means are computed in double from the exact sums, and given to updateCentroids with a count of 1
+		const int64_t* sums = slices.sums(0);
+		const int64_t* counts = slices.counts(0);
+
+		Dataset means(k, C, 0.0f);
+		std::vector<float> nonEmpty(k, 0.0f);
+
+		for (int j = 0; j < k; ++j) {
+			if (!counts[j]) continue;
+
+			nonEmpty[j] = 1.0f;
+			for (int d = 0; d < C; ++d) means[j][d] = (double) sums[j * C + d] / counts[j];
+		}
+
+		return updateCentroids(centroids, means, nonEmpty);
+	}
+};
+
+
+struct PixelLloydIteration : PixelIterationBase {
+
+	PixelLloydIteration(const PixelView& pixels) : PixelIterationBase(pixels) {}
+
+	bool iterate(Dataset& centroids) override {
+		return pixelIterate(centroids, false);
+	}
+};
+
+struct ParallelPixelLloydIteration : PixelIterationBase {
+
+	ParallelPixelLloydIteration(const PixelView& pixels) : PixelIterationBase(pixels) {}
+
+	bool iterate(Dataset& centroids) override {
+		return pixelIterate(centroids, true);
+	}
+};
@@ -0,0 +1,40 @@
+#pragma once
+
+#include "dataset.hpp"
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include <omp.h>
+
+
+// last step of color quantization: every pixel gets the color of its centroid. Pixels are 8 bit, interleaved like
+// stb_image gives them (one byte per dimension of the centroids), and the centroids are rounded and clamped to [0, 255]
+// once, so each pixel is just a copy.
+
+// the colors of the centroids as 8 bit values (k * D bytes)
+std::vector<unsigned char> palette(const DatasetView& centroids) {
+
+	const int k = centroids.size();
+	const int D = centroids.dim();
+
+	std::vector<unsigned char> colors((size_t) k * D);
+	for (int j = 0; j < k; ++j) {
+		for (int d = 0; d < D; ++d) {
+			colors[(size_t) j * D + d] = (unsigned char) std::clamp(std::lround(centroids[j][d]), 0L, 255L);
+		}
+	}
+
+	return colors;
+}
+
+// out must have room for numPixels * centroids.dim() bytes
+void quantizePixels(const Dataset& centroids, const int* labels, int numPixels, unsigned char* out, bool parallel = true) {
+
+	const int D = centroids.dim();
+	const std::vector<unsigned char> colors = palette(centroids);
+
+	#pragma omp parallel for if (parallel) schedule(static)
+	for (int i = 0; i < numPixels; ++i) {
+		std::copy(&colors[(size_t) labels[i] * D], &colors[(size_t) labels[i] * D] + D, &out[(size_t) i * D]);
+	}
+}
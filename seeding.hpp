@@ -0,0 +1,432 @@
+#pragma once
+
+#include "helper.hpp"
+#include "dataset.hpp"
+#include <omp.h>
+#include <random>
+
+
+// centroid initialization: k-means++ (Arthur and Vassilvitskii, 2007) and k-means|| (Bahmani et al., 2012).
+//
+// both are built on MinDistances, which keeps the squared distance of every point to the closest centroid chosen so far.
+// Adding a centroid is one pass over the points (instead of recomputing the distances to every previous centroid),
+// so k-means++ is O(N * K) instead of O(N * K^2). The pass is done with SIMD on W points at a time (points are copied
+// once to an AoSoA layout with W lanes, which is exactly what calculateDistances expects) and split between threads.
+//
+// randomness comes from the given std::mt19937 for the sequential choices and from hashing (seed, round, point) for
+// the per-point choices of k-means||, so results only depend on the seed and never on the number of threads.
+//
+// all of them take optional point weights (see LloydIteration::weights): a point with weight w is sampled as if it
+// was there w times.
+
+
+struct MinDistances {
+
+	static constexpr int CHUNK = 256; // points per partial sum (multiple of every vector width)
+
+	const DatasetView points;
+	const int N, D;
+	const bool parallel;
+	const ISA isa;
+	const int W;
+
+	Dataset packed; // AoSoA copy of the points, W lanes
+	AlignedBuffer<float> distances; // squared distance to the closest centroid, padded to a multiple of W with zeros
+	AlignedBuffer<float> weights; // copy of the weights padded like distances, empty if there are none
+	AlignedBuffer<int> nearest; // index (in the order they were added) of the closest centroid, only kept by addBatch
+	std::vector<double> chunkSums;
+	double total = 0.0;
+
+	MinDistances(const DatasetView& pts, const float* pointWeights = nullptr, bool parallel = true) : points(pts), N(pts.size()), D(pts.dim()),
+		parallel(parallel), isa(currentISA()), W(lanes(isa)), distances(roundUp(N, W)), nearest(roundUp(N, W)), chunkSums((N + CHUNK - 1) / CHUNK, 0.0) {
+
+		packed = Dataset(N, D, 0.0f, Layout::AoSoA, W);
+
+		#pragma omp parallel for if (parallel)
+		for (int i = 0; i < N; ++i) {
+			for (int d = 0; d < D; ++d) packed.at(i, d) = points[i][d];
+		}
+
+		// padding points have distance 0 so they are never sampled and don't change the sums
+		for (size_t i = 0; i < distances.size(); ++i) {
+			distances[i] = i < (size_t) N ? std::numeric_limits<float>::infinity() : 0.0f;
+			nearest[i] = 0; // the first centroid
+		}
+
+		if (pointWeights) {
+			weights = AlignedBuffer<float>(distances.size());
+			for (size_t i = 0; i < weights.size(); ++i) weights[i] = i < (size_t) N ? pointWeights[i] : 0.0f;
+		}
+	}
+
+	// what point i is sampled proportionally to
+	float mass(int i) const {
+		return weights.size() ? weights[i] * distances[i] : distances[i];
+	}
+
+	// sum of mass(i) for i in [begin, end) in 8 float lanes, the same way whatever W is, so the sampled points (and so the
+	// centroids) don't depend on the CPU
+	double sumDistances(int begin, int end) const {
+
+		float sums[8] = {};
+
+		int i = begin;
+		for (; i + 8 <= end; i += 8) {
+			for (int l = 0; l < 8; ++l) sums[l] += mass(i + l);
+		}
+		for (; i < end; ++i) sums[(i - begin) % 8] += mass(i);
+
+		double sum = 0.0;
+		for (int l = 0; l < 8; ++l) sum += sums[l];
+
+		return sum;
+	}
+
+	// points whose closest centroid is now `centroid` get their distance updated. Also updates the sums.
+	// this is the hot loop of k-means++ and it's memory bound, so nearest isn't updated here
+	void add(const float* centroid) {
+
+		const int numChunks = chunkSums.size();
+
+		#pragma omp parallel for if (parallel) schedule(static)
+		for (int c = 0; c < numChunks; ++c) {
+
+			int begin = c * CHUNK, end = std::min((c + 1) * CHUNK, (int) distances.size());
+			updateMinDistances(isa, &packed.data()[(size_t) begin * D], (end - begin) / W, D, centroid, &distances[begin]);
+
+			chunkSums[c] = sumDistances(begin, end);
+		}
+
+		sumChunks();
+	}
+
+	// same as calling add for every centroid in the batch (their indices start at firstIndex), but in a single pass
+	// using the same kernel as SIMDLloydIteration, which is a lot faster when the batch is big
+	void addBatch(const Dataset& batch, int firstIndex) {
+
+		PackedCentroids packedBatch(batch);
+		const int numChunks = chunkSums.size();
+
+		#pragma omp parallel for if (parallel) schedule(static)
+		for (int c = 0; c < numChunks; ++c) {
+
+			int begin = c * CHUNK, end = std::min((c + 1) * CHUNK, N);
+
+			int labels[CHUNK];
+			float dsts[CHUNK];
+			packedBatch.closest(points, begin, end, labels, dsts);
+
+			chunkSums[c] = 0.0;
+			for (int i = begin; i < end; ++i) {
+				if (dsts[i - begin] < distances[i]) {
+					distances[i] = dsts[i - begin];
+					nearest[i] = firstIndex + labels[i - begin];
+				}
+
+				chunkSums[c] += mass(i);
+			}
+		}
+
+		sumChunks();
+	}
+
+	// total is added up in chunk order by one thread: it's the bound of every draw, so it can't depend on how the
+	// partial sums of the threads would be combined
+	void sumChunks() {
+		total = 0.0;
+		for (double sum : chunkSums) total += sum;
+	}
+
+	// index i of a point sampled with probability mass(i) / total, r must be uniform in [0, 1)
+	int sample(double r) const {
+
+		if (total <= 0.0) return std::min((int) (r * N), N - 1); // every point is already a centroid
+
+		double target = r * total;
+
+		int c = 0;
+		while (c + 1 < (int) chunkSums.size() && target >= chunkSums[c]) {
+			target -= chunkSums[c];
+			++c;
+		}
+
+		int last = -1;
+		for (int i = c * CHUNK; i < std::min((c + 1) * CHUNK, N); ++i) {
+			float m = mass(i);
+			if (m <= 0.0f) continue;
+			last = i;
+
+			if (target < m) return i;
+			target -= m;
+		}
+
+		// float rounding made us walk past the end of the chunk
+		return last >= 0 ? last : c * CHUNK;
+	}
+};
+
+
+// uniform number in [0, 1) from a hash of (seed, a, b). splitmix64 finalizer
+double hashUniform(uint64_t seed, uint64_t a, uint64_t b) {
+	uint64_t x = seed ^ (a * 0x9E3779B97F4A7C15ull) ^ (b * 0xC2B2AE3D27D4EB4Full);
+	x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+	x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+	x = x ^ (x >> 31);
+	return (x >> 11) * (1.0 / 9007199254740992.0);
+}
+
+
+// index of a point chosen with probability proportional to its weight (uniformly if there are no weights)
+int sampleByWeight(int N, const float* weights, double r) {
+
+	if (!weights) return std::min((int) (r * N), N - 1);
+
+	double total = 0.0;
+	for (int i = 0; i < N; ++i) total += weights[i];
+
+	double target = r * total;
+	int last = 0;
+	for (int i = 0; i < N; ++i) {
+		if (weights[i] <= 0.0f) continue;
+		last = i;
+
+		if (target < weights[i]) return i;
+		target -= weights[i];
+	}
+
+	return last;
+}
+
+
+// n points chosen uniformly (with replacement, and proportionally to their weight if there are weights). Seeding on a
+// sample of a few hundred points per centroid gives almost the same quality as seeding on everything, and costs nothing
+// compared to a Lloyd iteration. The sample itself is unweighted
+Dataset subsample(const DatasetView& points, int n, std::mt19937& gen, const float* weights = nullptr) {
+
+	std::vector<int> indices(n);
+
+	if (weights) {
+		std::vector<double> cumulative(points.size());
+		double total = 0.0;
+		for (int i = 0; i < points.size(); ++i) cumulative[i] = total += weights[i];
+
+		std::uniform_real_distribution<double> uniform(0.0, total);
+		for (int& i : indices) {
+			i = std::upper_bound(cumulative.begin(), cumulative.end(), uniform(gen)) - cumulative.begin();
+			i = std::min(i, points.size() - 1);
+		}
+	} else {
+		std::uniform_int_distribution<int> uniform(0, points.size() - 1);
+		for (int& i : indices) i = uniform(gen);
+	}
+	std::sort(indices.begin(), indices.end()); // friendlier to the cache
+
+	Dataset sample(n, points.dim());
+	for (int s = 0; s < n; ++s) {
+		std::copy(points[indices[s]], points[indices[s]] + points.dim(), sample[s]);
+	}
+
+	return sample;
+}
+
+
+// points per centroid seeding looks at by default
+constexpr int SEEDING_SAMPLE = 256;
+
+// points the seeding of a model with k centroids looks at, for a sample size setting (KMeans::seedingSampleSize and the
+// others): that many if it's > 0, SEEDING_SAMPLE per centroid if it's 0, and every point if it's < 0. Never more than N
+int seedingPoints(int sampleSize, int k, int N) {
+	if (sampleSize < 0) return N;
+	return (int) std::min<long long>(N, sampleSize > 0 ? sampleSize : (long long) SEEDING_SAMPLE * k);
+}
+
+
+// k-means++ in O(N * K). It's K passes over the points, one after the other, so for big N it's memory bound
+// and costs about as much as a Lloyd iteration. With maxPoints > 0 it runs on a uniform sample of that many points
+Dataset kMeansPlusPlus(const DatasetView& pts, int k, std::mt19937& gen, bool parallel = true, int maxPoints = 0, const float* weights = nullptr) {
+
+	Dataset sample;
+	DatasetView points = pts;
+	if (maxPoints > 0 && maxPoints < pts.size()) {
+		sample = subsample(pts, maxPoints, gen, weights);
+		points = sample.view();
+		weights = nullptr;
+	}
+
+	const int D = points.dim();
+	std::uniform_real_distribution<double> uniform(0.0, 1.0);
+
+	Dataset centroids(k, D);
+	MinDistances minDistances(points, weights, parallel);
+
+	// first one is uniform (by weight)
+	int chosen = sampleByWeight(points.size(), weights, uniform(gen));
+
+	for (int j = 0; j < k; ++j) {
+		std::copy(points[chosen], points[chosen] + D, centroids[j]);
+		if (j + 1 == k) break;
+
+		minDistances.add(centroids[j]);
+		chosen = minDistances.sample(uniform(gen));
+	}
+
+	return centroids;
+}
+
+
+// weighted k-means++ followed by a few weighted Lloyd iterations. Only used on the few candidates of k-means||,
+// so it's just the simple scalar version
+Dataset reclusterCandidates(const Dataset& candidates, const std::vector<double>& weights, int k, std::mt19937& gen, int iterations = 10) {
+
+	const int C = candidates.size();
+	const int D = candidates.dim();
+	std::uniform_real_distribution<double> uniform(0.0, 1.0);
+
+	Dataset centroids(k, D);
+	std::vector<double> distances(C, std::numeric_limits<double>::infinity());
+
+	// first one with probability proportional to weight
+	double totalWeight = 0.0;
+	for (double w : weights) totalWeight += w;
+
+	auto pick = [&](const std::vector<double>& p, double total) {
+		double target = uniform(gen) * total;
+		int last = 0;
+		for (int i = 0; i < C; ++i) {
+			if (p[i] <= 0.0) continue;
+			last = i;
+			if (target < p[i]) return i;
+			target -= p[i];
+		}
+		return last;
+	};
+
+	int chosen = pick(weights, totalWeight);
+
+	std::vector<double> p(C);
+	for (int j = 0; j < k; ++j) {
+		std::copy(candidates[chosen], candidates[chosen] + D, centroids[j]);
+		if (j + 1 == k) break;
+
+		double total = 0.0;
+		for (int i = 0; i < C; ++i) {
+			distances[i] = std::min(distances[i], (double) squaredEuclideanDistance(candidates[i], centroids[j], D));
+			p[i] = weights[i] * distances[i];
+			total += p[i];
+		}
+
+		chosen = total > 0.0 ? pick(p, total) : std::min((int) (uniform(gen) * C), C - 1);
+	}
+
+	// weighted Lloyd on the candidates
+	std::vector<double> sums(k * D), counts(k);
+	for (int iter = 0; iter < iterations; ++iter) {
+
+		std::fill(sums.begin(), sums.end(), 0.0);
+		std::fill(counts.begin(), counts.end(), 0.0);
+
+		for (int i = 0; i < C; ++i) {
+			float minDst = 1e30;
+			int centroidIndex = 0;
+			for (int j = 0; j < k; ++j) {
+				float dst = squaredEuclideanDistance(candidates[i], centroids[j], D);
+				if (dst < minDst) {
+					minDst = dst;
+					centroidIndex = j;
+				}
+			}
+
+			counts[centroidIndex] += weights[i];
+			for (int d = 0; d < D; ++d) sums[centroidIndex * D + d] += weights[i] * candidates[i][d];
+		}
+
+		for (int j = 0; j < k; ++j) {
+			if (counts[j] <= 0.0) continue;
+			for (int d = 0; d < D; ++d) centroids[j][d] = sums[j * D + d] / counts[j];
+		}
+	}
+
+	return centroids;
+}
+
+
+// k-means||: `rounds` rounds where every point is picked independently with probability oversampling * d^2 / total
+// (so about `oversampling` new candidates per round), then the candidates are weighted by how many points are closest
+// to them and reclustered into k centroids. oversampling = 0 means 2 * k. Each round is one pass over the points, using
+// the Lloyd kernel with all of the round's candidates. maxPoints works like in kMeansPlusPlus
+Dataset kMeansParallel(const DatasetView& pts, int k, std::mt19937& gen, int rounds = 5, double oversampling = 0.0, bool parallel = true, int maxPoints = 0, const float* weights = nullptr) {
+
+	Dataset sample;
+	DatasetView points = pts;
+	if (maxPoints > 0 && maxPoints < pts.size()) {
+		sample = subsample(pts, maxPoints, gen, weights);
+		points = sample.view();
+		weights = nullptr;
+	}
+
+	const int N = points.size();
+	const int D = points.dim();
+	if (oversampling <= 0.0) oversampling = 2.0 * k;
+
+	std::uniform_real_distribution<double> uniform(0.0, 1.0);
+	const uint64_t seed = gen();
+
+	MinDistances minDistances(points, weights, parallel);
+	std::vector<int> candidates = { sampleByWeight(N, weights, uniform(gen)) };
+	minDistances.add(points[candidates[0]]);
+
+	for (int round = 0; round < rounds && minDistances.total > 0.0; ++round) {
+
+		const double total = minDistances.total;
+		std::vector<int> picked;
+
+		#pragma omp parallel if (parallel)
+		{
+			std::vector<int> pickedThread;
+
+			#pragma omp for nowait schedule(static)
+			for (int i = 0; i < N; ++i) {
+				if (hashUniform(seed, round, i) * total < oversampling * minDistances.mass(i)) pickedThread.push_back(i);
+			}
+
+			#pragma omp critical
+			picked.insert(picked.end(), pickedThread.begin(), pickedThread.end());
+		}
+
+		if (picked.empty()) continue;
+
+		// threads finish in any order
+		std::sort(picked.begin(), picked.end());
+
+		Dataset batch(picked.size(), D);
+		for (size_t b = 0; b < picked.size(); ++b) {
+			std::copy(points[picked[b]], points[picked[b]] + D, batch[b]);
+		}
+
+		minDistances.addBatch(batch, candidates.size());
+		candidates.insert(candidates.end(), picked.begin(), picked.end());
+	}
+
+	// not enough candidates (few distinct points), pad with uniform choices
+	while ((int) candidates.size() < k) {
+		int i = sampleByWeight(N, weights, uniform(gen));
+
+		Dataset batch(1, D);
+		std::copy(points[i], points[i] + D, batch[0]);
+
+		minDistances.addBatch(batch, candidates.size());
+		candidates.push_back(i);
+	}
+
+	// weight of each candidate = number (or total weight) of points closest to it
+	const int C = candidates.size();
+	std::vector<double> candidateWeights(C, 0.0);
+	for (int i = 0; i < N; ++i) candidateWeights[minDistances.nearest[i]] += weights ? weights[i] : 1.0;
+
+	Dataset candidatePoints(C, D);
+	for (int c = 0; c < C; ++c) {
+		std::copy(points[candidates[c]], points[candidates[c]] + D, candidatePoints[c]);
+	}
+
+	return reclusterCandidates(candidatePoints, candidateWeights, k, gen);
+}
@@ -0,0 +1,403 @@
+// no include guard on purpose: simd.hpp includes this once per instruction set, each time inside its own namespace
+// (which defines `Ops`, the vector type and its operations) and under the matching #pragma GCC target, so every
+// kernel here is compiled once for every ISA and the right one is picked at runtime.
+//
+// everything is written for a generic vector of O::W floats. Centroids are packed by PackedCentroids (see simd.hpp) in
+// groups of W, group g holding one vector per dimension (packed[(g * D + d) * W + lane])
+//
+// kernels with a FixedD template parameter are also compiled for the dimensions in dispatchDim (simd.hpp): with FixedD
+// != 0 the D passed at runtime is ignored, so loops over dimensions are fully unrolled and the centroid vectors of a
+// group are just FixedD loads with constant offsets. FixedD = 0 is the generic version
+
+
+// distances between one point and the W points of a group
+template <class O, int FixedD = 0>
+typename O::V calculateDistances(const float* point, const float* group, int D) {
+
+	if (FixedD) D = FixedD;
+
+	// this works really well with low dimensions, opposed to calculating
+	// one distance W dimensions at a time (for obvious reasons)
+	typename O::V dst = O::zero();
+
+	// -O2 doesn't always fully unroll this when D is a constant (inside the loop over groups), so it's asked for
+	#pragma GCC unroll 4
+	for (int d = 0; d < D; ++d) {
+		typename O::V diff = O::sub(O::set1(point[d]), O::load(&group[d * O::W]));
+		dst = O::add(dst, O::mul(diff, diff));
+	}
+
+	return dst;
+}
+
+
+template <class O>
+void updateArgmin(typename O::V& minIdxs, typename O::V currentIdxs, typename O::V& minDistances, typename O::V currentDistances) {
+	typename O::Mask mask = O::greater(minDistances, currentDistances); // where new distance is smaller than min distance
+	minIdxs = O::blend(minIdxs, currentIdxs, mask); // update index where distance is smaller
+	minDistances = O::min(currentDistances, minDistances); // update min distances
+}
+
+
+// first lane holding the smallest value
+template <class O>
+int argmin(typename O::V vec) {
+
+	// example: vec = [5, 2, 3, 7, 11, 2, 4, 10]
+	// indices:        0  1  2  3   4  5  6   7 --> argmin = 1
+
+	typename O::V minVal = O::hmin(vec); // minVal = [2, 2, 2, 2, 2, 2, 2, 2]
+	int mask = O::movemask(O::equal(minVal, vec)); // mask = 0b00100010 (1 where vec's element == minVal)
+	//                                                                ^
+	return __builtin_ctz(mask); // index of first bit set in mask  ---| = 1
+}
+
+
+// lane l starts at centroid l * groups (see PackedCentroids)
+template <class O>
+typename O::V firstIndices(int groups) {
+	alignas(64) float idxs[O::W];
+	for (int l = 0; l < O::W; ++l) idxs[l] = (float) (l * groups);
+
+	return O::load(idxs);
+}
+
+
+// index of the closest centroid to point. Ties are broken by the smallest index, same as the scalar loop.
+// If minDst is not null, the squared distance is written there
+template <class O, int FixedD = 0>
+int closestCentroid(const float* point, const float* packed, int groups, int D, float* minDst) {
+
+	if (FixedD) D = FixedD;
+
+	const typename O::V increment = O::set1(1.0f);
+	typename O::V minIdxs = firstIndices<O>(groups);
+
+	// first W distances can be calculated here to avoid an unnecessary cmp, blendv and min
+	// this is actually important when K is small, and that's quite common in k-means
+	typename O::V minDistances = calculateDistances<O, FixedD>(point, packed, D);
+
+	// indexes of next clusters we will work on
+	typename O::V currIdx = O::add(minIdxs, increment);
+
+	for (int g = 1; g < groups; ++g) {
+
+		typename O::V dst = calculateDistances<O, FixedD>(point, &packed[g * D * O::W], D);
+
+		// update argmin and min distance in every slice
+		updateArgmin<O>(minIdxs, currIdx, minDistances, dst);
+
+		currIdx = O::add(currIdx, increment);
+	}
+
+	// pass the contents of minIdxs to an array
+	float idxsArr[O::W];
+	O::storeu(idxsArr, minIdxs);
+
+	// this creates a problem: argmin will return the index of the first element in minDistances that is equal to the min
+	// value in minDistances, but because the real indices are in idxsArr, this will NOT be the real argmin. It will actually
+	// be the argmin of the indices % W (so for example, with W = 8, if centroids 6 and 17 are equidistant to the point, this
+	// will give centroid 17 % 8 = 1 as argmin instead of 6 % 8 = 6). This is not actually a problem because the k-means
+	// algorithm doesn't specify to which cluster a point should be assigned to if two or more share the same (and minimum)
+	// distance, so we could choose any, but just so this is equal to the scalar version, I "fixed" it with the permutations
+	// done in PackedCentroids
+	int lane = argmin<O>(minDistances);
+
+	if (minDst) {
+		float dstArr[O::W];
+		O::storeu(dstArr, minDistances);
+		*minDst = dstArr[lane];
+	}
+
+	return (int) idxsArr[lane];
+}
+
+
+// same as closestCentroid, but also gives the squared distance to the second closest centroid (which is what
+// Hamerly's lower bound needs). Each lane keeps its own two smallest distances, and they are combined at the end
+template <class O, int FixedD = 0>
+int closestTwoCentroids(const float* point, const float* packed, int groups, int D, float& minDst, float& secondMinDst) {
+
+	if (FixedD) D = FixedD;
+
+	const typename O::V increment = O::set1(1.0f);
+	typename O::V minIdxs = firstIndices<O>(groups);
+
+	typename O::V minDistances = calculateDistances<O, FixedD>(point, packed, D);
+	typename O::V secondMinDistances = O::set1(std::numeric_limits<float>::infinity());
+
+	typename O::V currIdx = O::add(minIdxs, increment);
+
+	for (int g = 1; g < groups; ++g) {
+
+		typename O::V dst = calculateDistances<O, FixedD>(point, &packed[g * D * O::W], D);
+
+		// where dst becomes the new min, the old min becomes the second min. Everywhere else dst may still beat the second min
+		typename O::Mask mask = O::greater(minDistances, dst);
+		secondMinDistances = O::blend(O::min(secondMinDistances, dst), minDistances, mask);
+
+		updateArgmin<O>(minIdxs, currIdx, minDistances, dst);
+
+		currIdx = O::add(currIdx, increment);
+	}
+
+	float idxsArr[O::W], minArr[O::W], secondArr[O::W];
+	O::storeu(idxsArr, minIdxs);
+	O::storeu(minArr, minDistances);
+	O::storeu(secondArr, secondMinDistances);
+
+	// see closestCentroid for why the first lane with the min value is the real argmin
+	int lane = argmin<O>(minDistances);
+
+	minDst = minArr[lane];
+	secondMinDst = secondArr[lane];
+	for (int l = 0; l < O::W; ++l) {
+		if (l != lane) secondMinDst = std::min(secondMinDst, minArr[l]);
+	}
+
+	return (int) idxsArr[lane];
+}
+
+
+// dot products of 4 rows with the centroids of NG consecutive groups, starting at group g, over dimensions [d0, d1).
+// They are added to dots (row r, group g starts at dots[r * ld + g * W]). The 4 * NG sums stay in registers the whole
+// time, and every centroid vector loaded is used by 4 rows
+template <class O, int NG>
+void dotTile(const float* const* rows, const float* packed, int g, int D, int d0, int d1, float* dots, int ld) {
+
+	typename O::V acc[4][NG];
+
+	#pragma GCC unroll 4
+	for (int r = 0; r < 4; ++r) {
+		#pragma GCC unroll 2
+		for (int n = 0; n < NG; ++n) acc[r][n] = O::loadu(&dots[r * ld + (g + n) * O::W]);
+	}
+
+	for (int d = d0; d < d1; ++d) {
+
+		typename O::V c[NG];
+
+		#pragma GCC unroll 2
+		for (int n = 0; n < NG; ++n) c[n] = O::load(&packed[((size_t) (g + n) * D + d) * O::W]);
+
+		#pragma GCC unroll 4
+		for (int r = 0; r < 4; ++r) {
+			typename O::V x = O::set1(rows[r][d]);
+
+			#pragma GCC unroll 2
+			for (int n = 0; n < NG; ++n) acc[r][n] = O::mulAdd(x, c[n], acc[r][n]);
+		}
+	}
+
+	#pragma GCC unroll 4
+	for (int r = 0; r < 4; ++r) {
+		#pragma GCC unroll 2
+		for (int n = 0; n < NG; ++n) O::storeu(&dots[r * ld + (g + n) * O::W], acc[r][n]);
+	}
+}
+
+
+// pshufb control that turns the bytes of loadPixelBytes into channels 2q and 2q + 1 of the pixel of every lane, as two
+// int16 (0 for channels past C)
+template <class O>
+typename O::VI pairShuffle(int C, int q) {
+	alignas(64) int32_t ctrl[O::W];
+	for (int l = 0; l < O::W; ++l) {
+		const int first = l % 4 * C; // pshufb only sees the 16 bytes of its own 4 lanes
+
+		uint32_t c = 0;
+		for (int b = 0; b < 2; ++b) {
+			const int channel = 2 * q + b;
+			const uint32_t low = channel < C ? first + channel : 0x80;
+			c |= (low | 0x8000) << (16 * b);
+		}
+		ctrl[l] = c;
+	}
+
+	return O::loadi(ctrl);
+}
+
+// 8 bit pixels with C channels against k centroids rounded to int16 (see PackedPixelCentroids in pixel-k-means.hpp),
+// pairs[j * PAIRS + q] holding channels 2q and 2q + 1 of centroid j (low and high half). Unlike the float kernels, each
+// lane is a pixel: the score of centroid j for W pixels is norms[j] - 2 p.q, where madd16 does one pair of channels
+// per instruction (the pixels are doubled instead of the centroids, 2 * 255 still fits in an int16), and there's no
+// horizontal min per pixel.
+//
+// labels gets the centroid with the smallest score (smallest index on ties), or -1 if any other score is within
+// 2 * sum(p) + slack of it, which is when the scores can't tell which centroid is really the closest
+template <class O, int C>
+void closestPixelsBatch(const unsigned char* pixels, int count, const int32_t* pairs, const int32_t* norms, int k, int32_t slack, int* labels) {
+
+	constexpr int PAIRS = (C + 1) / 2;
+	using VI = typename O::VI;
+
+	VI shuffles[PAIRS];
+	for (int q = 0; q < PAIRS; ++q) shuffles[q] = pairShuffle<O>(C, q);
+
+	const VI ones = O::set1i(0x00010001);
+	const VI slacks = O::set1i(slack);
+	const VI noScore = O::set1i(PIXEL_NO_SCORE);
+	const VI unsure = O::set1i(-1);
+
+	// W pixels from p, labels to out
+	auto block = [&](const unsigned char* p, int* out) {
+
+		const VI bytes = O::loadPixelBytes(p, C);
+
+		VI px[PAIRS];
+		VI sums = O::set1i(0); // 2 * sum(p)
+		for (int q = 0; q < PAIRS; ++q) {
+			px[q] = O::shuffleBytes(bytes, shuffles[q]);
+			px[q] = O::addi(px[q], px[q]);
+			sums = O::addi(sums, O::madd16(px[q], ones));
+		}
+
+		VI minScores = O::set1i(norms[0]);
+		for (int q = 0; q < PAIRS; ++q) minScores = O::subi(minScores, O::madd16(px[q], O::set1i(pairs[q])));
+
+		VI secondScores = noScore;
+		VI minIdxs = O::set1i(0);
+
+		for (int j = 1; j < k; ++j) {
+
+			VI score = O::set1i(norms[j]);
+			for (int q = 0; q < PAIRS; ++q) score = O::subi(score, O::madd16(px[q], O::set1i(pairs[j * PAIRS + q])));
+
+			// same as closestTwoCentroids
+			typename O::MaskI mask = O::greateri(minScores, score);
+			secondScores = O::blendi(O::mini(secondScores, score), minScores, mask);
+			minIdxs = O::blendi(minIdxs, O::set1i(j), mask);
+			minScores = O::mini(minScores, score);
+		}
+
+		const VI limit = O::addi(O::addi(minScores, sums), slacks);
+		O::storeui(out, O::blendi(unsure, minIdxs, O::greateri(secondScores, limit)));
+	};
+
+	// loadPixelBytes reads 4 * W bytes, which can go past the last pixel for C < 4: the last pixels are copied first
+	int i = 0;
+	for (; (size_t) i * C + 4 * O::W <= (size_t) count * C; i += O::W) block(&pixels[(size_t) i * C], &labels[i]);
+
+	for (; i < count; i += O::W) {
+		const int n = std::min(O::W, count - i);
+
+		alignas(64) unsigned char p[4 * O::W] = {};
+		int out[O::W];
+
+		std::copy(&pixels[(size_t) i * C], &pixels[(size_t) (i + n) * C], p);
+		block(p, out);
+		std::copy(out, out + n, &labels[i]);
+	}
+}
+
+
+// entry points, called through the dispatchers in simd.hpp
+
+template <int FixedD>
+int closest(const float* point, const float* packed, int groups, int D, float* minDst) {
+	return closestCentroid<Ops, FixedD>(point, packed, groups, D, minDst);
+}
+
+template <int FixedD>
+int closestTwo(const float* point, const float* packed, int groups, int D, float& minDst, float& secondMinDst) {
+	return closestTwoCentroids<Ops, FixedD>(point, packed, groups, D, minDst, secondMinDst);
+}
+
+// labels (and squared distances, if minDst is not null) of points [begin, end), written from index 0
+template <int FixedD>
+void closestBatch(const DatasetView& points, int begin, int end, const float* packed, int groups, int* labels, float* minDst) {
+
+	// with D known at compile time and all centroids in one group (k <= W, which is what isaFor aims for), the centroids
+	// are just FixedD vectors: they're loaded once per block and stay in registers, and lane l is centroid l
+	if constexpr (FixedD != 0) {
+		if (groups == 1) {
+			typename Ops::V centroids[FixedD];
+
+			#pragma GCC unroll 4
+			for (int d = 0; d < FixedD; ++d) centroids[d] = Ops::load(&packed[d * Ops::W]);
+
+			for (int i = begin; i < end; ++i) {
+				const float* point = points[i];
+
+				// same operations as calculateDistances
+				typename Ops::V dst = Ops::zero();
+
+				#pragma GCC unroll 4
+				for (int d = 0; d < FixedD; ++d) {
+					typename Ops::V diff = Ops::sub(Ops::set1(point[d]), centroids[d]);
+					dst = Ops::add(dst, Ops::mul(diff, diff));
+				}
+
+				int lane = argmin<Ops>(dst);
+				labels[i - begin] = lane;
+
+				if (minDst) {
+					float dstArr[Ops::W];
+					Ops::storeu(dstArr, dst);
+					minDst[i - begin] = dstArr[lane];
+				}
+			}
+
+			return;
+		}
+	}
+
+	for (int i = begin; i < end; ++i) {
+		labels[i - begin] = closestCentroid<Ops, FixedD>(points[i], packed, groups, points.dim(), minDst ? &minDst[i - begin] : nullptr);
+	}
+}
+
+// distances[i] = min(distances[i], squared distance of point i to centroid) for numBlocks blocks of an AoSoA copy of
+// the points with W lanes (distances has W values per block)
+template <int FixedD>
+void updateMinDistances(const float* blocks, int numBlocks, int D, const float* centroid, float* distances) {
+
+	if (FixedD) D = FixedD;
+
+	for (int b = 0; b < numBlocks; ++b) {
+		typename Ops::V dst = calculateDistances<Ops, FixedD>(centroid, &blocks[b * D * Ops::W], D);
+		Ops::store(&distances[b * Ops::W], Ops::min(Ops::load(&distances[b * Ops::W]), dst));
+	}
+}
+
+// dot products of every row with every packed centroid: dots[r * groups * W + g * W + lane]. numRows must be a multiple
+// of 4. Dimensions are done in slices, so the slice of two groups being used (at most 2 * 256 * 16 floats) stays in L1
+// while it goes through all rows, and the rows (a few dozen) stay in L2 while they go through all groups
+void dotProducts(const float* const* rows, int numRows, const float* packed, int groups, int D, float* dots) {
+
+	constexpr int SLICE = 256;
+	const int ld = groups * Ops::W;
+
+	std::fill(dots, dots + (size_t) numRows * ld, 0.0f);
+
+	for (int d0 = 0; d0 < D; d0 += SLICE) {
+		int d1 = std::min(d0 + SLICE, D);
+
+		int g = 0;
+		for (; g + 2 <= groups; g += 2) {
+			for (int r = 0; r < numRows; r += 4) dotTile<Ops, 2>(&rows[r], packed, g, D, d0, d1, &dots[(size_t) r * ld], ld);
+		}
+		if (g < groups) {
+			for (int r = 0; r < numRows; r += 4) dotTile<Ops, 1>(&rows[r], packed, g, D, d0, d1, &dots[(size_t) r * ld], ld);
+		}
+	}
+}
+
+// n float16 or bfloat16 to floats, W at a time and the last n % W one by one (never reads past in + n)
+void halfToFloats(HalfFormat format, const uint16_t* in, size_t n, float* out) {
+	const size_t full = n / Ops::W * Ops::W;
+
+	if (format == HalfFormat::Float16) {
+		for (size_t i = 0; i < full; i += Ops::W) Ops::storeu(&out[i], Ops::loadHalf(&in[i]));
+		for (size_t i = full; i < n; ++i) out[i] = halfToFloat(in[i]);
+	} else {
+		for (size_t i = 0; i < full; i += Ops::W) Ops::storeu(&out[i], Ops::loadBFloat16(&in[i]));
+		for (size_t i = full; i < n; ++i) out[i] = bfloat16ToFloat(in[i]);
+	}
+}
+
+// labels of count pixels with C channels, -1 where the scores aren't enough (see closestPixelsBatch)
+template <int C>
+void closestPixels(const unsigned char* pixels, int count, const int32_t* pairs, const int32_t* norms, int k, int32_t slack, int* labels) {
+	closestPixelsBatch<Ops, C>(pixels, count, pairs, norms, k, slack, labels);
+}
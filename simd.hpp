@@ -0,0 +1,533 @@
+#pragma once
+
+#include "dataset.hpp"
+#include <immintrin.h>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <algorithm>
+#include <type_traits>
+
+
+// runtime instruction set dispatch. The kernels in simd-kernels.hpp are compiled once for every ISA below (each copy
+// under its own #pragma GCC target), and which one runs is decided at runtime with CPUID, so the same binary works on
+// any x86-64 CPU and doesn't need -march=native. AVX-512 uses 16 lanes, AVX 8, SSE 4, and the scalar fallback is the
+// same generic code with a single lane.
+//
+// every width gives the same labels as the scalar loop of BasicLloydIteration: distances are computed with the same
+// operations in the same order (fp-contract is off, so the compiler never fuses a mul and an add into an FMA that rounds
+// differently), and ties go to the smallest index thanks to the permutation in PackedCentroids. FMA is only used
+// explicitly (mulAdd), by kernels that don't need to match the scalar loop bit for bit.
+//
+// the ISA can be forced with the KMEANS_ISA environment variable (scalar, sse, avx, avx512) or setISA, but never to
+// one the CPU doesn't support.
+
+enum class ISA { Scalar, SSE, AVX, AVX512 };
+
+int lanes(ISA isa) {
+	switch (isa) {
+		case ISA::Scalar: return 1;
+		case ISA::SSE: return 4;
+		case ISA::AVX: return 8;
+		case ISA::AVX512: return 16;
+	}
+	return 1;
+}
+
+const char* isaName(ISA isa) {
+	switch (isa) {
+		case ISA::Scalar: return "scalar";
+		case ISA::SSE: return "sse";
+		case ISA::AVX: return "avx";
+		case ISA::AVX512: return "avx512";
+	}
+	return "";
+}
+
+// bigger than any score of the pixel kernels (see pixel-k-means.hpp)
+constexpr int32_t PIXEL_NO_SCORE = 1 << 30;
+
+// 16 bit points (see half-k-means.hpp)
+enum class HalfFormat { Float16, BFloat16 };
+
+// any float16 (subnormals, infs and nans too), for the ISAs without F16C
+float halfToFloat(uint16_t x) {
+	const uint32_t sign = (uint32_t) (x & 0x8000) << 16;
+	const uint32_t exponent = (x >> 10) & 0x1F, mantissa = x & 0x3FF;
+
+	if (!exponent) {
+		const float value = mantissa * 5.9604644775390625e-08f; // 2^-24
+		return sign ? -value : value;
+	}
+
+	// rebias the exponent (127 - 15 = 112), or keep it all ones for infs and nans
+	const uint32_t bits = sign | (exponent == 0x1F ? 0x7F800000u : (exponent + 112) << 23) | mantissa << 13;
+
+	float value;
+	std::memcpy(&value, &bits, sizeof(value));
+	return value;
+}
+
+// bfloat16 is the top half of a float
+float bfloat16ToFloat(uint16_t x) {
+	const uint32_t bits = (uint32_t) x << 16;
+
+	float value;
+	std::memcpy(&value, &bits, sizeof(value));
+	return value;
+}
+
+
+#pragma GCC push_options
+#pragma GCC optimize("fp-contract=off")
+
+namespace simd_scalar {
+
+	struct Ops {
+		using V = float;
+		using Mask = bool;
+		static constexpr int W = 1;
+
+		static V zero() { return 0.0f; }
+		static V set1(float x) { return x; }
+		static V load(const float* p) { return *p; }
+		static V loadu(const float* p) { return *p; }
+		static void store(float* p, V v) { *p = v; }
+		static void storeu(float* p, V v) { *p = v; }
+		static V add(V a, V b) { return a + b; }
+		static V sub(V a, V b) { return a - b; }
+		static V mul(V a, V b) { return a * b; }
+		static V mulAdd(V a, V b, V c) { return a * b + c; }
+		static V min(V a, V b) { return a < b ? a : b; }
+		static Mask greater(V a, V b) { return a > b; }
+		static Mask equal(V a, V b) { return a == b; }
+		static V blend(V a, V b, Mask m) { return m ? b : a; }
+		static V hmin(V v) { return v; }
+		static int movemask(Mask m) { return m; }
+
+		// W float16 or bfloat16 as floats
+		static V loadHalf(const uint16_t* p) { return halfToFloat(*p); }
+		static V loadBFloat16(const uint16_t* p) { return bfloat16ToFloat(*p); }
+
+		// int32 lanes, for the 8 bit pixel kernels
+		using VI = int32_t;
+		using MaskI = bool;
+
+		static VI set1i(int32_t x) { return x; }
+		static VI loadi(const int32_t* p) { return *p; }
+		static void storeui(int32_t* p, VI v) { *p = v; }
+		static VI addi(VI a, VI b) { return a + b; }
+		static VI subi(VI a, VI b) { return a - b; }
+		static VI mini(VI a, VI b) { return a < b ? a : b; }
+		static MaskI greateri(VI a, VI b) { return a > b; }
+		static VI blendi(VI a, VI b, MaskI m) { return m ? b : a; }
+
+		// a and b hold two int16 each (low and high half): a.lo * b.lo + a.hi * b.hi, like pmaddwd
+		static VI madd16(VI a, VI b) { return (int16_t) (a & 0xFFFF) * (int16_t) (b & 0xFFFF) + (a >> 16) * (b >> 16); }
+
+		// every 4 lanes (16 bytes) start at the pixel of their first lane, p + lane * C. Here, the first 4 bytes of pixel 0
+		static VI loadPixelBytes(const unsigned char* p, int /* C */) {
+			int32_t x;
+			std::memcpy(&x, p, sizeof(x));
+			return x;
+		}
+
+		// pshufb: byte b of the result is byte ctrl[b] of v, or 0 if ctrl[b] has the high bit set
+		static VI shuffleBytes(VI v, VI ctrl) {
+			uint32_t result = 0;
+			for (int b = 0; b < 4; ++b) {
+				uint32_t c = ((uint32_t) ctrl >> (8 * b)) & 0xFF;
+				if (!(c & 0x80)) result |= (((uint32_t) v >> (8 * (c & 3))) & 0xFF) << (8 * b);
+			}
+			return result;
+		}
+	};
+
+	#include "simd-kernels.hpp"
+}
+
+#pragma GCC pop_options
+
+
+#pragma GCC push_options
+#pragma GCC target("sse4.1")
+#pragma GCC optimize("fp-contract=off")
+
+namespace simd_sse {
+
+	struct Ops {
+		using V = __m128;
+		using Mask = __m128;
+		static constexpr int W = 4;
+
+		static V zero() { return _mm_setzero_ps(); }
+		static V set1(float x) { return _mm_set1_ps(x); }
+		static V load(const float* p) { return _mm_load_ps(p); }
+		static V loadu(const float* p) { return _mm_loadu_ps(p); }
+		static void store(float* p, V v) { _mm_store_ps(p, v); }
+		static void storeu(float* p, V v) { _mm_storeu_ps(p, v); }
+		static V add(V a, V b) { return _mm_add_ps(a, b); }
+		static V sub(V a, V b) { return _mm_sub_ps(a, b); }
+		static V mul(V a, V b) { return _mm_mul_ps(a, b); }
+		static V mulAdd(V a, V b, V c) { return _mm_add_ps(_mm_mul_ps(a, b), c); }
+		static V min(V a, V b) { return _mm_min_ps(a, b); }
+		static Mask greater(V a, V b) { return _mm_cmpgt_ps(a, b); }
+		static Mask equal(V a, V b) { return _mm_cmpeq_ps(a, b); }
+		static V blend(V a, V b, Mask m) { return _mm_blendv_ps(a, b, m); }
+		static int movemask(Mask m) { return _mm_movemask_ps(m); }
+
+		// no F16C here, so float16 is converted one at a time
+		static V loadHalf(const uint16_t* p) { return _mm_setr_ps(halfToFloat(p[0]), halfToFloat(p[1]), halfToFloat(p[2]), halfToFloat(p[3])); }
+		static V loadBFloat16(const uint16_t* p) { return _mm_castsi128_ps(_mm_slli_epi32(_mm_cvtepu16_epi32(_mm_loadl_epi64((const __m128i*) p)), 16)); }
+
+		static V hmin(V vec) {
+			// vec = [x3, x2, x1, x0]
+			vec = _mm_min_ps(vec, _mm_shuffle_ps(vec, vec, _MM_SHUFFLE(2, 1, 0, 3))); // vec = [min(x3, x2), min(x2, x1), min(x1, x0), min(x0, x3)]
+			vec = _mm_min_ps(vec, _mm_shuffle_ps(vec, vec, _MM_SHUFFLE(1, 0, 3, 2)));
+			// vec = [min(x3, x2, x1, x0), min(x2, x1, x0, x3), min(x1, x0, x3, x2), min(x0, x3, x2, x1)] (min of all elements)
+
+			return vec;
+		}
+
+		using VI = __m128i;
+		using MaskI = __m128i;
+
+		static VI set1i(int32_t x) { return _mm_set1_epi32(x); }
+		static VI loadi(const int32_t* p) { return _mm_load_si128((const __m128i*) p); }
+		static void storeui(int32_t* p, VI v) { _mm_storeu_si128((__m128i*) p, v); }
+		static VI addi(VI a, VI b) { return _mm_add_epi32(a, b); }
+		static VI subi(VI a, VI b) { return _mm_sub_epi32(a, b); }
+		static VI mini(VI a, VI b) { return _mm_min_epi32(a, b); }
+		static MaskI greateri(VI a, VI b) { return _mm_cmpgt_epi32(a, b); }
+		static VI blendi(VI a, VI b, MaskI m) { return _mm_blendv_epi8(a, b, m); }
+		static VI madd16(VI a, VI b) { return _mm_madd_epi16(a, b); }
+		static VI loadPixelBytes(const unsigned char* p, int /* C */) { return _mm_loadu_si128((const __m128i*) p); }
+		static VI shuffleBytes(VI v, VI ctrl) { return _mm_shuffle_epi8(v, ctrl); }
+	};
+
+	#include "simd-kernels.hpp"
+}
+
+#pragma GCC pop_options
+
+
+#pragma GCC push_options
+#pragma GCC target("avx2,fma,f16c")
+#pragma GCC optimize("fp-contract=off")
+
+namespace simd_avx {
+
+	struct Ops {
+		using V = __m256;
+		using Mask = __m256;
+		static constexpr int W = 8;
+
+		static V zero() { return _mm256_setzero_ps(); }
+		static V set1(float x) { return _mm256_set1_ps(x); }
+		static V load(const float* p) { return _mm256_load_ps(p); }
+		static V loadu(const float* p) { return _mm256_loadu_ps(p); }
+		static void store(float* p, V v) { _mm256_store_ps(p, v); }
+		static void storeu(float* p, V v) { _mm256_storeu_ps(p, v); }
+		static V add(V a, V b) { return _mm256_add_ps(a, b); }
+		static V sub(V a, V b) { return _mm256_sub_ps(a, b); }
+		static V mul(V a, V b) { return _mm256_mul_ps(a, b); }
+		static V mulAdd(V a, V b, V c) { return _mm256_fmadd_ps(a, b, c); }
+		static V min(V a, V b) { return _mm256_min_ps(a, b); }
+		static Mask greater(V a, V b) { return _mm256_cmp_ps(a, b, _CMP_GT_OQ); }
+		static Mask equal(V a, V b) { return _mm256_cmp_ps(a, b, _CMP_EQ_OQ); }
+		static V blend(V a, V b, Mask m) { return _mm256_blendv_ps(a, b, m); }
+		static int movemask(Mask m) { return _mm256_movemask_ps(m); }
+		static V loadHalf(const uint16_t* p) { return _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*) p)); }
+		static V loadBFloat16(const uint16_t* p) { return _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*) p)), 16)); }
+
+		static V hmin(V vec) {
+			vec = _mm256_min_ps(vec, _mm256_permute2f128_ps(vec, vec, 0b11)); // gets min of first 4 with last 4
+
+			// same idea as SSE
+			vec = _mm256_min_ps(vec, _mm256_permute_ps(vec, 0b01001110));
+			vec = _mm256_min_ps(vec, _mm256_permute_ps(vec, 0b10110001));
+
+			return vec;
+		}
+
+		using VI = __m256i;
+		using MaskI = __m256i;
+
+		static VI set1i(int32_t x) { return _mm256_set1_epi32(x); }
+		static VI loadi(const int32_t* p) { return _mm256_load_si256((const __m256i*) p); }
+		static void storeui(int32_t* p, VI v) { _mm256_storeu_si256((__m256i*) p, v); }
+		static VI addi(VI a, VI b) { return _mm256_add_epi32(a, b); }
+		static VI subi(VI a, VI b) { return _mm256_sub_epi32(a, b); }
+		static VI mini(VI a, VI b) { return _mm256_min_epi32(a, b); }
+		static MaskI greateri(VI a, VI b) { return _mm256_cmpgt_epi32(a, b); }
+		static VI blendi(VI a, VI b, MaskI m) { return _mm256_blendv_epi8(a, b, m); }
+		static VI madd16(VI a, VI b) { return _mm256_madd_epi16(a, b); }
+		static VI shuffleBytes(VI v, VI ctrl) { return _mm256_shuffle_epi8(v, ctrl); }
+
+		// pixel 4 starts at byte 4C, which is int32 C
+		static VI loadPixelBytes(const unsigned char* p, int C) {
+			VI v = _mm256_loadu_si256((const __m256i*) p);
+			return _mm256_permutevar8x32_epi32(v, _mm256_setr_epi32(0, 1, 2, 3, C, C + 1, C + 2, C + 3));
+		}
+	};
+
+	#include "simd-kernels.hpp"
+}
+
+#pragma GCC pop_options
+
+
+#pragma GCC push_options
+#pragma GCC target("avx512f,avx512bw")
+#pragma GCC optimize("fp-contract=off")
+
+// GCC 12 warns that '__Y' may be used uninitialized inside avx512fintrin.h, wherever an intrinsic fills the lanes it
+// doesn't write with _mm512_undefined_*() (a variable initialized with itself on purpose). Those lanes are never read,
+// it's a false positive of the compiler, so it's silenced for the AVX-512 kernels only
+#pragma GCC diagnostic push
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+
+namespace simd_avx512 {
+
+	struct Ops {
+		using V = __m512;
+		using Mask = __mmask16;
+		static constexpr int W = 16;
+
+		static V zero() { return _mm512_setzero_ps(); }
+		static V set1(float x) { return _mm512_set1_ps(x); }
+		static V load(const float* p) { return _mm512_load_ps(p); }
+		static V loadu(const float* p) { return _mm512_loadu_ps(p); }
+		static void store(float* p, V v) { _mm512_store_ps(p, v); }
+		static void storeu(float* p, V v) { _mm512_storeu_ps(p, v); }
+		static V add(V a, V b) { return _mm512_add_ps(a, b); }
+		static V sub(V a, V b) { return _mm512_sub_ps(a, b); }
+		static V mul(V a, V b) { return _mm512_mul_ps(a, b); }
+		static V mulAdd(V a, V b, V c) { return _mm512_fmadd_ps(a, b, c); }
+		static V min(V a, V b) { return _mm512_min_ps(a, b); }
+		static Mask greater(V a, V b) { return _mm512_cmp_ps_mask(a, b, _CMP_GT_OQ); }
+		static Mask equal(V a, V b) { return _mm512_cmp_ps_mask(a, b, _CMP_EQ_OQ); }
+		static V blend(V a, V b, Mask m) { return _mm512_mask_blend_ps(m, a, b); }
+		static V hmin(V vec) { return _mm512_set1_ps(_mm512_reduce_min_ps(vec)); }
+		static int movemask(Mask m) { return m; }
+		static V loadHalf(const uint16_t* p) { return _mm512_cvtph_ps(_mm256_loadu_si256((const __m256i*) p)); }
+		static V loadBFloat16(const uint16_t* p) { return _mm512_castsi512_ps(_mm512_slli_epi32(_mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i*) p)), 16)); }
+
+		using VI = __m512i;
+		using MaskI = __mmask16;
+
+		static VI set1i(int32_t x) { return _mm512_set1_epi32(x); }
+		static VI loadi(const int32_t* p) { return _mm512_load_si512(p); }
+		static void storeui(int32_t* p, VI v) { _mm512_storeu_si512(p, v); }
+		static VI addi(VI a, VI b) { return _mm512_add_epi32(a, b); }
+		static VI subi(VI a, VI b) { return _mm512_sub_epi32(a, b); }
+		static VI mini(VI a, VI b) { return _mm512_min_epi32(a, b); }
+		static MaskI greateri(VI a, VI b) { return _mm512_cmpgt_epi32_mask(a, b); }
+		static VI blendi(VI a, VI b, MaskI m) { return _mm512_mask_blend_epi32(m, a, b); }
+
+		// these two are the reason this needs avx512bw
+		static VI madd16(VI a, VI b) { return _mm512_madd_epi16(a, b); }
+		static VI shuffleBytes(VI v, VI ctrl) { return _mm512_shuffle_epi8(v, ctrl); }
+
+		static VI loadPixelBytes(const unsigned char* p, int C) {
+			VI v = _mm512_loadu_si512(p);
+			return _mm512_permutexvar_epi32(_mm512_setr_epi32(0, 1, 2, 3, C, C + 1, C + 2, C + 3, 2 * C, 2 * C + 1, 2 * C + 2, 2 * C + 3, 3 * C, 3 * C + 1, 3 * C + 2, 3 * C + 3), v);
+		}
+	};
+
+	#include "simd-kernels.hpp"
+}
+
+#pragma GCC diagnostic pop
+#pragma GCC pop_options
+
+
+// widest ISA this CPU supports
+ISA supportedISA() {
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")) return ISA::AVX512;
+	if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") && __builtin_cpu_supports("f16c")) return ISA::AVX;
+	if (__builtin_cpu_supports("sse4.1")) return ISA::SSE;
+	return ISA::Scalar;
+}
+
+ISA& selectedISA() {
+	static ISA isa = [] {
+		ISA isa = supportedISA();
+
+		const char* env = std::getenv("KMEANS_ISA");
+		if (env) {
+			for (ISA requested : { ISA::Scalar, ISA::SSE, ISA::AVX, ISA::AVX512 }) {
+				if (std::strcmp(env, isaName(requested)) == 0) isa = std::min(isa, requested);
+			}
+		}
+
+		return isa;
+	}();
+
+	return isa;
+}
+
+// ISA used by all the kernels
+ISA currentISA() {
+	return selectedISA();
+}
+
+// forces an ISA (clamped to what the CPU supports), mostly for benchmarks and for comparing the results of each width
+void setISA(ISA isa) {
+	selectedISA() = std::min(isa, supportedISA());
+}
+
+// ISA to use with k centroids: lanes past k are wasted, so small K is done with narrower vectors
+ISA isaFor(int k) {
+	if (k <= 4) return std::min(currentISA(), ISA::SSE);
+	if (k <= 8) return std::min(currentISA(), ISA::AVX);
+	return currentISA();
+}
+
+
+// dimensions that get their own copy of the kernels, with every loop over dimensions unrolled at compile time: colors
+// (RGB, and RGBA or Lab + alpha), which is what this is mostly used for. Anything else uses the generic kernels
+template <int FixedD>
+using Dim = std::integral_constant<int, FixedD>;
+
+// calls f(Dim<D>()) if D is one of the dimensions above, f(Dim<0>()) otherwise. f can use its argument as a template
+// argument (FixedD), where 0 means "D is only known at runtime"
+template <class F>
+auto dispatchDim(int D, F&& f) {
+	switch (D) {
+		case 3: return f(Dim<3>());
+		case 4: return f(Dim<4>());
+		default: return f(Dim<0>());
+	}
+}
+
+
+// k centroids packed in groups of W = lanes(isa): group g holds one vector per dimension, packed[(g * D + d) * W + lane].
+// The number of groups is (k + W - 1) / W, and the padding is filled with infs so they are never closest to any point.
+// centroids are permuted in such a way that index1 < index2 <=> permutedIndex1 % W < permutedIndex2 % W (see closestCentroid)
+struct PackedCentroids {
+
+	ISA isa = ISA::Scalar;
+	int k = 0, D = 0, groups = 0;
+	AlignedBuffer<float> packed;
+
+	PackedCentroids() = default;
+
+	PackedCentroids(const float* centroids, int k, int D, size_t stride, ISA isa) : isa(isa), k(k), D(D) {
+
+		const int W = lanes(isa);
+		groups = (k + W - 1) / W;
+		packed = AlignedBuffer<float>((size_t) groups * D * W);
+
+		for (size_t i = 0; i < packed.size(); ++i) packed[i] = std::numeric_limits<float>::infinity();
+
+		for (int j = 0; j < k; ++j) {
+			int g = j % groups;
+			int lane = j / groups;
+
+			for (int d = 0; d < D; ++d) {
+				packed[((size_t) g * D + d) * W + lane] = centroids[j * stride + d];
+			}
+		}
+	}
+
+	PackedCentroids(const Dataset& centroids) : PackedCentroids(centroids.data(), centroids.size(), centroids.dim(), centroids.stride, isaFor(centroids.size())) {}
+
+	// index of the closest centroid to point (smallest index on ties). If minDst is not null, the squared distance is written there
+	int closest(const float* point, float* minDst = nullptr) const {
+		return dispatchDim(D, [&](auto fixedD) {
+			switch (isa) {
+				case ISA::AVX512: return simd_avx512::closest<fixedD>(point, packed.data(), groups, D, minDst);
+				case ISA::AVX: return simd_avx::closest<fixedD>(point, packed.data(), groups, D, minDst);
+				case ISA::SSE: return simd_sse::closest<fixedD>(point, packed.data(), groups, D, minDst);
+				default: return simd_scalar::closest<fixedD>(point, packed.data(), groups, D, minDst);
+			}
+		});
+	}
+
+	// closest centroid and the squared distances to the closest and second closest
+	int closestTwo(const float* point, float& minDst, float& secondMinDst) const {
+		return dispatchDim(D, [&](auto fixedD) {
+			switch (isa) {
+				case ISA::AVX512: return simd_avx512::closestTwo<fixedD>(point, packed.data(), groups, D, minDst, secondMinDst);
+				case ISA::AVX: return simd_avx::closestTwo<fixedD>(point, packed.data(), groups, D, minDst, secondMinDst);
+				case ISA::SSE: return simd_sse::closestTwo<fixedD>(point, packed.data(), groups, D, minDst, secondMinDst);
+				default: return simd_scalar::closestTwo<fixedD>(point, packed.data(), groups, D, minDst, secondMinDst);
+			}
+		});
+	}
+
+	// closest centroid of every point in [begin, end), written to labels[0, end - begin) (and the squared distances to minDst
+	// if it's not null). Cheaper than calling closest for each point when K is small
+	void closest(const DatasetView& points, int begin, int end, int* labels, float* minDst = nullptr) const {
+		dispatchDim(D, [&](auto fixedD) {
+			switch (isa) {
+				case ISA::AVX512: simd_avx512::closestBatch<fixedD>(points, begin, end, packed.data(), groups, labels, minDst); break;
+				case ISA::AVX: simd_avx::closestBatch<fixedD>(points, begin, end, packed.data(), groups, labels, minDst); break;
+				case ISA::SSE: simd_sse::closestBatch<fixedD>(points, begin, end, packed.data(), groups, labels, minDst); break;
+				default: simd_scalar::closestBatch<fixedD>(points, begin, end, packed.data(), groups, labels, minDst); break;
+			}
+		});
+	}
+};
+
+
+// distances[i] = min(distances[i], squared distance of point i to centroid), for numBlocks blocks of an AoSoA copy of the
+// points with lanes(isa) lanes
+void updateMinDistances(ISA isa, const float* blocks, int numBlocks, int D, const float* centroid, float* distances) {
+	dispatchDim(D, [&](auto fixedD) {
+		switch (isa) {
+			case ISA::AVX512: simd_avx512::updateMinDistances<fixedD>(blocks, numBlocks, D, centroid, distances); break;
+			case ISA::AVX: simd_avx::updateMinDistances<fixedD>(blocks, numBlocks, D, centroid, distances); break;
+			case ISA::SSE: simd_sse::updateMinDistances<fixedD>(blocks, numBlocks, D, centroid, distances); break;
+			default: simd_scalar::updateMinDistances<fixedD>(blocks, numBlocks, D, centroid, distances); break;
+		}
+	});
+}
+
+
+// dots[r * groups * lanes(isa) + g * lanes(isa) + lane] = rows[r] . (centroid in that lane of group g), see dotProducts in
+// simd-kernels.hpp. numRows must be a multiple of 4
+void dotProducts(ISA isa, const float* const* rows, int numRows, const float* packed, int groups, int D, float* dots) {
+	switch (isa) {
+		case ISA::AVX512: simd_avx512::dotProducts(rows, numRows, packed, groups, D, dots); break;
+		case ISA::AVX: simd_avx::dotProducts(rows, numRows, packed, groups, D, dots); break;
+		case ISA::SSE: simd_sse::dotProducts(rows, numRows, packed, groups, D, dots); break;
+		default: simd_scalar::dotProducts(rows, numRows, packed, groups, D, dots); break;
+	}
+}
+
+// n float16 or bfloat16 to floats (see HalfView in half-k-means.hpp)
+void halfToFloats(ISA isa, HalfFormat format, const uint16_t* in, size_t n, float* out) {
+	switch (isa) {
+		case ISA::AVX512: simd_avx512::halfToFloats(format, in, n, out); break;
+		case ISA::AVX: simd_avx::halfToFloats(format, in, n, out); break;
+		case ISA::SSE: simd_sse::halfToFloats(format, in, n, out); break;
+		default: simd_scalar::halfToFloats(format, in, n, out); break;
+	}
+}
+
+// labels of count pixels with C = 1 ~ 4 channels against k centroids rounded by PackedPixelCentroids, -1 where the float
+// distances are needed (see closestPixelsBatch in simd-kernels.hpp)
+void closestPixels(ISA isa, int C, const unsigned char* pixels, int count, const int32_t* pairs, const int32_t* norms, int k, int32_t slack, int* labels) {
+	auto run = [&](auto channels) {
+		switch (isa) {
+			case ISA::AVX512: simd_avx512::closestPixels<channels>(pixels, count, pairs, norms, k, slack, labels); break;
+			case ISA::AVX: simd_avx::closestPixels<channels>(pixels, count, pairs, norms, k, slack, labels); break;
+			case ISA::SSE: simd_sse::closestPixels<channels>(pixels, count, pairs, norms, k, slack, labels); break;
+			default: simd_scalar::closestPixels<channels>(pixels, count, pairs, norms, k, slack, labels); break;
+		}
+	};
+
+	switch (C) {
+		case 1: run(Dim<1>()); break;
+		case 2: run(Dim<2>()); break;
+		case 3: run(Dim<3>()); break;
+		default: run(Dim<4>()); break;
+	}
+}
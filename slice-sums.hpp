@@ -0,0 +1,244 @@
+#pragma once
+
+#include "dataset.hpp"
+#include "communicator.hpp"
+#include <algorithm>
+#include <vector>
+#include <omp.h>
+
+
+// per-cluster sums for the parallel iterators. Instead of one set of sums per thread, merged one thread at a time in an
+// omp critical (in whatever order threads get there), the points are split into a fixed number of slices, each summed
+// into its own buffer by whichever thread takes it (dynamic scheduling, so a thread on a faster or less busy core just
+// takes more slices), and the buffers are then added pairwise in a fixed tree order, every level in parallel.
+//
+// the number of slices depends on N, K and D only, never on the number of threads, so every float addition happens in
+// the same order on every run: the centroids are the same run to run and with any number of threads.
+//
+// buffers are kept between iterations (no allocation once they're big enough), each one starts on its own cache line so
+// threads never write to the same line, and each is zeroed by the thread that fills it.
+//
+// T is float for every iterator but the pixel ones, which sum 8 bit channels into int64_t (see pixel-k-means.hpp).
+//
+// points split between processes (see distributed-k-means.hpp) are sliced as if they were all in one place (see
+// SliceLayout): each process sums its own slices and adds them up as far as the tree goes without slices of other
+// processes, and only those partial sums are exchanged. Every process then finishes the tree the same way, so the sums
+// are added in exactly the same order as if a single process had every point.
+
+
+constexpr int SLICE_MIN_POINTS = 2048; // smallest slice worth the extra buffer
+constexpr int MAX_SLICES = 256;
+constexpr size_t SLICE_MAX_BYTES = size_t(32) << 20; // for all buffers together (big K * D gets fewer slices)
+
+// values per slice for k clusters in D dimensions: k * D sums, then k counts, rounded up to a cache line
+inline size_t sliceStride(int k, int D, size_t valueBytes) {
+	return roundUp((size_t) k * (D + 1), DATASET_ALIGNMENT / valueBytes);
+}
+
+inline int sliceCount(int N, int k, int D, size_t valueBytes, bool parallel) {
+	int byMemory = std::max<size_t>(1, SLICE_MAX_BYTES / (sliceStride(k, D, valueBytes) * valueBytes));
+	return parallel ? std::max(1, std::min({ (N + SLICE_MIN_POINTS - 1) / SLICE_MIN_POINTS, MAX_SLICES, byMemory })) : 1;
+}
+
+
+// slices of a dataset split between the ranks of a Communicator: slice s is points [bounds[s], bounds[s + 1]) of the
+// whole dataset (sliced like a parallel float iterator would slice it), and rank r has slices [first[r], first[r + 1]),
+// so its points are [bounds[first[r]], bounds[first[r + 1]])
+struct SliceLayout {
+
+	std::vector<int> bounds;
+	std::vector<int> first;
+	Communicator* comm = nullptr;
+
+	SliceLayout() = default;
+
+	SliceLayout(int totalN, int k, int D, Communicator& communicator) : comm(&communicator) {
+		const int numSlices = sliceCount(totalN, k, D, sizeof(float), true);
+		const int ranks = comm->size();
+
+		bounds.resize(numSlices + 1);
+		for (int s = 0; s <= numSlices; ++s) bounds[s] = (long long) totalN * s / numSlices;
+
+		first.resize(ranks + 1);
+		for (int r = 0; r <= ranks; ++r) first[r] = (long long) numSlices * r / ranks;
+	}
+
+	int numSlices() const { return bounds.size() - 1; }
+	int rank() const { return comm->rank(); }
+
+	int pointsBegin(int r) const { return bounds[first[r]]; }
+	int pointsEnd(int r) const { return bounds[first[r + 1]]; }
+
+	// rank that has slice s
+	int rankOf(int s) const {
+		return std::upper_bound(first.begin(), first.end(), s) - first.begin() - 1;
+	}
+
+	// rank that has point i of the whole dataset
+	int rankOfPoint(int i) const {
+		return rankOf(std::upper_bound(bounds.begin(), bounds.end(), i) - bounds.begin() - 1);
+	}
+
+	// whether slices [a, b) all belong to the same rank
+	bool sameRank(int a, int b) const {
+		return b <= first[rankOf(a) + 1];
+	}
+
+	// the partial sums rank r ends up with: the slices where the tree of reduce stops adding slices of rank r only
+	// (biggest aligned blocks of its slices, like a segment tree). Each one is the sum of the slices up to the next one
+	std::vector<int> blocks(int r) const {
+		const int total = numSlices();
+
+		std::vector<int> starts;
+		for (int s = first[r]; s < first[r + 1];) {
+			int size = 1;
+			while (s % (2 * size) == 0 && size < total && std::min(s + 2 * size, total) <= first[r + 1]) size *= 2;
+
+			starts.push_back(s);
+			s = std::min(s + size, total);
+		}
+
+		return starts;
+	}
+};
+
+
+template <typename T>
+struct SliceSumsOf {
+
+	int N = 0, k = 0, D = 0;
+	int numSlices = 0;
+	size_t stride = 0; // values per slice: k * D sums, then k counts, rounded up to a cache line
+
+	// set when the points are this rank's part of a dataset split between processes (not owned)
+	const SliceLayout* layout = nullptr;
+	int firstSlice = 0; // global index of slice 0 (only with a layout)
+
+	AlignedBuffer<T> buffer;
+
+	// with parallel = false there's a single slice, so the sums are added in the same order as the serial iterators.
+	// With a layout the slices are always the layout's (parallel only decides if threads are used)
+	void prepare(int numPoints, int numClusters, int dim, bool parallel) {
+
+		N = numPoints;
+		k = numClusters;
+		D = dim;
+		stride = sliceStride(k, D, sizeof(T));
+
+		if (layout) {
+			const int r = layout->rank();
+			assert(N == layout->pointsEnd(r) - layout->pointsBegin(r));
+
+			firstSlice = layout->first[r];
+			numSlices = layout->first[r + 1] - firstSlice;
+		} else {
+			firstSlice = 0;
+			numSlices = sliceCount(N, k, D, sizeof(T), parallel);
+		}
+
+		// at least one, the total ends up in slice 0
+		const size_t size = std::max(numSlices, 1) * stride;
+		if (buffer.size() < size) buffer = AlignedBuffer<T>(size);
+	}
+
+	int begin(int s) const {
+		if (layout) return layout->bounds[firstSlice + s] - layout->bounds[firstSlice];
+		return (long long) N * s / numSlices;
+	}
+	int end(int s) const { return begin(s + 1); }
+
+	// sums[c * D + d] is the weighted sum of dimension d of the points of slice s in cluster c
+	T* sums(int s) { return &buffer[s * stride]; }
+	T* counts(int s) { return &buffer[s * stride + (size_t) k * D]; }
+
+	void clear(int s) {
+		std::fill(sums(s), sums(s) + (size_t) k * (D + 1), T(0));
+	}
+
+	// adds every slice into slice 0: slice s += slice s + step for step = 1, 2, 4... Called by every thread of a parallel
+	// region (or outside of one, serially); every level is split between threads and ends with a barrier.
+	//
+	// with a layout, slices are numbered like in the whole dataset and only the additions between slices of this rank
+	// are done here, then every rank gets the total in slice 0 from exchange
+	void reduce() {
+
+		const size_t length = (size_t) k * (D + 1);
+		const size_t CHUNK = 4096; // values added by one task
+		const long chunks = (length + CHUNK - 1) / CHUNK;
+
+		const int total = layout ? layout->numSlices() : numSlices;
+		const int last = firstSlice + numSlices;
+
+		for (int step = 1; step < total; step *= 2) {
+
+			// the first pair of this level that is in this rank, and how many there are
+			const int firstPair = (firstSlice + 2 * step - 1) / (2 * step) * (2 * step);
+			long pairs = 0;
+			while (firstPair + pairs * 2 * step + step < total && std::min<long>(firstPair + (pairs + 1) * 2 * step, total) <= last) ++pairs;
+
+			#pragma omp for schedule(static)
+			for (long t = 0; t < pairs * chunks; ++t) {
+				T* dst = sums(firstPair - firstSlice + (t / chunks) * 2 * step);
+				const T* src = dst + step * stride;
+
+				const size_t from = (t % chunks) * CHUNK, to = std::min(length, from + CHUNK);
+				for (size_t f = from; f < to; ++f) dst[f] += src[f];
+			}
+		}
+
+		if (layout) {
+			#pragma omp single
+			exchange();
+		}
+	}
+
+	// every rank sends the partial sums it ended up with (see SliceLayout::blocks) and does the rest of the tree with
+	// everyone's, in the same order reduce would have added them with every slice here
+	void exchange() {
+
+		const size_t length = (size_t) k * (D + 1);
+		const int ranks = layout->comm->size();
+		const int me = layout->rank();
+		const int total = layout->numSlices();
+
+		std::vector<T*> nodes(total, nullptr);
+		std::vector<size_t> bytes(ranks);
+		std::vector<std::vector<int>> blocks(ranks);
+
+		size_t count = 0;
+		for (int r = 0; r < ranks; ++r) {
+			blocks[r] = layout->blocks(r);
+			bytes[r] = blocks[r].size() * length * sizeof(T);
+			count += blocks[r].size();
+		}
+
+		std::vector<T> send(blocks[me].size() * length), recv(count * length);
+		for (size_t b = 0; b < blocks[me].size(); ++b) {
+			std::copy(sums(blocks[me][b] - firstSlice), sums(blocks[me][b] - firstSlice) + length, &send[b * length]);
+		}
+
+		layout->comm->allgather(send.data(), recv.data(), bytes);
+
+		T* node = recv.data();
+		for (int r = 0; r < ranks; ++r) {
+			for (int s : blocks[r]) {
+				nodes[s] = node;
+				node += length;
+			}
+		}
+
+		for (int step = 1; step < total; step *= 2) {
+			for (int s = 0; s + step < total; s += 2 * step) {
+				if (layout->sameRank(s, std::min(s + 2 * step, total))) continue; // done by that rank
+
+				T* dst = nodes[s];
+				const T* src = nodes[s + step];
+				for (size_t f = 0; f < length; ++f) dst[f] += src[f];
+			}
+		}
+
+		std::copy(nodes[0], nodes[0] + length, sums(0));
+	}
+};
+
+using SliceSums = SliceSumsOf<float>;
@@ -0,0 +1,182 @@
+#pragma once
+
+#include "k-means-iteration.hpp"
+#include "slice-sums.hpp"
+#include "simd.hpp"
+#include <omp.h>
+#include <cmath>
+#include <algorithm>
+
+
+// spherical k-means, for embeddings compared by cosine similarity (text and image embeddings, usually normalized).
+// Centroids are unit vectors and every point goes to the centroid with the largest dot product, which for a unit point
+// is the same as the smallest Euclidean distance, without the subtractions or any norm. The dot products of a block of
+// points with every centroid are the blocked kernel of GemmLloydIteration (dotProducts in simd-kernels.hpp), and the
+// largest one of each point is picked in index order (smallest index on ties).
+//
+// the update makes every centroid the normalized sum of its points, also normalized (each scaled by weight / ||x||),
+// which maximizes the sum of the cosine similarities, so centroids never drift off the sphere like means do. Points
+// don't have to be normalized: the scale of a point doesn't change which centroid it's closest to in angle, and its
+// norm is divided out of the sums. The centroids given to the first iteration don't need to be normalized either (they
+// usually are seeded from the points), they're normalized before the assignment.
+//
+// labels are the same with any number of threads, and KMeans::predict gives the same ones for normalized points
+// (||x - c||^2 = 2 - 2 x.c), except for ties between dot products that only differ in the last bits.
+
+struct SphericalIterationBase : LloydIteration {
+
+	// points per block (multiple of 4, the rows of a tile)
+	static constexpr int BLOCK = 64;
+
+	const int D;
+
+	// weight(i) / ||x_i|| (0 for points at the origin), what every point is added to the sums with
+	std::vector<float> scale;
+
+	SliceSums slices;
+
+	SphericalIterationBase(const DatasetView& pts, const float* weights = nullptr) : LloydIteration(pts, weights), D(pts.dim()), scale(N) {
+
+		#pragma omp parallel for
+		for (int i = 0; i < N; ++i) {
+			float norm = 0.0f;
+			for (int d = 0; d < D; ++d) norm += points[i][d] * points[i][d];
+
+			scale[i] = norm > 0.0f ? weight(i) / std::sqrt(norm) : 0.0f;
+		}
+	}
+
+	// x / ||x||, or x itself if it's 0
+	static void normalize(const float* x, float* out, int D) {
+		double norm = 0.0;
+		for (int d = 0; d < D; ++d) norm += (double) x[d] * x[d];
+
+		const double inv = norm > 0.0 ? 1.0 / std::sqrt(norm) : 1.0;
+		for (int d = 0; d < D; ++d) out[d] = x[d] * inv;
+	}
+
+	bool sphericalIterate(Dataset& centroids, bool parallel) {
+
+		const int k = centroids.size();
+
+		Dataset unit(k, D);
+		for (int j = 0; j < k; ++j) normalize(centroids[j], unit[j], D);
+
+		// always the widest vectors, like GemmLloydIteration. position[j] is where the dot product with centroid j ends up
+		// (see PackedCentroids), the padding is never looked at
+		PackedCentroids packed(unit.data(), k, D, unit.stride, currentISA());
+		const int W = lanes(packed.isa);
+		const int ld = packed.groups * W;
+
+		std::vector<int> position(k);
+		for (int j = 0; j < k; ++j) position[j] = (j % packed.groups) * W + j / packed.groups;
+
+		// kept between iterations (see slice-sums.hpp)
+		slices.prepare(N, k, D, parallel);
+
+		int* labels = trackedLabels();
+		long long changed = 0;
+
+		const auto start = InstrumentClock::now();
+		auto assigned = start;
+
+		#pragma omp parallel if (parallel)
+		{
+
+			AlignedBuffer<float> dots((size_t) BLOCK * ld);
+			const float* rows[BLOCK];
+
+			#pragma omp for schedule(dynamic, 1) reduction(+ : changed)
+			for (int slice = 0; slice < slices.numSlices; ++slice) {
+
+				slices.clear(slice);
+				float* sums = slices.sums(slice);
+				float* counts = slices.counts(slice);
+				const int first = slices.begin(slice), last = slices.end(slice);
+
+				for (int begin = first; begin < last; begin += BLOCK) {
+
+					int end = std::min(begin + BLOCK, last);
+
+					// the last block is padded to a multiple of 4 rows by repeating its last point
+					int numRows = roundUp(end - begin, 4);
+					for (int r = 0; r < numRows; ++r) rows[r] = points[std::min(begin + r, end - 1)];
+
+					dotProducts(packed.isa, rows, numRows, packed.packed.data(), packed.groups, D, dots.data());
+
+					for (int i = begin; i < end; ++i) {
+						const float* dot = &dots[(size_t) (i - begin) * ld];
+
+						int centroidIndex = 0;
+						float best = dot[position[0]];
+						for (int j = 1; j < k; ++j) {
+							if (dot[position[j]] > best) {
+								best = dot[position[j]];
+								centroidIndex = j;
+							}
+						}
+
+						if (labels) {
+							changed += labels[i] != centroidIndex;
+							labels[i] = centroidIndex;
+						}
+
+						// the weight counts for empty clusters, the sums only need the direction
+						const float s = scale[i];
+						counts[centroidIndex] += weight(i);
+						for (int d = 0; d < D; ++d) {
+							sums[centroidIndex * D + d] += s * points[i][d];
+						}
+					}
+				}
+			}
+
+			#pragma omp master
+			assigned = InstrumentClock::now();
+
+			// add up the sums of all slices
+			slices.reduce();
+		}
+
+		recordPhases(start, assigned, InstrumentClock::now());
+		stats.distances = (long long) N * k; // the dot products
+		if (labels) stats.changed = changed;
+
+		// the new centroids are given to updateCentroids with a count of 1. A cluster whose points add up to 0 keeps its
+		// (normalized) centroid
+		const float* sums = slices.sums(0);
+		const float* counts = slices.counts(0);
+
+		Dataset directions(k, D, 0.0f);
+		std::vector<float> nonEmpty(k, 0.0f);
+
+		for (int j = 0; j < k; ++j) {
+			if (!counts[j]) continue;
+
+			nonEmpty[j] = 1.0f;
+			normalize(&sums[(size_t) j * D], directions[j], D);
+			if (std::all_of(directions[j], directions[j] + D, [](float x) { return x == 0.0f; })) std::copy(unit[j], unit[j] + D, directions[j]);
+		}
+
+		return updateCentroids(centroids, directions, nonEmpty);
+	}
+};
+
+
+struct SphericalLloydIteration : SphericalIterationBase {
+
+	SphericalLloydIteration(const DatasetView& pts, const float* weights = nullptr) : SphericalIterationBase(pts, weights) {}
+
+	bool iterate(Dataset& centroids) override {
+		return sphericalIterate(centroids, false);
+	}
+};
+
+struct ParallelSphericalLloydIteration : SphericalIterationBase {
+
+	ParallelSphericalLloydIteration(const DatasetView& pts, const float* weights = nullptr) : SphericalIterationBase(pts, weights) {}
+
+	bool iterate(Dataset& centroids) override {
+		return sphericalIterate(centroids, true);
+	}
+};
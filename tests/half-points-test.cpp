@@ -0,0 +1,111 @@
+#include <iostream>
+#include <random>
+
+#include "half-k-means.hpp"
+#include "parallel-SIMD-k-means.hpp"
+
+using namespace std;
+
+
+// checks HalfView::toFloats and the half iterators on every ISA this machine has. D isn't a multiple of 16 and blocks
+// start anywhere in the buffer, so a conversion that reads past the last point shows up here (and under ASan).
+// Exits with 1 if anything is off
+
+
+int failures = 0;
+
+void check(bool ok, const string& what) {
+    if (!ok) {
+        cerr << "FAILED: " << what << "\n";
+        failures++;
+    }
+}
+
+
+Dataset randomPoints(int N, int D, unsigned seed) {
+    mt19937 gen(seed);
+    normal_distribution<float> dist(0.0f, 1.0f);
+
+    Dataset points(N, D);
+    for (int i = 0; i < N; ++i) {
+        for (int d = 0; d < D; ++d) points[i][d] = dist(gen);
+    }
+
+    return points;
+}
+
+
+void testConversion(const HalfView& half, const string& name) {
+
+    // every block start, including ones that aren't a multiple of 16 values into the buffer, and the last point alone
+    vector<float> out((size_t) half.size() * half.dim());
+    for (int begin : { 0, 1, 3, half.size() / 2 + 1, half.size() - 1 }) {
+
+        const DatasetView converted = half.toFloats(begin, half.size(), out.data());
+
+        bool same = converted.size() == half.size() - begin;
+        for (int i = begin; i < half.size() && same; ++i) {
+            for (int d = 0; d < half.dim(); ++d) same = same && converted[i - begin][d] == half.value(i, d);
+        }
+
+        check(same, name + " toFloats from point " + to_string(begin));
+    }
+}
+
+
+template <typename HalfIterator>
+void testFit(const HalfPoints& points, const string& name) {
+
+    const int k = 7, iterations = 4;
+    const Dataset floats = points.toDataset();
+
+    Dataset expected(k, points.D), centroids(k, points.D);
+    for (int j = 0; j < k; ++j) {
+        for (int d = 0; d < points.D; ++d) expected[j][d] = centroids[j][d] = floats[j * 13][d];
+    }
+
+    ParallelSIMDLloydIteration reference(floats);
+    HalfIterator half(points.view());
+
+    for (int it = 0; it < iterations; ++it) {
+        reference.iterate(expected);
+        half.iterate(centroids);
+    }
+
+    bool same = true;
+    for (int j = 0; j < k; ++j) {
+        for (int d = 0; d < points.D; ++d) same = same && expected[j][d] == centroids[j][d];
+    }
+
+    check(same, name + " centroids match ParallelSIMDLloydIteration");
+}
+
+
+int main() {
+
+    const ISA supported = supportedISA();
+    const char* isaNames[] = { "scalar", "sse", "avx", "avx512" };
+
+    // 228 * 18 isn't a multiple of 16 and neither is 227 * 18, where the last point starts. 300 is over one block per point
+    for (int D : { 18, 300 }) {
+        const Dataset points = randomPoints(228, D, D);
+
+        for (HalfFormat format : { HalfFormat::Float16, HalfFormat::BFloat16 }) {
+            const HalfPoints half(points, format);
+
+            for (int isa = 0; isa <= (int) supported; ++isa) {
+                setISA((ISA) isa);
+
+                const string name = string(isaNames[isa]) + (format == HalfFormat::Float16 ? " float16" : " bfloat16") + " D = " + to_string(D);
+                testConversion(half.view(), name);
+                testFit<HalfLloydIteration>(half, name + " HalfLloydIteration");
+                testFit<ParallelHalfLloydIteration>(half, name + " ParallelHalfLloydIteration");
+            }
+        }
+    }
+
+    if (failures) return 1;
+
+    cout << "all half point tests passed\n";
+    return 0;
+}
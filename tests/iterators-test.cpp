@@ -0,0 +1,300 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <random>
+#include <cstring>
+#include <cmath>
+#include <type_traits>
+#include <omp.h>
+
+#include "k-means.hpp"
+#include "SIMD-k-means.hpp"
+#include "parallel-k-means.hpp"
+#include "parallel-SIMD-k-means.hpp"
+#include "hamerly-k-means.hpp"
+#include "elkan-k-means.hpp"
+#include "gemm-k-means.hpp"
+#include "multi-k-means.hpp"
+#include "distributed-k-means.hpp"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+
+// checks the claims the iterators make about each other, bit for bit:
+//  - SIMDLloydIteration gives the labels and centroids of BasicLloydIteration on every ISA, and the parallel iterators
+//    the labels of BasicLloydIteration from the same centroids
+//  - every parallel iterator that adds its sums with SliceSums (Lloyd, Hamerly, Elkan and its Hamerly fallback, Gemm)
+//    goes through the same centroids as ParallelSIMDLloydIteration, with 1 thread or several, and the serial Hamerly and
+//    Elkan (a single slice) through the ones of BasicLloydIteration
+//  - seeding adds up the same total and picks the same centroids with any number of threads
+//  - MultiKMeans and DistributedKMeans end with the centroids of fitting each model by itself in one process
+// exits with 1 if anything is off
+
+
+const int K = 10;
+const int THREADS = 4; // more than the cores of the machine is fine, it only has to split the work differently
+
+int failures = 0;
+
+void check(bool ok, const string& what) {
+    if (!ok) {
+        cerr << "FAILED: " << what << "\n";
+        failures++;
+    }
+}
+
+
+// K blobs
+Dataset randomPoints(int N, int D, unsigned seed) {
+    mt19937 gen(seed);
+    normal_distribution<float> dist(0.0f, 1.0f);
+    uniform_real_distribution<float> center(-10.0f, 10.0f);
+
+    Dataset centers(K, D);
+    for (int j = 0; j < K; ++j) {
+        for (int d = 0; d < D; ++d) centers[j][d] = center(gen);
+    }
+
+    Dataset points(N, D);
+    for (int i = 0; i < N; ++i) {
+        for (int d = 0; d < D; ++d) points[i][d] = centers[i % K][d] + 2.0f * dist(gen);
+    }
+
+    return points;
+}
+
+bool same(const Dataset& a, const Dataset& b) {
+    if (a.size() != b.size() || a.dim() != b.dim()) return false;
+
+    for (int j = 0; j < a.size(); ++j) {
+        if (memcmp(a[j], b[j], a.dim() * sizeof(float)) != 0) return false;
+    }
+
+    return true;
+}
+
+bool same(const vector<Dataset>& a, const vector<Dataset>& b) {
+    if (a.size() != b.size()) return false;
+
+    for (size_t i = 0; i < a.size(); ++i) {
+        if (!same(a[i], b[i])) return false;
+    }
+
+    return true;
+}
+
+
+// the centroids after every iteration, until they stop moving (or 500 iterations, like fit)
+template <class Iterator, typename... Args>
+vector<Dataset> trajectory(const Dataset& points, const Dataset& start, int threads, Args... args) {
+    omp_set_num_threads(threads);
+
+    Iterator iterator(points, nullptr, args...);
+    Dataset centroids = start;
+
+    vector<Dataset> steps;
+    for (int it = 0; it < 500; ++it) {
+        bool converged = iterator.iterate(centroids);
+        steps.push_back(centroids);
+        if (converged) break;
+    }
+
+    return steps;
+}
+
+// labels of one iteration from the given centroids
+template <class Iterator>
+vector<int> labelsFrom(const Dataset& points, const Dataset& centroids) {
+    Iterator iterator(points);
+    iterator.trackChanges = true;
+
+    Dataset moved = centroids;
+    iterator.iterate(moved);
+
+    return iterator.lastLabels;
+}
+
+
+void testISAs(const Dataset& points, const Dataset& start, const string& name) {
+
+    const char* isaNames[] = { "scalar", "sse", "avx", "avx512" };
+    const vector<Dataset> basic = trajectory<BasicLloydIteration>(points, start, 1);
+
+    for (int isa = 0; isa <= (int) supportedISA(); ++isa) {
+        setISA((ISA) isa);
+        const string where = name + " " + isaNames[isa];
+
+        check(same(trajectory<SIMDLloydIteration>(points, start, 1), basic), where + ": SIMDLloydIteration centroids match BasicLloydIteration");
+
+        // the parallel sums are added in another order, so their centroids drift apart in the last bits from Basic's,
+        // but from the same centroids the labels are the same
+        omp_set_num_threads(THREADS);
+        bool labels = true;
+        for (const Dataset& centroids : trajectory<ParallelSIMDLloydIteration>(points, start, THREADS)) {
+            const vector<int> expected = labelsFrom<BasicLloydIteration>(points, centroids);
+            labels = labels && labelsFrom<ParallelSIMDLloydIteration>(points, centroids) == expected;
+            labels = labels && labelsFrom<ParallelLloydIteration>(points, centroids) == expected;
+        }
+        check(labels, where + ": parallel labels match BasicLloydIteration");
+    }
+
+    setISA(supportedISA());
+}
+
+
+template <class Iterator, typename... Args>
+void testSame(const Dataset& points, const Dataset& start, const vector<Dataset>& expected, const string& name, Args... args) {
+    check(same(trajectory<Iterator>(points, start, 1, args...), expected), name + " with 1 thread");
+    check(same(trajectory<Iterator>(points, start, THREADS, args...), expected), name + " with " + to_string(THREADS) + " threads");
+}
+
+void testThreads(const Dataset& points, const Dataset& start, const string& name) {
+
+    const vector<Dataset> parallel = trajectory<ParallelSIMDLloydIteration>(points, start, 1);
+    const string matchParallel = " matches ParallelSIMDLloydIteration";
+
+    testSame<ParallelSIMDLloydIteration>(points, start, parallel, name + " ParallelSIMDLloydIteration" + matchParallel);
+    testSame<ParallelLloydIteration>(points, start, parallel, name + " ParallelLloydIteration" + matchParallel);
+    testSame<ParallelHamerlyLloydIteration>(points, start, parallel, name + " ParallelHamerlyLloydIteration" + matchParallel);
+    testSame<ParallelSIMDHamerlyLloydIteration>(points, start, parallel, name + " ParallelSIMDHamerlyLloydIteration" + matchParallel);
+    testSame<ParallelElkanLloydIteration<>>(points, start, parallel, name + " ParallelElkanLloydIteration" + matchParallel);
+    testSame<ParallelElkanLloydIteration<>>(points, start, parallel, name + " ParallelElkanLloydIteration (Hamerly fallback)" + matchParallel, size_t(1));
+    testSame<ParallelGemmLloydIteration>(points, start, parallel, name + " ParallelGemmLloydIteration" + matchParallel);
+
+    const vector<Dataset> basic = trajectory<BasicLloydIteration>(points, start, 1);
+    const string matchBasic = " matches BasicLloydIteration";
+
+    testSame<HamerlyLloydIteration>(points, start, basic, name + " HamerlyLloydIteration" + matchBasic);
+    testSame<SIMDHamerlyLloydIteration>(points, start, basic, name + " SIMDHamerlyLloydIteration" + matchBasic);
+    testSame<ElkanLloydIteration<>>(points, start, basic, name + " ElkanLloydIteration" + matchBasic);
+}
+
+
+void testSeeding(const Dataset& points, const string& name) {
+
+    // the bound of every draw, which the choices can only follow if it's the same to the last bit. The sums of chunks of
+    // points add up exactly in any order unless they span a lot of magnitudes, so every chunk here has its own scale
+    Dataset spread = points;
+    mt19937 scales(7);
+    uniform_real_distribution<float> exponent(-4.0f, 4.0f);
+    float scale = 1.0f;
+    for (int i = 0; i < spread.size(); ++i) {
+        if (i % MinDistances::CHUNK == 0) scale = pow(10.0f, exponent(scales));
+        for (int d = 0; d < spread.dim(); ++d) spread[i][d] *= scale;
+    }
+
+    auto total = [&](int threads) {
+        omp_set_num_threads(threads);
+        const vector<float> origin(spread.dim(), 0.0f);
+
+        MinDistances distances(spread);
+        distances.add(origin.data());
+        return distances.total;
+    };
+
+    check(total(1) == total(THREADS), name + " the k-means++ total is the same with any number of threads");
+
+    auto seed = [&](int threads, bool parallelSeeding) {
+        omp_set_num_threads(threads);
+        mt19937 gen(11);
+        return parallelSeeding ? kMeansParallel(points, K, gen) : kMeansPlusPlus(points, K, gen);
+    };
+
+    check(same(seed(1, false), seed(THREADS, false)), name + " k-means++ picks the same centroids with any number of threads");
+    check(same(seed(1, true), seed(THREADS, true)), name + " k-means|| picks the same centroids with any number of threads");
+}
+
+
+void testMulti(const Dataset& points, const string& name) {
+
+    MultiKMeans multi({ K, K + 3 }, 2, 5);
+    multi.initializeCentroids(points);
+
+    vector<Dataset> starts;
+    for (auto& m : multi.models) starts.push_back(m.centroids);
+
+    omp_set_num_threads(THREADS);
+    multi.fit();
+
+    for (size_t m = 0; m < starts.size(); ++m) {
+        const vector<Dataset> alone = trajectory<ParallelSIMDLloydIteration>(points, starts[m], THREADS);
+        check(same(multi.models[m].centroids, alone.back()), name + " MultiKMeans model " + to_string(m) + " matches ParallelSIMDLloydIteration");
+    }
+}
+
+
+#if defined(__unix__) || defined(__APPLE__)
+
+// every rank fits its shard and checks the centroids against KMeans on every point. Has to run before anything else
+// uses OpenMP: its threads don't survive a fork
+template <class Iterator, typename... Args>
+void testDistributed(const Dataset& points, int ranks, const string& name, Args... args) {
+
+    SharedMemoryGroup group(ranks);
+    check(group.isOpen(), "shared memory for " + name);
+    if (!group.isOpen()) return;
+
+    for (int r = 0; r < ranks; ++r) {
+        if (fork() == 0) {
+            SharedMemoryCommunicator comm(group, r);
+
+            DistributedKMeans distributed(comm, K, points.size(), points.dim(), 3);
+            distributed.initializeCentroids(points.view().slice(distributed.begin(), distributed.end()));
+            distributed.fit<Iterator>(100, args...);
+
+            KMeans single(K, 3);
+            single.initializeCentroids(points.view());
+            single.fit<Iterator>(100, args...);
+
+            _exit(same(distributed.centroids, single.centroids) ? 0 : 1);
+        }
+    }
+
+    bool ok = true;
+    for (int r = 0; r < ranks; ++r) {
+        int status;
+        wait(&status);
+        ok = ok && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    }
+
+    check(ok, name + " DistributedKMeans on " + to_string(ranks) + " ranks matches KMeans");
+}
+
+#endif
+
+
+int main() {
+
+    const Dataset distributedPoints = randomPoints(40000, 5, 1);
+
+#if defined(__unix__) || defined(__APPLE__)
+    testDistributed<ParallelSIMDLloydIteration>(distributedPoints, 3, "D = 5 ParallelSIMDLloydIteration");
+    testDistributed<ParallelElkanLloydIteration<>>(distributedPoints, 2, "D = 5 ParallelElkanLloydIteration (Hamerly fallback)", size_t(1));
+#endif
+
+    // D = 3 and 4 have their own kernels (see dispatchDim in simd.hpp)
+    for (int D : { 3, 4, 13 }) {
+        const Dataset points = randomPoints(30011, D, D);
+        const string name = "D = " + to_string(D);
+
+        // point i is in blob i % K, so this starts with two centroids in every other blob and none in the rest, and
+        // they have to move across for a while
+        Dataset start(K, D);
+        for (int j = 0; j < K; ++j) copy(points[2 * j], points[2 * j] + D, start[j]);
+
+        testISAs(points, start, name);
+        testThreads(points, start, name);
+        testSeeding(points, name);
+        testMulti(points, name);
+    }
+
+    if (failures) return 1;
+
+    cout << "all iterator tests passed\n";
+    return 0;
+}
@@ -0,0 +1,139 @@
+#pragma once
+
+#include "dataset.hpp"
+#include <vector>
+#include <cstring>
+#include <cmath>
+
+
+// an image has one point per pixel, but usually a lot less distinct colors (at most 2^24, and photos with big smooth
+// areas have way fewer), so every Lloyd iteration does the same work many times. collapseDuplicates keeps each
+// distinct point once, with its number of copies as weight, and every iterator takes the weights (see
+// LloydIteration::weights), so fitting the distinct points gives the same assignments as fitting all of them.
+//
+// with cellSize > 0, points are first snapped to a grid of that size and all points in the same cell become a single
+// point (their mean) with their total weight. This is not exact anymore, but the sum of the points of each cell is
+// kept, so centroids barely change, and it makes the number of points small no matter what the image is.
+
+struct WeightedPoints {
+
+	Dataset points;
+	std::vector<float> weights;
+
+	// index[i] = row of `points` that point i of the original dataset became, to map labels back to it
+	std::vector<int> index;
+
+	int size() const { return points.size(); }
+	DatasetView view() const { return points.view(); }
+};
+
+
+// hash of the bits of a row of D floats
+inline uint64_t hashRow(const float* row, int D) {
+	uint64_t h = 0x9E3779B97F4A7C15ull;
+	for (int d = 0; d < D; ++d) {
+		uint32_t bits;
+		std::memcpy(&bits, &row[d], sizeof(bits));
+		h = (h ^ bits) * 0xBF58476D1CE4E5B9ull;
+		h ^= h >> 29;
+	}
+
+	// colors are small integers, so most of the low bits of the floats are 0: mix everything into the low bits, which
+	// are the ones that pick the slot
+	h = (h ^ (h >> 32)) * 0x94D049BB133111EBull;
+	return h ^ (h >> 31);
+}
+
+
+// distinct points (in order of first appearance) and how many times each one appears. Points are compared bit by bit
+// in their cell when cellSize > 0, or as they are otherwise
+WeightedPoints collapseDuplicates(const DatasetView& points, float cellSize = 0.0f) {
+
+	const int N = points.size();
+	const int D = points.dim();
+
+	// what is compared: the points themselves, or the coordinates of their cell
+	Dataset cells;
+	DatasetView keys = points;
+	if (cellSize > 0.0f) {
+		cells = Dataset(N, D);
+		for (int i = 0; i < N; ++i) {
+			for (int d = 0; d < D; ++d) cells[i][d] = std::floor(points[i][d] / cellSize);
+		}
+		keys = cells.view();
+	}
+
+	// open addressing with linear probing, kept at most half full. It starts small and grows with the number of distinct
+	// points, so with few colors it stays in cache. Slots keep part of the hash, so points are only compared when it's
+	// the same (which almost always means it's the same point)
+	struct Slot {
+		uint32_t tag;
+		int id; // index of the distinct point, -1 if empty
+	};
+
+	std::vector<Slot> table(1024, { 0, -1 });
+	size_t mask = table.size() - 1;
+
+	WeightedPoints out;
+	out.index.resize(N);
+
+	std::vector<int> firstOf; // first point of every distinct key
+	std::vector<uint64_t> hashes; // and its hash
+	std::vector<double> weights;
+
+	auto grow = [&]() {
+		table.assign(2 * table.size(), { 0, -1 });
+		mask = table.size() - 1;
+
+		for (int j = 0; j < (int) hashes.size(); ++j) {
+			size_t slot = hashes[j] & mask;
+			while (table[slot].id != -1) slot = (slot + 1) & mask;
+			table[slot] = { (uint32_t) (hashes[j] >> 32), j };
+		}
+	};
+
+	for (int i = 0; i < N; ++i) {
+		const uint64_t hash = hashRow(keys[i], D);
+		const uint32_t tag = hash >> 32;
+		size_t slot = hash & mask;
+
+		while (table[slot].id != -1) {
+			if (table[slot].tag == tag && std::memcmp(keys[firstOf[table[slot].id]], keys[i], D * sizeof(float)) == 0) break;
+			slot = (slot + 1) & mask;
+		}
+
+		int id = table[slot].id;
+
+		if (id == -1) {
+			id = firstOf.size();
+			table[slot] = { tag, id };
+			firstOf.push_back(i);
+			hashes.push_back(hash);
+			weights.push_back(0.0);
+
+			if (2 * firstOf.size() > table.size()) grow();
+		}
+
+		out.index[i] = id;
+		weights[id] += 1.0;
+	}
+
+	const int M = firstOf.size();
+	out.points = Dataset(M, D);
+	out.weights.assign(weights.begin(), weights.end());
+
+	if (cellSize > 0.0f) {
+		// mean of the points of every cell, so the weighted sum of the cell is the same as the sum of its points
+		std::vector<double> sums((size_t) M * D, 0.0);
+		for (int i = 0; i < N; ++i) {
+			for (int d = 0; d < D; ++d) sums[(size_t) out.index[i] * D + d] += points[i][d];
+		}
+		for (int j = 0; j < M; ++j) {
+			for (int d = 0; d < D; ++d) out.points[j][d] = sums[(size_t) j * D + d] / weights[j];
+		}
+	} else {
+		for (int j = 0; j < M; ++j) std::copy(points[firstOf[j]], points[firstOf[j]] + D, out.points[j]);
+	}
+
+	return out;
+}